@@ -10,3 +10,10 @@ void msleep (unsigned msecs)
 {
 	MsDelay(msecs);
 }
+
+void usleep_range (unsigned long min, unsigned long max)
+{
+	(void) max;
+
+	usDelay(min);
+}
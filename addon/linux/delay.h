@@ -9,6 +9,9 @@ void udelay (unsigned long usecs);
 
 void msleep (unsigned msecs);
 
+// other threads run meanwhile, the delay is not shorter than min
+void usleep_range (unsigned long min, unsigned long max);
+
 #ifdef __cplusplus
 }
 #endif
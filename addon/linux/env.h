@@ -18,6 +18,8 @@ void SchedulerYield ();
 void MsDelay (unsigned nMilliSeconds);
 void usDelay (unsigned nMicroSeconds);
 
+unsigned GetClockTicks (void);		// free running counter in microseconds
+
 typedef void TPeriodicTimerHandler (void);
 void RegisterPeriodicHandler (TPeriodicTimerHandler *pHandler);
 
@@ -13,11 +13,15 @@ extern "C" {
 
 static inline void *kmalloc (size_t size, int flags)
 {
+	(void) flags;
+
 	return qwq_malloc (size);
 }
 
 static inline void *kzalloc (size_t size, int flags)
 {
+	(void) flags;
+
 	void *p = qwq_malloc (size);
 	if (p != 0)
 	{
@@ -40,6 +40,14 @@ void MsDelay (unsigned nMilliSeconds)
 	usDelay(nMilliSeconds * 1000);
 }
 
+unsigned GetClockTicks ()
+{
+	DMB(); DSB();
+	unsigned nTicks = *SYSTMR_CLO;
+	DMB(); DSB();
+	return nTicks;
+}
+
 static TPeriodicTimerHandler *periodic = NULL;
 
 void RegisterPeriodicHandler (TPeriodicTimerHandler *pHandler)
@@ -21,19 +21,16 @@
 
 #include <vc4/vchiq/vchiqdevice.h>
 #include <vc4/sound/vchiqsoundbasedevice.h>
+#include <vc4/sound/soundoscillator.h>
 
-#include <math.h>
 #include <linux/assert.h>
 #include <linux/env.h>
 #include "coroutine.h"
 #include "common.h"
 
-#ifndef M_PI
-#define M_PI 3.1415926535897932384626433832795
-#endif
-
 CVCHIQDevice		    m_VCHIQ;
 CVCHIQSoundBaseDevice   m_VCHIQSound;
+CSoundOscillator	m_Oscillator;
 
 static void Initialize ();
 static void Run ();
@@ -51,17 +48,9 @@ static const char FromKernel[] = "kernel";
 
 unsigned synth(int16_t *buf, unsigned chunk_size)
 {
-	//uint32_t seed = 20191118;
-	static uint8_t phase = 0;
 	static uint32_t count = 0;
-	if (count >= 131072) { count = 0; return 0; }
-	for (unsigned i = 0; i < chunk_size; i += 2) {
-		//seed = ((seed * 1103515245) + 12345) & 0x7fffffff;
-		//buf[i] = (int16_t)(seed & 0xffff);
-		int16_t sample = (int16_t)(32767 * sin(phase / 255.0 * M_PI * 2));
-		buf[i] = buf[i + 1] = sample;
-		phase += 2; // Folds over to 0 ~ 255, generates 344.5 Hz (F4 - ~1/4 semitone)
-	}
+	if (count >= 131072) { count = 0; CSoundOscillator_Reset(&m_Oscillator); return 0; }
+	CSoundOscillator_Render(&m_Oscillator, buf, chunk_size);
 	count += (chunk_size >> 1);
 	return chunk_size;
 }
@@ -142,8 +131,12 @@ void Initialize (void)
 
 	if (bOK)
 	{
-		bOK = CVCHIQDevice_Initialize(&m_VCHIQ);
+		bOK = CVCHIQDevice_Initialize(&m_VCHIQ, 0, 0);
 		CVCHIQSoundBaseDevice_Ctor(&m_VCHIQSound, &m_VCHIQ, 44100, 4000, VCHIQSoundDestinationAuto);
+
+		// 344.5 Hz (F4 - ~1/4 semitone)
+		CSoundOscillator_Ctor(&m_Oscillator, SoundWaveformSine, 44100);
+		CSoundOscillator_SetFrequency(&m_Oscillator, 44100.0f / 128);
 	}
 
 	env_init();
@@ -0,0 +1,404 @@
+//
+// soundadpcm.c
+//
+// Streaming IMA and Microsoft ADPCM decoder, which renders into the chunks
+// of CVCHIQSoundBaseDevice
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundadpcm.h>
+#include <linux/assert.h>
+#include <string.h>
+
+#define WAVE_FORMAT_ADPCM        0x0002
+#define WAVE_FORMAT_IMA_ADPCM        0x0011
+
+static const int16_t s_IMAStepTable[89] =
+{
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t s_IMAIndexTable[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t s_MSCoeff1[7] = {256, 512, 0, 192, 240, 460, 392};
+static const int16_t s_MSCoeff2[7] = {0, -256, 0, 64, 0, -208, -232};
+
+static const int16_t s_MSAdaptationTable[16] =
+{
+    230, 230, 230, 230, 307, 409, 512, 614,
+    768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static inline int Clamp16 (int nValue)
+{
+    if (nValue > 32767)
+    {
+        return 32767;
+    }
+
+    if (nValue < -32768)
+    {
+        return -32768;
+    }
+
+    return nValue;
+}
+
+static inline int GetInt16 (const uint8_t *p)
+{
+    return (int16_t) (p[0] | p[1] << 8);
+}
+
+static inline unsigned GetUInt16 (const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline unsigned GetUInt32 (const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static unsigned GetHeaderSize (enum TSoundADPCMFormat Format, unsigned nChannels)
+{
+    return (Format == SoundADPCMIMA ? 4 : 7) * nChannels;
+}
+
+// number of frames in a block of nBytes bytes (the last block may be shorter)
+static unsigned GetBlockFrames (enum TSoundADPCMFormat Format, unsigned nChannels, unsigned nBytes)
+{
+    unsigned nHeaderSize = GetHeaderSize (Format, nChannels);
+    if (nBytes < nHeaderSize)
+    {
+        return 0;
+    }
+
+    if (Format == SoundADPCMIMA)
+    {
+        // one sample in the header, groups of 8 samples in 4 bytes per channel
+        return (nBytes - nHeaderSize) / (4 * nChannels) * 8 + 1;
+    }
+
+    // two samples in the header, one sample per nibble
+    return (nBytes - nHeaderSize) * 2 / nChannels + 2;
+}
+
+static inline int DecodeIMA (TSoundADPCMChannel *pChannel, unsigned nNibble)
+{
+    int nStep = s_IMAStepTable[pChannel->nStepIndex];
+
+    int nDiff = nStep >> 3;
+    if (nNibble & 4)
+    {
+        nDiff += nStep;
+    }
+    if (nNibble & 2)
+    {
+        nDiff += nStep >> 1;
+    }
+    if (nNibble & 1)
+    {
+        nDiff += nStep >> 2;
+    }
+
+    int nSample = Clamp16 (nNibble & 8 ? pChannel->nSample1 - nDiff : pChannel->nSample1 + nDiff);
+    pChannel->nSample1 = nSample;
+
+    int nIndex = pChannel->nStepIndex + s_IMAIndexTable[nNibble & 7];
+    pChannel->nStepIndex = nIndex < 0 ? 0 : (nIndex > 88 ? 88 : nIndex);
+
+    return nSample;
+}
+
+static inline int DecodeMS (TSoundADPCMChannel *pChannel, unsigned nNibble)
+{
+    int nSigned = nNibble & 8 ? (int) nNibble - 16 : (int) nNibble;
+
+    int nPredictor = (pChannel->nSample1 * pChannel->nCoeff1 + pChannel->nSample2 * pChannel->nCoeff2) >> 8;
+    int nSample = Clamp16 (nPredictor + nSigned * pChannel->nDelta);
+
+    pChannel->nSample2 = pChannel->nSample1;
+    pChannel->nSample1 = nSample;
+
+    int nDelta = (s_MSAdaptationTable[nNibble] * pChannel->nDelta) >> 8;
+    pChannel->nDelta = nDelta < 16 ? 16 : nDelta;
+
+    return nSample;
+}
+
+// reads the block header at m_nBlockOffset, returns FALSE at the end of the data
+static boolean CSoundADPCMDecoder_StartBlock (CSoundADPCMDecoder *_this)
+{
+    if (_this->m_nBlockOffset >= _this->m_nDataSize)
+    {
+        return FALSE;
+    }
+
+    unsigned nBytes = _this->m_nDataSize - _this->m_nBlockOffset;
+    if (nBytes > _this->m_nBlockAlign)
+    {
+        nBytes = _this->m_nBlockAlign;
+    }
+
+    _this->m_nBlockFrames = GetBlockFrames (_this->m_Format, _this->m_nChannels, nBytes);
+    if (_this->m_nBlockFrames == 0)
+    {
+        return FALSE;
+    }
+
+    const uint8_t *pHeader = _this->m_pData + _this->m_nBlockOffset;
+    unsigned nChannels = _this->m_nChannels;
+
+    for (unsigned i = 0; i < nChannels; i++)
+    {
+        TSoundADPCMChannel *pChannel = &_this->m_Channel[i];
+
+        if (_this->m_Format == SoundADPCMIMA)
+        {
+            pChannel->nSample1 = GetInt16 (pHeader + i*4);
+            pChannel->nStepIndex = pHeader[i*4 + 2] > 88 ? 88 : pHeader[i*4 + 2];
+        }
+        else
+        {
+            unsigned nPredictor = pHeader[i] > 6 ? 6 : pHeader[i];
+            pChannel->nCoeff1 = s_MSCoeff1[nPredictor];
+            pChannel->nCoeff2 = s_MSCoeff2[nPredictor];
+            pChannel->nDelta  = GetInt16 (pHeader + nChannels + i*2);
+            pChannel->nSample1 = GetInt16 (pHeader + nChannels*3 + i*2);
+            pChannel->nSample2 = GetInt16 (pHeader + nChannels*5 + i*2);
+        }
+    }
+
+    _this->m_nFrame = 0;
+
+    return TRUE;
+}
+
+// decodes frame m_nFrame of the current block into pOut[0..m_nChannels-1]
+static void CSoundADPCMDecoder_DecodeFrame (CSoundADPCMDecoder *_this, int *pOut)
+{
+    const uint8_t *pData =   _this->m_pData + _this->m_nBlockOffset
+                   + GetHeaderSize (_this->m_Format, _this->m_nChannels);
+    unsigned nChannels = _this->m_nChannels;
+    unsigned nFrame = _this->m_nFrame;
+
+    for (unsigned i = 0; i < nChannels; i++)
+    {
+        TSoundADPCMChannel *pChannel = &_this->m_Channel[i];
+
+        if (_this->m_Format == SoundADPCMIMA)
+        {
+            if (nFrame == 0)
+            {
+                pOut[i] = pChannel->nSample1;
+
+                continue;
+            }
+
+            // groups of 4 bytes per channel, low nibble first
+            unsigned nSample = nFrame - 1;
+            unsigned nByte = (nSample / 8) * 4 * nChannels + i*4 + (nSample % 8) / 2;
+            unsigned nNibble = nSample & 1 ? pData[nByte] >> 4 : pData[nByte] & 0x0F;
+
+            pOut[i] = DecodeIMA (pChannel, nNibble);
+        }
+        else
+        {
+            if (nFrame < 2)
+            {
+                pOut[i] = nFrame == 0 ? pChannel->nSample2 : pChannel->nSample1;
+
+                continue;
+            }
+
+            // nibbles of all channels interleaved, high nibble first
+            unsigned nSample = (nFrame - 2) * nChannels + i;
+            unsigned nNibble = nSample & 1 ? pData[nSample / 2] & 0x0F : pData[nSample / 2] >> 4;
+
+            pOut[i] = DecodeMS (pChannel, nNibble);
+        }
+    }
+
+    _this->m_nFrame++;
+}
+
+void CSoundADPCMDecoder_Ctor (CSoundADPCMDecoder *_this)
+{
+    _this->m_Format = SoundADPCMUnknown;
+    _this->m_pData = 0;
+    _this->m_nDataSize = 0;
+    _this->m_nChannels = 1;
+    _this->m_nBlockAlign = 0;
+    _this->m_bLoop = FALSE;
+    _this->m_nBlockOffset = 0;
+    _this->m_nBlockFrames = 0;
+    _this->m_nFrame = 0;
+}
+
+boolean CSoundADPCMDecoder_Open (CSoundADPCMDecoder *_this, const void *pData, unsigned nDataSize,
+                 enum TSoundADPCMFormat Format, unsigned nChannels, unsigned nBlockAlign)
+{
+    if (   pData == 0
+        || Format >= SoundADPCMUnknown
+        || !(nChannels == 1 || nChannels == 2)
+        || GetBlockFrames (Format, nChannels, nBlockAlign) < 2)
+    {
+        return FALSE;
+    }
+
+    _this->m_Format = Format;
+    _this->m_pData = (const uint8_t *) pData;
+    _this->m_nDataSize = nDataSize;
+    _this->m_nChannels = nChannels;
+    _this->m_nBlockAlign = nBlockAlign;
+
+    CSoundADPCMDecoder_Rewind (_this);
+
+    return TRUE;
+}
+
+boolean CSoundADPCMDecoder_OpenWAVE (CSoundADPCMDecoder *_this, const void *pWAVE, unsigned nSize)
+{
+    const uint8_t *pFile = (const uint8_t *) pWAVE;
+    if (   pFile == 0
+        || nSize < 12
+        || memcmp (pFile, "RIFF", 4) != 0
+        || memcmp (pFile + 8, "WAVE", 4) != 0)
+    {
+        return FALSE;
+    }
+
+    enum TSoundADPCMFormat Format = SoundADPCMUnknown;
+    unsigned nChannels = 0;
+    unsigned nBlockAlign = 0;
+
+    for (unsigned nOffset = 12; nOffset + 8 <= nSize;)
+    {
+        const uint8_t *pChunk = pFile + nOffset;
+        unsigned nChunkSize = GetUInt32 (pChunk + 4);
+        if (nChunkSize > nSize - nOffset - 8)
+        {
+            nChunkSize = nSize - nOffset - 8;
+        }
+
+        if (   memcmp (pChunk, "fmt ", 4) == 0
+            && nChunkSize >= 16)
+        {
+            switch (GetUInt16 (pChunk + 8))
+            {
+            case WAVE_FORMAT_IMA_ADPCM:    Format = SoundADPCMIMA;        break;
+            case WAVE_FORMAT_ADPCM:        Format = SoundADPCMMicrosoft;    break;
+            default:            return FALSE;
+            }
+
+            nChannels = GetUInt16 (pChunk + 10);
+            nBlockAlign = GetUInt16 (pChunk + 20);
+        }
+        else if (memcmp (pChunk, "data", 4) == 0)
+        {
+            if (Format == SoundADPCMUnknown)
+            {
+                return FALSE;
+            }
+
+            return CSoundADPCMDecoder_Open (_this, pChunk + 8, nChunkSize, Format,
+                            nChannels, nBlockAlign);
+        }
+
+        // chunks are padded to an even size
+        nOffset += 8 + ((nChunkSize + 1) & ~1U);
+    }
+
+    return FALSE;
+}
+
+void CSoundADPCMDecoder_SetLoop (CSoundADPCMDecoder *_this, boolean bLoop)
+{
+    _this->m_bLoop = bLoop;
+}
+
+void CSoundADPCMDecoder_Rewind (CSoundADPCMDecoder *_this)
+{
+    _this->m_nBlockOffset = 0;
+    _this->m_nBlockFrames = 0;
+    _this->m_nFrame = 0;
+
+    if (_this->m_pData != 0)
+    {
+        CSoundADPCMDecoder_StartBlock (_this);
+    }
+}
+
+unsigned CSoundADPCMDecoder_Render (CSoundADPCMDecoder *_this, int16_t *pBuffer, unsigned nChunkSize)
+{
+    assert (pBuffer != 0);
+    assert ((nChunkSize & 1) == 0);
+
+    unsigned nFrames = nChunkSize / 2;
+    unsigned nDone = 0;
+
+    while (nDone < nFrames)
+    {
+        if (_this->m_nFrame >= _this->m_nBlockFrames)
+        {
+            if (_this->m_nBlockOffset < _this->m_nDataSize)
+            {
+                _this->m_nBlockOffset += _this->m_nBlockAlign;
+            }
+
+            if (!CSoundADPCMDecoder_StartBlock (_this))
+            {
+                if (!_this->m_bLoop)
+                {
+                    break;
+                }
+
+                _this->m_nBlockOffset = 0;
+                if (!CSoundADPCMDecoder_StartBlock (_this))
+                {
+                    break;
+                }
+            }
+        }
+
+        // decode the rest of the block or the chunk, whichever is shorter
+        unsigned nBlockFrames = _this->m_nBlockFrames - _this->m_nFrame;
+        if (nBlockFrames > nFrames - nDone)
+        {
+            nBlockFrames = nFrames - nDone;
+        }
+
+        int Frame[2];
+        for (unsigned i = 0; i < nBlockFrames; i++)
+        {
+            CSoundADPCMDecoder_DecodeFrame (_this, Frame);
+
+            pBuffer[0] = (int16_t) Frame[0];
+            pBuffer[1] = (int16_t) Frame[_this->m_nChannels - 1];
+            pBuffer += 2;
+        }
+
+        nDone += nBlockFrames;
+    }
+
+    return nDone * 2;
+}
@@ -0,0 +1,100 @@
+//
+// soundadpcm.h
+//
+// Streaming IMA and Microsoft ADPCM decoder, which renders into the chunks
+// of CVCHIQSoundBaseDevice
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundadpcm_h
+#define _vc4_sound_soundadpcm_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <linux/types.h>
+
+enum TSoundADPCMFormat
+{
+    SoundADPCMIMA,            ///< IMA/DVI ADPCM as in WAVE files (format tag 0x11)
+    SoundADPCMMicrosoft,        ///< Microsoft ADPCM (format tag 0x02), standard coefficients
+    SoundADPCMUnknown
+};
+
+typedef struct TSoundADPCMChannel
+{
+    int nSample1;            // last sample
+    int nSample2;            // sample before (Microsoft only)
+    int nStepIndex;            // IMA only
+    int nDelta;                // Microsoft only
+    int nCoeff1;            // Microsoft only
+    int nCoeff2;            // Microsoft only
+}
+TSoundADPCMChannel;
+
+typedef struct CSoundADPCMDecoder
+{
+    enum TSoundADPCMFormat m_Format;
+    const uint8_t *m_pData;        // encoded data, stays encoded in memory
+    unsigned m_nDataSize;
+    unsigned m_nChannels;        // 1 or 2
+    unsigned m_nBlockAlign;        // bytes per block
+    boolean m_bLoop;
+
+    unsigned m_nBlockOffset;        // of the current block in m_pData
+    unsigned m_nBlockFrames;        // number of frames in the current block
+    unsigned m_nFrame;            // next frame in the current block
+    TSoundADPCMChannel m_Channel[2];
+}
+CSoundADPCMDecoder;
+
+void CSoundADPCMDecoder_Ctor (CSoundADPCMDecoder *_this);
+
+/// \brief Sets the encoded data to be played
+/// \param pData    ADPCM blocks, must stay valid while playing
+/// \param nDataSize    size of the data in bytes (the last block may be shorter)
+/// \param Format    ADPCM variant
+/// \param nChannels    1 (mono, duplicated on output) or 2 (stereo)
+/// \param nBlockAlign    size of one block in bytes
+/// \return Are the parameters valid?
+boolean CSoundADPCMDecoder_Open (CSoundADPCMDecoder *_this, const void *pData, unsigned nDataSize,
+                 enum TSoundADPCMFormat Format, unsigned nChannels, unsigned nBlockAlign);
+
+/// \brief Sets the encoded data from an image of a WAVE file
+/// \param pWAVE    RIFF/WAVE file image, must stay valid while playing
+/// \param nSize    size of the image in bytes
+/// \return Is the file an IMA or Microsoft ADPCM WAVE file?
+/// \note The sample rate of the file is not checked.
+boolean CSoundADPCMDecoder_OpenWAVE (CSoundADPCMDecoder *_this, const void *pWAVE, unsigned nSize);
+
+/// \param bLoop    restart at the beginning, when the end of the data is reached?
+void CSoundADPCMDecoder_SetLoop (CSoundADPCMDecoder *_this, boolean bLoop);
+
+/// \brief Restarts at the beginning of the data
+void CSoundADPCMDecoder_Rewind (CSoundADPCMDecoder *_this);
+
+/// \brief Decodes the next frames into an interleaved stereo buffer
+/// \param pBuffer    the frames are written here
+/// \param nChunkSize    number of words in pBuffer (must be even)
+/// \return Number of words written (< nChunkSize at the end of the data without loop)
+/// \note Has the semantics of chunk_cb_t, decoding stops and resumes anywhere inside a block.
+unsigned CSoundADPCMDecoder_Render (CSoundADPCMDecoder *_this, int16_t *pBuffer, unsigned nChunkSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
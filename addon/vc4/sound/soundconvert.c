@@ -0,0 +1,175 @@
+//
+// soundconvert.c
+//
+// Conversion of sample formats to the 16-bit stereo format of the VCHIQ
+// audio service
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundconvert.h>
+#include <linux/assert.h>
+#include <string.h>
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+    #define SOUND_CONVERT_NEON
+    #include <arm_neon.h>
+#endif
+
+static inline int16_t GetSample (const void *pIn, unsigned nIndex, enum TSoundFormat Format)
+{
+    switch (Format)
+    {
+    case SoundFormatUnsigned8:
+        return (int16_t) (((int) ((const uint8_t *) pIn)[nIndex] - 128) << 8);
+
+    case SoundFormatSigned16:
+        return ((const int16_t *) pIn)[nIndex];
+
+    case SoundFormatSigned24: {
+        const uint8_t *pSample = (const uint8_t *) pIn + nIndex * 3;
+        return (int16_t) (pSample[1] | pSample[2] << 8);
+        }
+
+    case SoundFormatSigned32:
+        return (int16_t) (((const int32_t *) pIn)[nIndex] >> 16);
+
+    case SoundFormatFloat32: {
+        float fSample = ((const float *) pIn)[nIndex] * 32768.0f;
+        if (fSample >= 32767.0f)
+        {
+            return 32767;
+        }
+        if (fSample <= -32768.0f)
+        {
+            return -32768;
+        }
+        return (int16_t) fSample;
+        }
+
+    default:
+        assert (0);
+        return 0;
+    }
+}
+
+#ifdef SOUND_CONVERT_NEON
+
+// stores 8 mono samples as 8 stereo frames
+static inline void StoreMono (int16_t *pOut, int16x8_t Samples)
+{
+    int16x8x2_t Stereo = vzipq_s16 (Samples, Samples);
+    vst1q_s16 (pOut, Stereo.val[0]);
+    vst1q_s16 (pOut + 8, Stereo.val[1]);
+}
+
+// loads 8 samples, returns the number of samples loaded (0 for no NEON kernel)
+static inline unsigned Load8 (int16x8_t *pSamples, const void *pIn, enum TSoundFormat Format)
+{
+    switch (Format)
+    {
+    case SoundFormatUnsigned8: {
+        uint8x8_t In = veor_u8 (vld1_u8 ((const uint8_t *) pIn), vdup_n_u8 (0x80));
+        *pSamples = vreinterpretq_s16_u16 (vshll_n_u8 (In, 8));
+        } return 8;
+
+    case SoundFormatSigned16:
+        *pSamples = vld1q_s16 ((const int16_t *) pIn);
+        return 8;
+
+    case SoundFormatSigned24: {
+        uint8x8x3_t In = vld3_u8 ((const uint8_t *) pIn);
+        uint8x8x2_t Zip = vzip_u8 (In.val[1], In.val[2]);
+        *pSamples = vreinterpretq_s16_u8 (vcombine_u8 (Zip.val[0], Zip.val[1]));
+        } return 8;
+
+    case SoundFormatSigned32: {
+        const int32_t *pIn32 = (const int32_t *) pIn;
+        *pSamples = vcombine_s16 (vshrn_n_s32 (vld1q_s32 (pIn32), 16),
+                      vshrn_n_s32 (vld1q_s32 (pIn32 + 4), 16));
+        } return 8;
+
+    case SoundFormatFloat32: {
+        const float *pInF = (const float *) pIn;
+        *pSamples = vcombine_s16 (vqmovn_s32 (vcvtq_n_s32_f32 (vld1q_f32 (pInF), 15)),
+                      vqmovn_s32 (vcvtq_n_s32_f32 (vld1q_f32 (pInF + 4), 15)));
+        } return 8;
+
+    default:
+        return 0;
+    }
+}
+
+#endif
+
+unsigned SoundConvertGetFrameSize (enum TSoundFormat Format, unsigned nChannels)
+{
+    static const unsigned SampleSize[SoundFormatUnknown] = {1, 2, 3, 4, 4};
+
+    assert (Format < SoundFormatUnknown);
+    assert (nChannels == 1 || nChannels == 2);
+
+    return SampleSize[Format] * nChannels;
+}
+
+void SoundConvertToStereo16 (int16_t *pOut, const void *pIn, unsigned nFrames,
+                 enum TSoundFormat Format, unsigned nChannels)
+{
+    assert (pOut != 0);
+    assert (pIn != 0);
+    assert (Format < SoundFormatUnknown);
+    assert (nChannels == 1 || nChannels == 2);
+
+    if (   Format == SoundFormatSigned16
+        && nChannels == 2)
+    {
+        memcpy (pOut, pIn, nFrames * 2 * sizeof (int16_t));
+
+        return;
+    }
+
+    const uint8_t *pIn8 = (const uint8_t *) pIn;
+
+#ifdef SOUND_CONVERT_NEON
+    unsigned nFrameSize = SoundConvertGetFrameSize (Format, nChannels);
+
+    if (nChannels == 1)
+    {
+        int16x8_t Samples;
+        for (; nFrames >= 8 && Load8 (&Samples, pIn8, Format); nFrames -= 8)
+        {
+            StoreMono (pOut, Samples);
+            pIn8 += 8 * nFrameSize;
+            pOut += 16;
+        }
+    }
+    else
+    {
+        int16x8_t Samples;
+        for (; nFrames >= 4 && Load8 (&Samples, pIn8, Format); nFrames -= 4)
+        {
+            vst1q_s16 (pOut, Samples);
+            pIn8 += 4 * nFrameSize;
+            pOut += 8;
+        }
+    }
+#endif
+
+    for (unsigned i = 0; i < nFrames; i++)
+    {
+        int16_t nLeft = GetSample (pIn8, i * nChannels, Format);
+
+        *pOut++ = nLeft;
+        *pOut++ = nChannels == 2 ? GetSample (pIn8, i * 2 + 1, Format) : nLeft;
+    }
+}
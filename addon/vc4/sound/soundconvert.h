@@ -0,0 +1,56 @@
+//
+// soundconvert.h
+//
+// Conversion of sample formats to the 16-bit stereo format of the VCHIQ
+// audio service
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundconvert_h
+#define _vc4_sound_soundconvert_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+enum TSoundFormat
+{
+    SoundFormatUnsigned8,        ///< 8-bit unsigned
+    SoundFormatSigned16,        ///< 16-bit signed, little endian
+    SoundFormatSigned24,        ///< 24-bit signed, packed into 3 bytes, little endian
+    SoundFormatSigned32,        ///< 32-bit signed, little endian
+    SoundFormatFloat32,            ///< 32-bit float, -1.0..1.0
+    SoundFormatUnknown
+};
+
+/// \return Size of one frame (one sample for each channel) in bytes
+unsigned SoundConvertGetFrameSize (enum TSoundFormat Format, unsigned nChannels);
+
+/// \brief Converts sound data to interleaved 16-bit stereo
+/// \param pOut        destination buffer (nFrames * 2 words)
+/// \param pIn        source data, samples must be aligned to their natural size
+/// \param nFrames    number of frames to be converted
+/// \param Format    format of the source samples
+/// \param nChannels    number of source channels (1 or 2, mono is duplicated)
+/// \note Uses NEON on RASPPI >= 2, values out of range are saturated.
+void SoundConvertToStereo16 (int16_t *pOut, const void *pIn, unsigned nFrames,
+                 enum TSoundFormat Format, unsigned nChannels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+//
+// soundgain.c
+//
+// Software gain stage with sample-accurate ramps for interleaved 16-bit
+// stereo data
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundgain.h>
+#include <linux/assert.h>
+#include <linux/barrier.h>
+#include <math.h>
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+    #define SOUND_GAIN_NEON
+    #include <arm_neon.h>
+#endif
+
+#define GAIN_Q31(gain)        ((int32_t) (gain) << 16)
+#define GAIN_UNITY        GAIN_Q31 (SOUND_GAIN_UNITY)
+#define GAIN_FLOOR        (GAIN_UNITY / 1000)    // -60 dB, exponential ramps start/end here
+
+#define SEGMENT_FRAMES        16            // exponential ramps are linear in between
+#define RATIO_SHIFT        20
+
+static inline int16_t Saturate (int nValue)
+{
+    if (nValue > 32767)
+    {
+        return 32767;
+    }
+
+    if (nValue < -32768)
+    {
+        return -32768;
+    }
+
+    return (int16_t) nValue;
+}
+
+// applies a linear ramp starting at nGain to nFrames frames, returns the gain after the last frame
+static int32_t ApplyRamp (int16_t *pOut, const int16_t *pIn, unsigned nFrames, int32_t nGain, int32_t nStep,
+               int bMix)
+{
+#ifdef SOUND_GAIN_NEON
+    if (nFrames >= 4)
+    {
+        // one lane per frame, the Q15 gains are duplicated for both channels
+        int32_t Lanes[4] = {nGain, nGain + nStep, nGain + 2*nStep, nGain + 3*nStep};
+        int32x4_t Gain = vld1q_s32 (Lanes);
+        int32x4_t Step = vdupq_n_s32 (4*nStep);
+
+        for (; nFrames >= 4; nFrames -= 4)
+        {
+            int16x4_t Gain16 = vshrn_n_s32 (Gain, 16);
+            int16x4x2_t Gains = vzip_s16 (Gain16, Gain16);
+
+            int16x8_t Out = vqrdmulhq_s16 (vld1q_s16 (pIn), vcombine_s16 (Gains.val[0], Gains.val[1]));
+            if (bMix)
+            {
+                Out = vqaddq_s16 (vld1q_s16 (pOut), Out);
+            }
+
+            vst1q_s16 (pOut, Out);
+            pIn += 8;
+            pOut += 8;
+
+            Gain = vaddq_s32 (Gain, Step);
+        }
+
+        nGain = vgetq_lane_s32 (Gain, 0);
+    }
+#endif
+
+    for (; nFrames > 0; nFrames--)
+    {
+        int nGain15 = nGain >> 16;
+        int nLeft  = (pIn[0] * nGain15 + 0x4000) >> 15;
+        int nRight = (pIn[1] * nGain15 + 0x4000) >> 15;
+
+        if (bMix)
+        {
+            pOut[0] = Saturate (pOut[0] + nLeft);
+            pOut[1] = Saturate (pOut[1] + nRight);
+        }
+        else
+        {
+            pOut[0] = (int16_t) nLeft;
+            pOut[1] = (int16_t) nRight;
+        }
+
+        pIn += 2;
+        pOut += 2;
+
+        nGain += nStep;
+    }
+
+    return nGain;
+}
+
+static void CSoundGain_StartSegment (CSoundGain *_this)
+{
+    assert (_this->m_nFramesLeft > 0);
+
+    unsigned nFrames = _this->m_nFramesLeft;
+    int32_t nEnd = _this->m_nTarget;
+
+    if (   _this->m_Ramp == SoundRampExponential
+        && nFrames > SEGMENT_FRAMES)
+    {
+        nFrames = SEGMENT_FRAMES;
+
+        uint64_t nNext = ((uint64_t) _this->m_nGain * _this->m_nRatio) >> RATIO_SHIFT;
+        nEnd = nNext < GAIN_UNITY ? (int32_t) nNext : GAIN_UNITY;
+    }
+
+    _this->m_nSegmentLeft = nFrames;
+    _this->m_nStep = (int32_t) (((int64_t) nEnd - _this->m_nGain) / (int) nFrames);
+}
+
+static void CSoundGain_Apply (CSoundGain *_this, int16_t *pOut, const int16_t *pIn, unsigned nChunkSize,
+                  int bMix)
+{
+    assert (pOut != 0);
+    assert (pIn != 0);
+    assert ((nChunkSize & 1) == 0);
+
+    unsigned nFrames = nChunkSize / 2;
+    while (nFrames > 0)
+    {
+        if (_this->m_nFramesLeft == 0)
+        {
+            if (   _this->m_nGain != GAIN_UNITY
+                || bMix)
+            {
+                ApplyRamp (pOut, pIn, nFrames, _this->m_nGain, 0, bMix);
+            }
+
+            return;
+        }
+
+        if (_this->m_nSegmentLeft == 0)
+        {
+            CSoundGain_StartSegment (_this);
+        }
+
+        unsigned nSegmentFrames = nFrames < _this->m_nSegmentLeft ? nFrames : _this->m_nSegmentLeft;
+
+        _this->m_nGain = ApplyRamp (pOut, pIn, nSegmentFrames, _this->m_nGain, _this->m_nStep, bMix);
+
+        _this->m_nSegmentLeft -= nSegmentFrames;
+        _this->m_nFramesLeft -= nSegmentFrames;
+        if (_this->m_nFramesLeft == 0)
+        {
+            // remove the rounding error of the steps
+            _this->m_nGain = _this->m_nTarget;
+        }
+
+        pOut += nSegmentFrames * 2;
+        pIn += nSegmentFrames * 2;
+        nFrames -= nSegmentFrames;
+    }
+}
+
+void CSoundGain_Ctor (CSoundGain *_this, unsigned nGain)
+{
+    _this->m_Ramp = SoundRampLinear;
+    _this->m_nRatio = 1 << RATIO_SHIFT;
+    _this->m_nSegmentLeft = 0;
+    _this->m_nStep = 0;
+
+    CSoundGain_SetGain (_this, nGain);
+}
+
+void CSoundGain_SetGain (CSoundGain *_this, unsigned nGain)
+{
+    if (nGain > SOUND_GAIN_UNITY)
+    {
+        nGain = SOUND_GAIN_UNITY;
+    }
+
+    _this->m_nFramesLeft = 0;
+    _this->m_nGain = GAIN_Q31 (nGain);
+    _this->m_nTarget = _this->m_nGain;
+}
+
+void CSoundGain_Ramp (CSoundGain *_this, unsigned nTargetGain, unsigned nFrames, enum TSoundRamp Ramp)
+{
+    assert (Ramp < SoundRampUnknown);
+
+    if (nFrames == 0)
+    {
+        CSoundGain_SetGain (_this, nTargetGain);
+
+        return;
+    }
+
+    if (nTargetGain > SOUND_GAIN_UNITY)
+    {
+        nTargetGain = SOUND_GAIN_UNITY;
+    }
+
+    // stop a running ramp, before the parameters are modified
+    _this->m_nFramesLeft = 0;
+    _this->m_nTarget = GAIN_Q31 (nTargetGain);
+    _this->m_Ramp = Ramp;
+    _this->m_nSegmentLeft = 0;
+
+    if (Ramp == SoundRampExponential)
+    {
+        if (_this->m_nGain < GAIN_FLOOR)
+        {
+            _this->m_nGain = GAIN_FLOOR;
+        }
+
+        int32_t nEnd = _this->m_nTarget > GAIN_FLOOR ? _this->m_nTarget : GAIN_FLOOR;
+
+        double fRatio = pow ((double) nEnd / _this->m_nGain, (double) SEGMENT_FRAMES / nFrames);
+        fRatio *= 1 << RATIO_SHIFT;
+        _this->m_nRatio = fRatio < 4294967295.0 ? (uint32_t) fRatio : 0xFFFFFFFF;
+    }
+
+    wmb ();
+    _this->m_nFramesLeft = nFrames;
+}
+
+unsigned CSoundGain_GetGain (CSoundGain *_this)
+{
+    return _this->m_nGain >> 16;
+}
+
+boolean CSoundGain_IsRamping (CSoundGain *_this)
+{
+    return _this->m_nFramesLeft > 0;
+}
+
+void CSoundGain_Process (CSoundGain *_this, int16_t *pBuffer, unsigned nChunkSize)
+{
+    CSoundGain_Apply (_this, pBuffer, pBuffer, nChunkSize, 0);
+}
+
+void CSoundGain_Mix (CSoundGain *_this, int16_t *pOut, const int16_t *pIn, unsigned nChunkSize)
+{
+    CSoundGain_Apply (_this, pOut, pIn, nChunkSize, 1);
+}
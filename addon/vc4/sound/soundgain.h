@@ -0,0 +1,86 @@
+//
+// soundgain.h
+//
+// Software gain stage with sample-accurate ramps for interleaved 16-bit
+// stereo data
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundgain_h
+#define _vc4_sound_soundgain_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <linux/types.h>
+
+#define SOUND_GAIN_UNITY        32767        // Q15
+
+enum TSoundRamp
+{
+    SoundRampLinear,            ///< constant step per frame
+    SoundRampExponential,        ///< constant step in dB per frame (from/to -60 dB at zero)
+    SoundRampUnknown
+};
+
+typedef struct CSoundGain
+{
+    int32_t m_nGain;            // current gain (Q31)
+    int32_t m_nTarget;            // at the end of the ramp (Q31)
+    enum TSoundRamp m_Ramp;
+    uint32_t m_nRatio;            // exponential: gain factor per segment (Q20)
+
+    unsigned m_nFramesLeft;        // until the end of the ramp
+    unsigned m_nSegmentLeft;        // until the end of the linear segment
+    int32_t m_nStep;            // per frame in the current segment (Q31)
+}
+CSoundGain;
+
+/// \param nGain    initial gain (0..SOUND_GAIN_UNITY)
+void CSoundGain_Ctor (CSoundGain *_this, unsigned nGain);
+
+/// \brief Sets the gain immediately, a running ramp is stopped
+void CSoundGain_SetGain (CSoundGain *_this, unsigned nGain);
+
+/// \brief Starts a ramp from the current gain
+/// \param nTargetGain    gain at the end of the ramp (0..SOUND_GAIN_UNITY)
+/// \param nFrames    length of the ramp in frames (0 to set the gain immediately)
+/// \param Ramp        shape of the ramp
+/// \note Calculates the ramp parameters, must not be called from the slot handler.
+void CSoundGain_Ramp (CSoundGain *_this, unsigned nTargetGain, unsigned nFrames, enum TSoundRamp Ramp);
+
+/// \return Current gain (0..SOUND_GAIN_UNITY)
+unsigned CSoundGain_GetGain (CSoundGain *_this);
+
+/// \return Is a ramp still running?
+boolean CSoundGain_IsRamping (CSoundGain *_this);
+
+/// \brief Applies the gain to an interleaved stereo buffer in place
+/// \param nChunkSize    number of words in pBuffer (must be even)
+/// \note Returns at once with unity gain, uses NEON on RASPPI >= 2.
+void CSoundGain_Process (CSoundGain *_this, int16_t *pBuffer, unsigned nChunkSize);
+
+/// \brief Applies the gain to pIn and adds the result to pOut, the sums are saturated
+/// \param nChunkSize    number of words in pIn and pOut (must be even)
+/// \note A crossfade uses two gain stages ramping in opposite directions, the first one\n
+///       is applied with CSoundGain_Process(), the second one with CSoundGain_Mix().
+void CSoundGain_Mix (CSoundGain *_this, int16_t *pOut, const int16_t *pIn, unsigned nChunkSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+//
+// soundmixer.c
+//
+// Software mixer for sound effects, which renders into the chunks of
+// CVCHIQSoundBaseDevice
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundmixer.h>
+#include <linux/assert.h>
+#include <linux/barrier.h>
+#include <string.h>
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+    #define SOUND_MIXER_NEON
+    #include <arm_neon.h>
+#elif RASPPI == 1
+    #define SOUND_MIXER_ARMV6
+#endif
+
+// Q15 multiplication with rounding
+#define GAIN(sample, gain)    (((int) (sample) * (gain) + 0x4000) >> 15)
+
+#ifdef SOUND_MIXER_ARMV6
+
+// adds both 16-bit halves with signed saturation
+static inline uint32_t qadd16 (uint32_t nOp1, uint32_t nOp2)
+{
+    uint32_t nResult;
+    asm ("qadd16 %0, %1, %2" : "=r" (nResult) : "r" (nOp1), "r" (nOp2));
+    return nResult;
+}
+
+static inline void MixFrame (int16_t *pOut, int nLeft, int nRight)
+{
+    uint32_t nOut = (uint16_t) pOut[0] | (uint32_t) (uint16_t) pOut[1] << 16;
+    nOut = qadd16 (nOut, (uint16_t) nLeft | (uint32_t) (uint16_t) nRight << 16);
+    pOut[0] = (int16_t) nOut;
+    pOut[1] = (int16_t) (nOut >> 16);
+}
+
+#else
+
+static inline int16_t Saturate (int nValue)
+{
+    if (nValue > 32767)
+    {
+        return 32767;
+    }
+
+    if (nValue < -32768)
+    {
+        return -32768;
+    }
+
+    return (int16_t) nValue;
+}
+
+static inline void MixFrame (int16_t *pOut, int nLeft, int nRight)
+{
+    pOut[0] = Saturate (pOut[0] + nLeft);
+    pOut[1] = Saturate (pOut[1] + nRight);
+}
+
+#endif
+
+static void MixMono (int16_t *pOut, const int16_t *pIn, unsigned nFrames,
+             int16_t nGainLeft, int16_t nGainRight)
+{
+#ifdef SOUND_MIXER_NEON
+    for (; nFrames >= 8; nFrames -= 8)
+    {
+        int16x8_t In = vld1q_s16 (pIn);
+        pIn += 8;
+
+        int16x8x2_t Stereo = vzipq_s16 (vqrdmulhq_n_s16 (In, nGainLeft),
+                        vqrdmulhq_n_s16 (In, nGainRight));
+
+        vst1q_s16 (pOut,     vqaddq_s16 (vld1q_s16 (pOut),     Stereo.val[0]));
+        vst1q_s16 (pOut + 8, vqaddq_s16 (vld1q_s16 (pOut + 8), Stereo.val[1]));
+        pOut += 16;
+    }
+#endif
+
+    for (; nFrames > 0; nFrames--)
+    {
+        int16_t nSample = *pIn++;
+        MixFrame (pOut, GAIN (nSample, nGainLeft), GAIN (nSample, nGainRight));
+        pOut += 2;
+    }
+}
+
+static void MixStereo (int16_t *pOut, const int16_t *pIn, unsigned nFrames,
+               int16_t nGainLeft, int16_t nGainRight)
+{
+#ifdef SOUND_MIXER_NEON
+    int16x4x2_t Gain = vzip_s16 (vdup_n_s16 (nGainLeft), vdup_n_s16 (nGainRight));
+    int16x8_t Gains = vcombine_s16 (Gain.val[0], Gain.val[0]);
+
+    for (; nFrames >= 4; nFrames -= 4)
+    {
+        int16x8_t In = vqrdmulhq_s16 (vld1q_s16 (pIn), Gains);
+        pIn += 8;
+
+        vst1q_s16 (pOut, vqaddq_s16 (vld1q_s16 (pOut), In));
+        pOut += 8;
+    }
+#endif
+
+    for (; nFrames > 0; nFrames--)
+    {
+        MixFrame (pOut, GAIN (pIn[0], nGainLeft), GAIN (pIn[1], nGainRight));
+        pIn += 2;
+        pOut += 2;
+    }
+}
+
+static void CSoundMixer_SetGains (TSoundMixerVoice *pVoice, unsigned nGain, int nPan)
+{
+    if (nGain > SOUND_MIXER_GAIN_UNITY)
+    {
+        nGain = SOUND_MIXER_GAIN_UNITY;
+    }
+
+    if (nPan < SOUND_MIXER_PAN_LEFT)
+    {
+        nPan = SOUND_MIXER_PAN_LEFT;
+    }
+    else if (nPan > SOUND_MIXER_PAN_RIGHT)
+    {
+        nPan = SOUND_MIXER_PAN_RIGHT;
+    }
+
+    // balance law: the centered voice plays with full gain on both sides
+    unsigned nLeft  = nPan > 0 ? SOUND_MIXER_PAN_RIGHT - nPan : SOUND_MIXER_PAN_RIGHT;
+    unsigned nRight = nPan < 0 ? SOUND_MIXER_PAN_RIGHT + nPan : SOUND_MIXER_PAN_RIGHT;
+
+    pVoice->nGainLeft  = (int16_t) (nGain * nLeft / SOUND_MIXER_PAN_RIGHT);
+    pVoice->nGainRight = (int16_t) (nGain * nRight / SOUND_MIXER_PAN_RIGHT);
+}
+
+void CSoundMixer_Ctor (CSoundMixer *_this)
+{
+    memset (_this->m_Voice, 0, sizeof _this->m_Voice);
+}
+
+int CSoundMixer_Play (CSoundMixer *_this, const int16_t *pSamples, unsigned nFrames,
+              unsigned nChannels, unsigned nGain, int nPan, boolean bLoop)
+{
+    assert (pSamples != 0);
+    assert (nChannels == 1 || nChannels == 2);
+
+    if (nFrames == 0)
+    {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < SOUND_MIXER_MAX_VOICES; i++)
+    {
+        TSoundMixerVoice *pVoice = &_this->m_Voice[i];
+        if (pVoice->bActive)
+        {
+            continue;
+        }
+
+        pVoice->pSamples = pSamples;
+        pVoice->nFrames = nFrames;
+        pVoice->nChannels = nChannels;
+        pVoice->bLoop = bLoop;
+        pVoice->nPosition = 0;
+        CSoundMixer_SetGains (pVoice, nGain, nPan);
+
+        // the voice must be complete, before it is seen by CSoundMixer_Render()
+        wmb ();
+        pVoice->bActive = TRUE;
+
+        return i;
+    }
+
+    return -1;
+}
+
+void CSoundMixer_Stop (CSoundMixer *_this, int nVoice)
+{
+    assert (0 <= nVoice && nVoice < SOUND_MIXER_MAX_VOICES);
+
+    _this->m_Voice[nVoice].bActive = FALSE;
+}
+
+void CSoundMixer_StopAll (CSoundMixer *_this)
+{
+    for (unsigned i = 0; i < SOUND_MIXER_MAX_VOICES; i++)
+    {
+        _this->m_Voice[i].bActive = FALSE;
+    }
+}
+
+boolean CSoundMixer_IsPlaying (CSoundMixer *_this, int nVoice)
+{
+    assert (0 <= nVoice && nVoice < SOUND_MIXER_MAX_VOICES);
+
+    return _this->m_Voice[nVoice].bActive;
+}
+
+void CSoundMixer_SetVolume (CSoundMixer *_this, int nVoice, unsigned nGain, int nPan)
+{
+    assert (0 <= nVoice && nVoice < SOUND_MIXER_MAX_VOICES);
+
+    CSoundMixer_SetGains (&_this->m_Voice[nVoice], nGain, nPan);
+}
+
+unsigned CSoundMixer_Render (CSoundMixer *_this, int16_t *pBuffer, unsigned nChunkSize)
+{
+    assert (pBuffer != 0);
+    assert ((nChunkSize & 1) == 0);
+
+    memset (pBuffer, 0, nChunkSize * sizeof (int16_t));
+
+    unsigned nFramesOut = nChunkSize / 2;
+
+    for (unsigned i = 0; i < SOUND_MIXER_MAX_VOICES; i++)
+    {
+        TSoundMixerVoice *pVoice = &_this->m_Voice[i];
+        if (!pVoice->bActive)
+        {
+            continue;
+        }
+
+        rmb ();
+
+        unsigned nDone = 0;
+        while (nDone < nFramesOut)
+        {
+            unsigned nFrames = pVoice->nFrames - pVoice->nPosition;
+            if (nFrames > nFramesOut - nDone)
+            {
+                nFrames = nFramesOut - nDone;
+            }
+
+            const int16_t *pIn = pVoice->pSamples + pVoice->nPosition * pVoice->nChannels;
+            if (pVoice->nChannels == 1)
+            {
+                MixMono (pBuffer + nDone*2, pIn, nFrames, pVoice->nGainLeft, pVoice->nGainRight);
+            }
+            else
+            {
+                MixStereo (pBuffer + nDone*2, pIn, nFrames, pVoice->nGainLeft, pVoice->nGainRight);
+            }
+
+            nDone += nFrames;
+            pVoice->nPosition += nFrames;
+
+            if (pVoice->nPosition == pVoice->nFrames)
+            {
+                if (!pVoice->bLoop)
+                {
+                    pVoice->bActive = FALSE;
+
+                    break;
+                }
+
+                pVoice->nPosition = 0;
+            }
+        }
+    }
+
+    return nChunkSize;
+}
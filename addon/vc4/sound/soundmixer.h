@@ -0,0 +1,91 @@
+//
+// soundmixer.h
+//
+// Software mixer for sound effects, which renders into the chunks of
+// CVCHIQSoundBaseDevice
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundmixer_h
+#define _vc4_sound_soundmixer_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <linux/types.h>
+
+#define SOUND_MIXER_MAX_VOICES        32
+
+#define SOUND_MIXER_GAIN_UNITY        32767        // Q15
+#define SOUND_MIXER_PAN_LEFT        -32767
+#define SOUND_MIXER_PAN_CENTER        0
+#define SOUND_MIXER_PAN_RIGHT        32767
+
+typedef struct TSoundMixerVoice
+{
+    volatile boolean bActive;
+
+    const int16_t *pSamples;
+    unsigned nFrames;
+    unsigned nChannels;            // 1 or 2
+    boolean bLoop;
+
+    unsigned nPosition;            // next frame
+    int16_t nGainLeft;            // Q15
+    int16_t nGainRight;            // Q15
+}
+TSoundMixerVoice;
+
+typedef struct CSoundMixer
+{
+    TSoundMixerVoice m_Voice[SOUND_MIXER_MAX_VOICES];
+}
+CSoundMixer;
+
+void CSoundMixer_Ctor (CSoundMixer *_this);
+
+/// \brief Starts playing a sound on a free voice
+/// \param pSamples    16-bit samples (interleaved, if stereo), must stay valid while playing
+/// \param nFrames    number of frames (samples per channel)
+/// \param nChannels    1 (mono) or 2 (stereo)
+/// \param nGain    0..SOUND_MIXER_GAIN_UNITY
+/// \param nPan        SOUND_MIXER_PAN_LEFT..SOUND_MIXER_PAN_RIGHT
+/// \param bLoop    repeat the sound until CSoundMixer_Stop() is called?
+/// \return Voice number, or -1 if all voices are in use
+int CSoundMixer_Play (CSoundMixer *_this, const int16_t *pSamples, unsigned nFrames,
+              unsigned nChannels, unsigned nGain, int nPan, boolean bLoop);
+
+void CSoundMixer_Stop (CSoundMixer *_this, int nVoice);
+void CSoundMixer_StopAll (CSoundMixer *_this);
+
+/// \return Is the voice still playing? (one-shot voices stop by themselves)
+boolean CSoundMixer_IsPlaying (CSoundMixer *_this, int nVoice);
+
+/// \brief Sets gain and pan of a playing voice
+void CSoundMixer_SetVolume (CSoundMixer *_this, int nVoice, unsigned nGain, int nPan);
+
+/// \brief Mixes all active voices into an interleaved stereo buffer
+/// \param pBuffer    buffer to be overwritten with the mixed samples
+/// \param nChunkSize    number of words in pBuffer (must be even)
+/// \return nChunkSize (has the signature of chunk_cb_t apart from _this)
+/// \note Sums are saturated, uses NEON on RASPPI >= 2 and ARMv6 SIMD on RASPPI 1.
+unsigned CSoundMixer_Render (CSoundMixer *_this, int16_t *pBuffer, unsigned nChunkSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
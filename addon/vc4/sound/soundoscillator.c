@@ -0,0 +1,302 @@
+//
+// soundoscillator.c
+//
+// Wavetable oscillators with fixed-point phase accumulators
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundoscillator.h>
+#include <linux/assert.h>
+#include <linux/types.h>
+#include <string.h>
+#include <math.h>
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+    #define SOUND_OSCILLATOR_NEON
+    #include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932384626433832795
+#endif
+
+#define TABLE_SIZE        SOUND_OSCILLATOR_TABLE_SIZE
+#define INDEX_SHIFT        (32 - 10)        // Q32 phase to table index
+#define BLOCK_FRAMES        64            // generated at once, before gain is applied
+
+#if TABLE_SIZE != (1 << (32 - INDEX_SHIFT))
+    #error SOUND_OSCILLATOR_TABLE_SIZE does not match INDEX_SHIFT
+#endif
+
+// the tables have one more sample (equal to the first) for the interpolation
+static int16_t s_SineTable[TABLE_SIZE+1];
+
+// level n contains the harmonics up to (TABLE_SIZE/2) >> n
+static int16_t s_Table[SoundWaveformUnknown-1][SOUND_OSCILLATOR_LEVELS][TABLE_SIZE+1];
+
+static boolean s_bTablesValid = FALSE;
+
+static inline int16_t Saturate (int nValue)
+{
+    if (nValue > 32767)
+    {
+        return 32767;
+    }
+
+    if (nValue < -32768)
+    {
+        return -32768;
+    }
+
+    return (int16_t) nValue;
+}
+
+// amplitude of harmonic nHarmonic (1 is the fundamental), phase is sine
+static double GetHarmonic (enum TSoundWaveform Waveform, unsigned nHarmonic)
+{
+    switch (Waveform)
+    {
+    case SoundWaveformSawtooth:
+        return (nHarmonic & 1 ? 1.0 : -1.0) / nHarmonic;
+
+    case SoundWaveformSquare:
+        return nHarmonic & 1 ? 1.0 / nHarmonic : 0.0;
+
+    case SoundWaveformTriangle:
+        if (!(nHarmonic & 1))
+        {
+            return 0.0;
+        }
+        return (nHarmonic & 2 ? -1.0 : 1.0) / ((double) nHarmonic * nHarmonic);
+
+    default:
+        assert (0);
+        return 0.0;
+    }
+}
+
+static void CalculateTables (void)
+{
+    static double Sine[TABLE_SIZE];
+    static double Wave[TABLE_SIZE];
+
+    for (unsigned i = 0; i < TABLE_SIZE; i++)
+    {
+        Sine[i] = sin (2.0 * M_PI * i / TABLE_SIZE);
+
+        s_SineTable[i] = (int16_t) lround (Sine[i] * 32767.0);
+    }
+    s_SineTable[TABLE_SIZE] = s_SineTable[0];
+
+    for (unsigned nWaveform = SoundWaveformSawtooth; nWaveform < SoundWaveformUnknown; nWaveform++)
+    {
+        for (unsigned nLevel = 0; nLevel < SOUND_OSCILLATOR_LEVELS; nLevel++)
+        {
+            unsigned nHarmonics = (TABLE_SIZE/2) >> nLevel;
+
+            // the harmonics are summed up using the sine table, sin (k*x) = Sine[k*i % TABLE_SIZE]
+            memset (Wave, 0, sizeof Wave);
+            for (unsigned k = 1; k <= nHarmonics; k++)
+            {
+                double fAmplitude = GetHarmonic ((enum TSoundWaveform) nWaveform, k);
+                if (fAmplitude == 0.0)
+                {
+                    continue;
+                }
+
+                for (unsigned i = 0; i < TABLE_SIZE; i++)
+                {
+                    Wave[i] += fAmplitude * Sine[k*i % TABLE_SIZE];
+                }
+            }
+
+            // normalize to full scale, including the overshoot of the Gibbs phenomenon
+            double fPeak = 0.0;
+            for (unsigned i = 0; i < TABLE_SIZE; i++)
+            {
+                if (fabs (Wave[i]) > fPeak)
+                {
+                    fPeak = fabs (Wave[i]);
+                }
+            }
+
+            int16_t *pTable = s_Table[nWaveform-1][nLevel];
+            for (unsigned i = 0; i < TABLE_SIZE; i++)
+            {
+                pTable[i] = (int16_t) lround (Wave[i] / fPeak * 32767.0);
+            }
+            pTable[TABLE_SIZE] = pTable[0];
+        }
+    }
+
+    s_bTablesValid = TRUE;
+}
+
+// generates nFrames mono samples with full scale, linear interpolation between table samples
+static uint32_t Generate (int16_t *pOut, const int16_t *pTable, uint32_t nPhase, uint32_t nIncrement,
+              unsigned nFrames)
+{
+    for (unsigned i = 0; i < nFrames; i++)
+    {
+        unsigned nIndex = nPhase >> INDEX_SHIFT;
+        int nWeight = (nPhase >> (INDEX_SHIFT - 15)) & 0x7FFF;
+
+        int nSample0 = pTable[nIndex];
+        int nSample1 = pTable[nIndex+1];
+        pOut[i] = (int16_t) (nSample0 + (((nSample1 - nSample0) * nWeight) >> 15));
+
+        nPhase += nIncrement;
+    }
+
+    return nPhase;
+}
+
+// applies the gain to nFrames mono samples and writes or adds them to both channels
+static void Store (int16_t *pOut, const int16_t *pIn, unsigned nFrames, int16_t nGain, int bMix)
+{
+#ifdef SOUND_OSCILLATOR_NEON
+    for (; nFrames >= 8; nFrames -= 8)
+    {
+        int16x8_t In = vqrdmulhq_n_s16 (vld1q_s16 (pIn), nGain);
+        pIn += 8;
+
+        int16x8x2_t Stereo = vzipq_s16 (In, In);
+        if (bMix)
+        {
+            Stereo.val[0] = vqaddq_s16 (vld1q_s16 (pOut),     Stereo.val[0]);
+            Stereo.val[1] = vqaddq_s16 (vld1q_s16 (pOut + 8), Stereo.val[1]);
+        }
+
+        vst1q_s16 (pOut,     Stereo.val[0]);
+        vst1q_s16 (pOut + 8, Stereo.val[1]);
+        pOut += 16;
+    }
+#endif
+
+    for (; nFrames > 0; nFrames--)
+    {
+        int nSample = ((int) *pIn++ * nGain + 0x4000) >> 15;
+
+        if (bMix)
+        {
+            pOut[0] = Saturate (pOut[0] + nSample);
+            pOut[1] = Saturate (pOut[1] + nSample);
+        }
+        else
+        {
+            pOut[0] = pOut[1] = (int16_t) nSample;
+        }
+
+        pOut += 2;
+    }
+}
+
+static void CSoundOscillator_Process (CSoundOscillator *_this, int16_t *pBuffer, unsigned nChunkSize,
+                      int bMix)
+{
+    assert (pBuffer != 0);
+    assert ((nChunkSize & 1) == 0);
+
+    int16_t Block[BLOCK_FRAMES];
+
+    for (unsigned nFrames = nChunkSize / 2; nFrames > 0;)
+    {
+        unsigned nBlockFrames = nFrames < BLOCK_FRAMES ? nFrames : BLOCK_FRAMES;
+
+        _this->m_nPhase = Generate (Block, _this->m_pTable, _this->m_nPhase,
+                        _this->m_nIncrement, nBlockFrames);
+
+        Store (pBuffer, Block, nBlockFrames, _this->m_nGain, bMix);
+
+        pBuffer += nBlockFrames * 2;
+        nFrames -= nBlockFrames;
+    }
+}
+
+void CSoundOscillator_Ctor (CSoundOscillator *_this, enum TSoundWaveform Waveform, unsigned nSampleRate)
+{
+    assert (Waveform < SoundWaveformUnknown);
+    assert (nSampleRate > 0);
+
+    if (!s_bTablesValid)
+    {
+        CalculateTables ();
+    }
+
+    _this->m_Waveform = Waveform;
+    _this->m_nSampleRate = nSampleRate;
+    _this->m_nPhase = 0;
+    _this->m_nGain = SOUND_OSCILLATOR_GAIN_UNITY;
+
+    CSoundOscillator_SetFrequency (_this, 440.0f);
+}
+
+void CSoundOscillator_SetFrequency (CSoundOscillator *_this, float fFrequency)
+{
+    assert (fFrequency >= 0.0f);
+
+    double fIncrement = (double) fFrequency / _this->m_nSampleRate * 4294967296.0;
+    if (fIncrement > 2147483648.0)
+    {
+        fIncrement = 2147483648.0;        // Nyquist frequency
+    }
+
+    uint32_t nIncrement = (uint32_t) fIncrement;
+
+    if (_this->m_Waveform == SoundWaveformSine)
+    {
+        _this->m_pTable = s_SineTable;
+    }
+    else
+    {
+        // table level n is free of aliasing for increments up to 2^n / TABLE_SIZE
+        unsigned nSteps = nIncrement > 0 ? (nIncrement - 1) >> INDEX_SHIFT : 0;
+        unsigned nLevel = nSteps > 0 ? 32 - __builtin_clz (nSteps) : 0;
+        if (nLevel >= SOUND_OSCILLATOR_LEVELS)
+        {
+            nLevel = SOUND_OSCILLATOR_LEVELS-1;
+        }
+
+        _this->m_pTable = s_Table[_this->m_Waveform-1][nLevel];
+    }
+
+    _this->m_nIncrement = nIncrement;
+}
+
+void CSoundOscillator_SetGain (CSoundOscillator *_this, unsigned nGain)
+{
+    if (nGain > SOUND_OSCILLATOR_GAIN_UNITY)
+    {
+        nGain = SOUND_OSCILLATOR_GAIN_UNITY;
+    }
+
+    _this->m_nGain = (int16_t) nGain;
+}
+
+void CSoundOscillator_Reset (CSoundOscillator *_this)
+{
+    _this->m_nPhase = 0;
+}
+
+unsigned CSoundOscillator_Render (CSoundOscillator *_this, int16_t *pBuffer, unsigned nChunkSize)
+{
+    CSoundOscillator_Process (_this, pBuffer, nChunkSize, 0);
+
+    return nChunkSize;
+}
+
+void CSoundOscillator_Mix (CSoundOscillator *_this, int16_t *pBuffer, unsigned nChunkSize)
+{
+    CSoundOscillator_Process (_this, pBuffer, nChunkSize, 1);
+}
@@ -0,0 +1,84 @@
+//
+// soundoscillator.h
+//
+// Wavetable oscillators with fixed-point phase accumulators
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundoscillator_h
+#define _vc4_sound_soundoscillator_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SOUND_OSCILLATOR_TABLE_SIZE    1024        // samples per period
+#define SOUND_OSCILLATOR_LEVELS        10        // band-limited tables per waveform
+
+#define SOUND_OSCILLATOR_GAIN_UNITY    32767        // Q15
+
+enum TSoundWaveform
+{
+    SoundWaveformSine,
+    SoundWaveformSawtooth,        ///< band-limited
+    SoundWaveformSquare,        ///< band-limited
+    SoundWaveformTriangle,        ///< band-limited
+    SoundWaveformUnknown
+};
+
+typedef struct CSoundOscillator
+{
+    enum TSoundWaveform m_Waveform;
+    unsigned m_nSampleRate;
+
+    const int16_t *m_pTable;        // selected by the frequency
+    uint32_t m_nPhase;            // fraction of one period (Q32)
+    uint32_t m_nIncrement;        // per sample (Q32)
+    int16_t m_nGain;            // Q15
+}
+CSoundOscillator;
+
+/// \param Waveform    waveform to be generated
+/// \param nSampleRate    sample rate of the device in Hz
+/// \note Calculates the wave tables on first use, must not be called from the slot handler.
+void CSoundOscillator_Ctor (CSoundOscillator *_this, enum TSoundWaveform Waveform, unsigned nSampleRate);
+
+/// \param fFrequency    0.0..nSampleRate/2 in Hz
+/// \note Selects the table with the most harmonics, which are all below the Nyquist frequency.
+void CSoundOscillator_SetFrequency (CSoundOscillator *_this, float fFrequency);
+
+/// \param nGain    0..SOUND_OSCILLATOR_GAIN_UNITY
+void CSoundOscillator_SetGain (CSoundOscillator *_this, unsigned nGain);
+
+/// \brief Restarts the waveform at phase 0
+void CSoundOscillator_Reset (CSoundOscillator *_this);
+
+/// \brief Generates the waveform into an interleaved stereo buffer (same signal on both channels)
+/// \param pBuffer    buffer to be overwritten
+/// \param nChunkSize    number of words in pBuffer (must be even)
+/// \return nChunkSize (has the signature of chunk_cb_t apart from _this)
+unsigned CSoundOscillator_Render (CSoundOscillator *_this, int16_t *pBuffer, unsigned nChunkSize);
+
+/// \brief Adds the waveform to an interleaved stereo buffer, the sums are saturated
+/// \param pBuffer    buffer with the signal of other oscillators
+/// \param nChunkSize    number of words in pBuffer (must be even)
+void CSoundOscillator_Mix (CSoundOscillator *_this, int16_t *pBuffer, unsigned nChunkSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+//
+// soundresampler.c
+//
+// Streaming sample rate converter for interleaved 16-bit stereo data
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <vc4/sound/soundresampler.h>
+#include <linux/assert.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932384626433832795
+#endif
+
+#define HISTORY_FRAMES        SOUND_RESAMPLER_TAPS
+#define HALF_TAPS        (SOUND_RESAMPLER_TAPS / 2)
+#define PHASE_SHIFT        (32 - 7)        // Q32 fraction to phase index
+
+#if SOUND_RESAMPLER_PHASES != (1 << (32 - PHASE_SHIFT))
+    #error SOUND_RESAMPLER_PHASES does not match PHASE_SHIFT
+#endif
+
+static inline int16_t Saturate (int nValue)
+{
+    if (nValue > 32767)
+    {
+        return 32767;
+    }
+
+    if (nValue < -32768)
+    {
+        return -32768;
+    }
+
+    return (int16_t) nValue;
+}
+
+// frame nIndex of the history, which is followed by the current block
+static inline const int16_t *GetFrame (CSoundResampler *_this, const int16_t *pIn, unsigned nIndex)
+{
+    if (nIndex < HISTORY_FRAMES)
+    {
+        return &_this->m_History[nIndex * 2];
+    }
+
+    return &pIn[(nIndex - HISTORY_FRAMES) * 2];
+}
+
+static void CSoundResampler_CalculateFilter (CSoundResampler *_this, unsigned nInputRate, unsigned nOutputRate)
+{
+    // cut-off frequency relative to the input rate, below the lower Nyquist frequency
+    double fCutOff = 0.5 * 0.95;
+    if (nOutputRate < nInputRate)
+    {
+        fCutOff *= (double) nOutputRate / nInputRate;
+    }
+
+    for (unsigned nPhase = 0; nPhase <= SOUND_RESAMPLER_PHASES; nPhase++)
+    {
+        double Coeff[SOUND_RESAMPLER_TAPS];
+        double fSum = 0.0;
+
+        for (unsigned nTap = 0; nTap < SOUND_RESAMPLER_TAPS; nTap++)
+        {
+            // distance of the tap from the output frame
+            double x = (double) nTap - (HALF_TAPS - 1) - (double) nPhase / SOUND_RESAMPLER_PHASES;
+
+            double fSinc = 2.0 * fCutOff;
+            if (x != 0.0)
+            {
+                fSinc = sin (2.0 * M_PI * fCutOff * x) / (M_PI * x);
+            }
+
+            // Blackman window
+            double fWindow = 0.42 + 0.5 * cos (M_PI * x / HALF_TAPS)
+                          + 0.08 * cos (2.0 * M_PI * x / HALF_TAPS);
+
+            Coeff[nTap] = fSinc * fWindow;
+            fSum += Coeff[nTap];
+        }
+
+        // normalize to unity gain at DC
+        for (unsigned nTap = 0; nTap < SOUND_RESAMPLER_TAPS; nTap++)
+        {
+            _this->m_Coeff[nPhase][nTap] = Saturate ((int) lround (Coeff[nTap] / fSum * 32768.0));
+        }
+    }
+}
+
+void CSoundResampler_Ctor (CSoundResampler *_this, unsigned nInputRate, unsigned nOutputRate,
+               enum TSoundResamplerQuality Quality)
+{
+    assert (nInputRate > 0);
+    assert (nOutputRate > 0);
+    assert (Quality < SoundResamplerUnknown);
+
+    _this->m_Quality = Quality;
+    // the step is precise enough to prevent a noticeable drift over hours
+    uint64_t nStep = ((uint64_t) nInputRate << 32) / nOutputRate;
+    _this->m_nStep = (unsigned) (nStep >> 32);
+    _this->m_nStepFraction = (uint32_t) nStep;
+
+    if (Quality == SoundResamplerSinc)
+    {
+        CSoundResampler_CalculateFilter (_this, nInputRate, nOutputRate);
+    }
+
+    CSoundResampler_Reset (_this);
+}
+
+void CSoundResampler_Reset (CSoundResampler *_this)
+{
+    memset (_this->m_History, 0, sizeof _this->m_History);
+    _this->m_nPosition = HISTORY_FRAMES;        // the first frame of the stream
+    _this->m_nFraction = 0;
+}
+
+unsigned CSoundResampler_Process (CSoundResampler *_this,
+                  const int16_t *pIn, unsigned nInFrames, unsigned *pInFramesUsed,
+                  int16_t *pOut, unsigned nOutFrames)
+{
+    assert (pIn != 0 || nInFrames == 0);
+    assert (pInFramesUsed != 0);
+    assert (pOut != 0);
+
+    // frames needed left and right of m_nPosition
+    unsigned nLag  = _this->m_Quality == SoundResamplerSinc ? HALF_TAPS - 1 : 0;
+    unsigned nLead = _this->m_Quality == SoundResamplerSinc ? HALF_TAPS : 1;
+
+    // the history keeps at least nLag frames left of the position
+    unsigned nPosition = _this->m_nPosition;
+    assert (nPosition >= nLag);
+    uint32_t nFraction = _this->m_nFraction;
+    unsigned nOut = 0;
+
+    while (   nOut < nOutFrames
+           && nPosition + nLead < HISTORY_FRAMES + nInFrames)
+    {
+        int nLeft, nRight;
+
+        if (_this->m_Quality == SoundResamplerSinc)
+        {
+            // the coefficients are interpolated between two adjacent phases
+            const int16_t *pCoeff0 = _this->m_Coeff[nFraction >> PHASE_SHIFT];
+            const int16_t *pCoeff1 = pCoeff0 + SOUND_RESAMPLER_TAPS;
+            int nWeight = (nFraction >> (PHASE_SHIFT - 15)) & 0x7FFF;
+            unsigned nFirst = nPosition - nLag;
+
+            nLeft = 0;
+            nRight = 0;
+
+            for (unsigned nTap = 0; nTap < SOUND_RESAMPLER_TAPS; nTap++)
+            {
+                const int16_t *pFrame =   nFirst >= HISTORY_FRAMES
+                            ? &pIn[(nFirst - HISTORY_FRAMES + nTap) * 2]
+                            : GetFrame (_this, pIn, nFirst + nTap);
+
+                int nCoeff = pCoeff0[nTap] + (((pCoeff1[nTap] - pCoeff0[nTap]) * nWeight) >> 15);
+                nLeft  += nCoeff * pFrame[0];
+                nRight += nCoeff * pFrame[1];
+            }
+
+            nLeft  = (nLeft  + 0x4000) >> 15;
+            nRight = (nRight + 0x4000) >> 15;
+        }
+        else
+        {
+            const int16_t *pFrame0 = GetFrame (_this, pIn, nPosition);
+            const int16_t *pFrame1 = GetFrame (_this, pIn, nPosition + 1);
+
+            int nWeight = nFraction >> 16;
+            nLeft  = pFrame0[0] + (((pFrame1[0] - pFrame0[0]) * nWeight) >> 16);
+            nRight = pFrame0[1] + (((pFrame1[1] - pFrame0[1]) * nWeight) >> 16);
+        }
+
+        *pOut++ = Saturate (nLeft);
+        *pOut++ = Saturate (nRight);
+        nOut++;
+
+        uint32_t nPrevFraction = nFraction;
+        nFraction += _this->m_nStepFraction;
+        nPosition += _this->m_nStep + (nFraction < nPrevFraction ? 1 : 0);
+    }
+
+    // The frames left of the filter are not needed any more. If the input has run out,
+    // these are all frames (nPosition + nLead >= HISTORY_FRAMES + nInFrames and
+    // HISTORY_FRAMES > nLag + nLead), the overlap is kept in the history.
+    unsigned nConsumed = nPosition - nLag;
+    if (nConsumed > nInFrames)
+    {
+        nConsumed = nInFrames;
+    }
+
+    int16_t History[HISTORY_FRAMES * 2];
+    for (unsigned i = 0; i < HISTORY_FRAMES; i++)
+    {
+        const int16_t *pFrame = GetFrame (_this, pIn, nConsumed + i);
+        History[i*2]   = pFrame[0];
+        History[i*2+1] = pFrame[1];
+    }
+    memcpy (_this->m_History, History, sizeof History);
+
+    _this->m_nPosition = nPosition - nConsumed;
+    _this->m_nFraction = nFraction;
+
+    *pInFramesUsed = nConsumed;
+
+    return nOut;
+}
@@ -0,0 +1,86 @@
+//
+// soundresampler.h
+//
+// Streaming sample rate converter for interleaved 16-bit stereo data
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _vc4_sound_soundresampler_h
+#define _vc4_sound_soundresampler_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SOUND_RESAMPLER_TAPS        32        // of the windowed-sinc filter
+#define SOUND_RESAMPLER_PHASES        128        // of the polyphase filter bank
+
+enum TSoundResamplerQuality
+{
+    SoundResamplerLinear,        ///< linear interpolation, cheap
+    SoundResamplerSinc,            ///< polyphase windowed-sinc filter
+    SoundResamplerUnknown
+};
+
+typedef struct CSoundResampler
+{
+    enum TSoundResamplerQuality m_Quality;
+
+    unsigned m_nStep;            // input frames per output frame (integer part)
+    uint32_t m_nStepFraction;        // (Q32)
+    unsigned m_nPosition;        // input frame left of the next output frame,
+                        // counted from the first frame in m_History
+    uint32_t m_nFraction;        // offset from m_nPosition (Q32)
+
+    // the last input frames (interleaved), which precede the next block
+    int16_t m_History[SOUND_RESAMPLER_TAPS * 2];
+
+    // one more phase for the interpolation between phases
+    int16_t m_Coeff[SOUND_RESAMPLER_PHASES+1][SOUND_RESAMPLER_TAPS];    // Q15
+}
+CSoundResampler;
+
+/// \param nInputRate    sample rate of the source in Hz
+/// \param nOutputRate    sample rate of the device in Hz
+/// \param Quality    interpolation method
+/// \note Calculates the filter bank, must not be called from the slot handler.
+void CSoundResampler_Ctor (CSoundResampler *_this, unsigned nInputRate, unsigned nOutputRate,
+               enum TSoundResamplerQuality Quality);
+
+/// \brief Clears the history, to start a new stream
+void CSoundResampler_Reset (CSoundResampler *_this);
+
+/// \brief Converts a block of interleaved stereo frames
+/// \param pIn        input frames
+/// \param nInFrames    number of input frames
+/// \param pInFramesUsed    returns the number of input frames consumed\n
+///            (less than nInFrames only, if pOut is full, pass the rest again)
+/// \param pOut        output buffer
+/// \param nOutFrames    size of the output buffer in frames
+/// \return Number of output frames written
+/// \note Does not allocate memory and can be used from chunk_cb.
+/// \note The overlap of the filter (1 frame for linear, 16 for sinc) is kept in the history,\n
+///       so the output lags the input by it. Pass silence at the end of the stream to get\n
+///       the last frames.
+unsigned CSoundResampler_Process (CSoundResampler *_this,
+                  const int16_t *pIn, unsigned nInFrames, unsigned *pInFramesUsed,
+                  int16_t *pOut, unsigned nOutFrames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,387 @@
+//
+// adpcmbench.c
+//
+// Benchmark of CSoundADPCMDecoder: frames decoded per second of CPU time and the share
+// of one core, which is needed to play a stream in real time
+//
+// The IMA and the Microsoft ADPCM data are encoded here from a sine sweep, so that the
+// decoded signal can be checked (SNR). The Microsoft encoder selects the predictor with
+// the least error for each block and channel, like common encoders do.
+//
+#include <vc4/sound/soundadpcm.h>
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define SAMPLE_RATE		44100
+#define CHUNK_SIZE		4000		// words, like the sample program
+#define BLOCK_ALIGN		1024		// bytes per block, as written by common encoders
+#define SOUND_FRAMES		(SAMPLE_RATE * 2)
+#define MIN_SECONDS		0.2
+
+#define MAX_CHANNELS		2
+#define MAX_DATA_SIZE		(SOUND_FRAMES * MAX_CHANNELS / 2 + 64 * BLOCK_ALIGN)
+
+static const int16_t s_IMAStepTable[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+	11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+	32767
+};
+
+static const int s_IMAIndexTable[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int s_MSCoeff1[7] = {256, 512, 0, 192, 240, 460, 392};
+static const int s_MSCoeff2[7] = {0, -256, 0, 64, 0, -208, -232};
+
+static const int s_MSAdaptationTable[16] =
+{
+	230, 230, 230, 230, 307, 409, 512, 614,
+	768, 614, 512, 409, 307, 230, 230, 230
+};
+
+#define MS_INITIAL_DELTA	16
+
+static int16_t s_Source[SOUND_FRAMES * MAX_CHANNELS];
+static uint8_t s_Data[MAX_DATA_SIZE];
+static int16_t s_Buffer[CHUNK_SIZE];
+
+static CSoundADPCMDecoder s_Decoder;
+
+typedef struct TIMAEncoder
+{
+	int nPredicted;
+	int nIndex;
+}
+TIMAEncoder;
+
+static unsigned EncodeIMASample (TIMAEncoder *pEncoder, int nSample)
+{
+	int nStep = s_IMAStepTable[pEncoder->nIndex];
+	int nDiff = nSample - pEncoder->nPredicted;
+
+	unsigned nNibble = 0;
+	if (nDiff < 0)
+	{
+		nNibble = 8;
+		nDiff = -nDiff;
+	}
+
+	// the same quantization as the decoder uses
+	int nDelta = nStep >> 3;
+	for (unsigned nBit = 4; nBit > 0; nBit >>= 1)
+	{
+		if (nDiff >= nStep)
+		{
+			nNibble |= nBit;
+			nDiff -= nStep;
+			nDelta += nStep;
+		}
+		nStep >>= 1;
+	}
+
+	pEncoder->nPredicted += nNibble & 8 ? -nDelta : nDelta;
+	if (pEncoder->nPredicted > 32767)
+	{
+		pEncoder->nPredicted = 32767;
+	}
+	else if (pEncoder->nPredicted < -32768)
+	{
+		pEncoder->nPredicted = -32768;
+	}
+
+	pEncoder->nIndex += s_IMAIndexTable[nNibble & 7];
+	if (pEncoder->nIndex < 0)
+	{
+		pEncoder->nIndex = 0;
+	}
+	else if (pEncoder->nIndex > 88)
+	{
+		pEncoder->nIndex = 88;
+	}
+
+	return nNibble;
+}
+
+// encodes s_Source in WAVE IMA ADPCM blocks, returns the data size
+static unsigned EncodeIMA (unsigned nChannels)
+{
+	unsigned nBlockFrames = (BLOCK_ALIGN - 4 * nChannels) / (4 * nChannels) * 8 + 1;
+	TIMAEncoder Encoder[MAX_CHANNELS] = {{0, 0}, {0, 0}};
+
+	unsigned nSize = 0;
+	for (unsigned nFrame = 0; nFrame + nBlockFrames <= SOUND_FRAMES; nFrame += nBlockFrames)
+	{
+		uint8_t *pBlock = s_Data + nSize;
+		memset (pBlock, 0, BLOCK_ALIGN);
+
+		// the header holds the first frame
+		for (unsigned c = 0; c < nChannels; c++)
+		{
+			int nSample = s_Source[nFrame * nChannels + c];
+			Encoder[c].nPredicted = nSample;
+
+			pBlock[c*4] = (uint8_t) nSample;
+			pBlock[c*4 + 1] = (uint8_t) (nSample >> 8);
+			pBlock[c*4 + 2] = (uint8_t) Encoder[c].nIndex;
+		}
+
+		// groups of 8 samples (4 bytes) per channel, low nibble first
+		uint8_t *pData = pBlock + 4 * nChannels;
+		for (unsigned i = 1; i < nBlockFrames; i += 8)
+		{
+			for (unsigned c = 0; c < nChannels; c++)
+			{
+				for (unsigned j = 0; j < 8; j++)
+				{
+					unsigned nNibble = EncodeIMASample (&Encoder[c],
+									    s_Source[(nFrame + i + j) * nChannels + c]);
+					pData[j / 2] |= nNibble << (j & 1 ? 4 : 0);
+				}
+
+				pData += 4;
+			}
+		}
+
+		nSize += BLOCK_ALIGN;
+	}
+
+	return nSize;
+}
+
+typedef struct TMSEncoder
+{
+	int nSample1;
+	int nSample2;
+	int nDelta;
+	unsigned nPredictor;
+}
+TMSEncoder;
+
+static unsigned EncodeMSSample (TMSEncoder *pEncoder, int nSample)
+{
+	int nPredicted =   (  pEncoder->nSample1 * s_MSCoeff1[pEncoder->nPredictor]
+			    + pEncoder->nSample2 * s_MSCoeff2[pEncoder->nPredictor]) >> 8;
+	int nDiff = nSample - nPredicted;
+
+	// rounded to the nearest step
+	int nSigned =   nDiff >= 0
+		      ?   (nDiff + pEncoder->nDelta / 2) / pEncoder->nDelta
+		      : -((-nDiff + pEncoder->nDelta / 2) / pEncoder->nDelta);
+	if (nSigned > 7)
+	{
+		nSigned = 7;
+	}
+	else if (nSigned < -8)
+	{
+		nSigned = -8;
+	}
+
+	// the same reconstruction as the decoder uses
+	int nDecoded = nPredicted + nSigned * pEncoder->nDelta;
+	if (nDecoded > 32767)
+	{
+		nDecoded = 32767;
+	}
+	else if (nDecoded < -32768)
+	{
+		nDecoded = -32768;
+	}
+
+	pEncoder->nSample2 = pEncoder->nSample1;
+	pEncoder->nSample1 = nDecoded;
+
+	unsigned nNibble = (unsigned) nSigned & 0x0F;
+	pEncoder->nDelta = (s_MSAdaptationTable[nNibble] * pEncoder->nDelta) >> 8;
+	if (pEncoder->nDelta < 16)
+	{
+		pEncoder->nDelta = 16;
+	}
+
+	return nNibble;
+}
+
+// squared error of channel c of the block at nFrame with a predictor
+static double GetMSError (unsigned nChannels, unsigned c, unsigned nFrame, unsigned nBlockFrames,
+			  unsigned nPredictor)
+{
+	TMSEncoder Encoder = {s_Source[(nFrame + 1) * nChannels + c], s_Source[nFrame * nChannels + c],
+			      MS_INITIAL_DELTA, nPredictor};
+
+	double fError = 0.0;
+	for (unsigned i = 2; i < nBlockFrames; i++)
+	{
+		int nSample = s_Source[(nFrame + i) * nChannels + c];
+		EncodeMSSample (&Encoder, nSample);
+
+		double fDiff = Encoder.nSample1 - nSample;
+		fError += fDiff * fDiff;
+	}
+
+	return fError;
+}
+
+// encodes s_Source in WAVE Microsoft ADPCM blocks, returns the data size
+static unsigned EncodeMS (unsigned nChannels)
+{
+	unsigned nBlockFrames = (BLOCK_ALIGN - 7 * nChannels) * 2 / nChannels + 2;
+
+	unsigned nSize = 0;
+	for (unsigned nFrame = 0; nFrame + nBlockFrames <= SOUND_FRAMES; nFrame += nBlockFrames)
+	{
+		uint8_t *pBlock = s_Data + nSize;
+		memset (pBlock, 0, BLOCK_ALIGN);
+
+		// the header holds the first two frames (sample 2 is the first one)
+		TMSEncoder Encoder[MAX_CHANNELS];
+		for (unsigned c = 0; c < nChannels; c++)
+		{
+			unsigned nBest = 0;
+			double fBestError = GetMSError (nChannels, c, nFrame, nBlockFrames, 0);
+			for (unsigned p = 1; p < 7; p++)
+			{
+				double fError = GetMSError (nChannels, c, nFrame, nBlockFrames, p);
+				if (fError < fBestError)
+				{
+					nBest = p;
+					fBestError = fError;
+				}
+			}
+
+			Encoder[c].nSample1 = s_Source[(nFrame + 1) * nChannels + c];
+			Encoder[c].nSample2 = s_Source[nFrame * nChannels + c];
+			Encoder[c].nDelta = MS_INITIAL_DELTA;
+			Encoder[c].nPredictor = nBest;
+
+			pBlock[c] = (uint8_t) nBest;
+			pBlock[nChannels + c*2] = (uint8_t) MS_INITIAL_DELTA;
+			pBlock[nChannels + c*2 + 1] = 0;
+			pBlock[nChannels*3 + c*2] = (uint8_t) Encoder[c].nSample1;
+			pBlock[nChannels*3 + c*2 + 1] = (uint8_t) (Encoder[c].nSample1 >> 8);
+			pBlock[nChannels*5 + c*2] = (uint8_t) Encoder[c].nSample2;
+			pBlock[nChannels*5 + c*2 + 1] = (uint8_t) (Encoder[c].nSample2 >> 8);
+		}
+
+		// nibbles of all channels interleaved, high nibble first
+		uint8_t *pData = pBlock + 7 * nChannels;
+		unsigned nNibbles = 0;
+		for (unsigned i = 2; i < nBlockFrames; i++)
+		{
+			for (unsigned c = 0; c < nChannels; c++, nNibbles++)
+			{
+				unsigned nNibble = EncodeMSSample (&Encoder[c], s_Source[(nFrame + i) * nChannels + c]);
+				pData[nNibbles / 2] |= nNibble << (nNibbles & 1 ? 0 : 4);
+			}
+		}
+
+		nSize += BLOCK_ALIGN;
+	}
+
+	return nSize;
+}
+
+// SNR of the decoded data against s_Source in dB
+static double MeasureSNR (unsigned nChannels)
+{
+	CSoundADPCMDecoder_Rewind (&s_Decoder);
+
+	double fSignal = 0.0, fNoise = 0.0;
+	unsigned nFrame = 0;
+	unsigned nWords;
+	while ((nWords = CSoundADPCMDecoder_Render (&s_Decoder, s_Buffer, CHUNK_SIZE)) > 0)
+	{
+		for (unsigned i = 0; i < nWords; i += 2, nFrame++)
+		{
+			for (unsigned c = 0; c < 2; c++)
+			{
+				// mono is duplicated on output
+				double fExpected = s_Source[nFrame * nChannels + (nChannels == 2 ? c : 0)];
+				double fError = s_Buffer[i + c] - fExpected;
+
+				fSignal += fExpected * fExpected;
+				fNoise += fError * fError;
+			}
+		}
+	}
+
+	return 10.0 * log10 (fSignal / fNoise);
+}
+
+static void Decode (void *pParam)
+{
+	if (CSoundADPCMDecoder_Render (&s_Decoder, s_Buffer, CHUNK_SIZE) < CHUNK_SIZE)
+	{
+		CSoundADPCMDecoder_Rewind (&s_Decoder);
+	}
+}
+
+int main (void)
+{
+	static const char *pFormatName[SoundADPCMUnknown] = {"IMA", "Microsoft"};
+
+	int nResult = 0;
+
+	printf ("CSoundADPCMDecoder, block align %u, chunk %u words\n\n", BLOCK_ALIGN, CHUNK_SIZE);
+	printf ("format     channels   SNR dB   Mframes/s   %% of a core at %u Hz\n", SAMPLE_RATE);
+
+	for (unsigned f = 0; f < SoundADPCMUnknown; f++)
+	{
+		enum TSoundADPCMFormat Format = (enum TSoundADPCMFormat) f;
+
+		for (unsigned nChannels = 1; nChannels <= MAX_CHANNELS; nChannels++)
+		{
+			// a sine sweep from 100 Hz to 5 kHz at -6 dBFS, the right channel is inverted
+			double fPhase = 0.0;
+			for (unsigned i = 0; i < SOUND_FRAMES; i++)
+			{
+				double fFrequency = 100.0 + 4900.0 * i / SOUND_FRAMES;
+				fPhase += 2.0 * M_PI * fFrequency / SAMPLE_RATE;
+
+				int16_t nSample = (int16_t) lrint (16384.0 * sin (fPhase));
+				s_Source[i * nChannels] = nSample;
+				if (nChannels == 2)
+				{
+					s_Source[i * nChannels + 1] = -nSample;
+				}
+			}
+
+			unsigned nSize =   Format == SoundADPCMIMA
+					 ? EncodeIMA (nChannels)
+					 : EncodeMS (nChannels);
+
+			CSoundADPCMDecoder_Ctor (&s_Decoder);
+			if (!CSoundADPCMDecoder_Open (&s_Decoder, s_Data, nSize, Format, nChannels,
+						      BLOCK_ALIGN))
+			{
+				printf ("%-10s %8u   cannot open\n", pFormatName[f], nChannels);
+				nResult = 1;
+
+				continue;
+			}
+
+			// IMA reaches about 28 dB with this signal, Microsoft ADPCM about 35 dB
+			char SNR[16];
+			double fSNR = MeasureSNR (nChannels);
+			snprintf (SNR, sizeof SNR, "%.1f", fSNR);
+			if (fSNR < 15.0)
+			{
+				nResult = 1;
+			}
+
+			CSoundADPCMDecoder_Rewind (&s_Decoder);
+			double fSeconds = BenchRun (Decode, 0, MIN_SECONDS);
+			double fFramesPerSecond = (CHUNK_SIZE / 2) / fSeconds;
+
+			printf ("%-10s %8u %8s %11.2f %10.3f\n", pFormatName[f], nChannels, SNR,
+				fFramesPerSecond / 1e6, 100.0 * SAMPLE_RATE / fFramesPerSecond);
+		}
+	}
+
+	return nResult;
+}
@@ -0,0 +1,52 @@
+//
+// bench.h
+//
+// Helpers of the host benchmarks
+//
+#ifndef _bench_h
+#define _bench_h
+
+#include <time.h>
+
+// CPU time of the process in seconds
+static inline double BenchCPUTime (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// calls pFunc(pParam) repeatedly for at least fMinSeconds of CPU time,
+// returns the CPU time per call in seconds
+static inline double BenchRun (void (*pFunc) (void *), void *pParam, double fMinSeconds)
+{
+	(*pFunc) (pParam);		// warm up
+
+	unsigned long nCalls = 0;
+	double fStart = BenchCPUTime ();
+	double fElapsed;
+	do
+	{
+		(*pFunc) (pParam);
+		nCalls++;
+
+		fElapsed = BenchCPUTime () - fStart;
+	}
+	while (fElapsed < fMinSeconds);
+
+	return fElapsed / nCalls;
+}
+
+// pseudo random numbers (xorshift32), reproducible in all runs
+static inline unsigned BenchRandom (unsigned *pState)
+{
+	unsigned x = *pState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *pState = x;
+}
+
+#endif
@@ -0,0 +1,148 @@
+//
+// draintest.c
+//
+// Test of back-to-back clips, which are started from the drain callback
+//
+// Each clip ends with a short return of chunk_cb(). The drain callback starts the next clip
+// at once. It is called on the slot handler thread, or from CVCHIQSoundBaseDevice_Start()
+// itself, if a clip is empty and nothing is pending. The clips are played in message and
+// in bulk mode. The program fails (exit code 1), if a clip is lost, and is aborted by an
+// alarm, if a restart hangs.
+//
+#include <vc4/vchiq/vchiqdevice.h>
+#include <vc4/sound/vchiqsoundbasedevice.h>
+#include <vc4/sound/soundoscillator.h>
+#include <linux/env.h>
+#include "hostenv.h"
+#include "vpusim.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define SAMPLE_RATE		48000
+#define CHUNK_SIZE		4000		// words
+#define TIMEOUT_SECS		10
+
+// frames of each clip, an empty clip ends the stream before anything is written
+static const unsigned s_ClipFrames[] = {0, 100, 2000, 0, 0, 4000, 12345, 1999, 0};
+#define NUM_CLIPS		(sizeof s_ClipFrames / sizeof s_ClipFrames[0])
+
+static CVCHIQDevice s_VCHIQ;
+static CVCHIQSoundBaseDevice s_Sound;
+static CSoundOscillator s_Oscillator;
+
+static unsigned s_nClip;			// currently played
+static unsigned s_nFramesLeft;
+static unsigned long long s_nFramesRendered;
+static unsigned s_nDrained;			// drain callbacks
+static int s_bFailed;
+
+static unsigned Render (int16_t *pBuffer, unsigned nChunkSize)
+{
+	if (nChunkSize / 2 > s_nFramesLeft)
+	{
+		nChunkSize = s_nFramesLeft * 2;
+	}
+	s_nFramesLeft -= nChunkSize / 2;
+	s_nFramesRendered += nChunkSize / 2;
+
+	CSoundOscillator_Render (&s_Oscillator, pBuffer, nChunkSize);
+
+	return nChunkSize;
+}
+
+static void DrainHandler (void *pParam)
+{
+	s_nDrained++;
+
+	if (s_nClip+1 < NUM_CLIPS)
+	{
+		s_nFramesLeft = s_ClipFrames[++s_nClip];
+
+		if (!CVCHIQSoundBaseDevice_Start (&s_Sound))
+		{
+			fprintf (stderr, "Cannot restart clip %u\n", s_nClip);
+
+			s_bFailed = 1;
+		}
+	}
+}
+
+static int PlayClips (enum TVCHIQSoundTransferMode Mode, const char *pModeName)
+{
+	CVCHIQSoundBaseDevice_SetTransferMode (&s_Sound, Mode);
+
+	unsigned long long nFramesExpected = 0;
+	for (unsigned i = 0; i < NUM_CLIPS; i++)
+	{
+		nFramesExpected += s_ClipFrames[i];
+	}
+
+	s_nClip = 0;
+	s_nFramesLeft = s_ClipFrames[0];
+	s_nFramesRendered = 0;
+	s_nDrained = 0;
+	s_bFailed = 0;
+
+	if (!CVCHIQSoundBaseDevice_Start (&s_Sound))
+	{
+		fprintf (stderr, "Cannot start sound device\n");
+
+		return 1;
+	}
+
+	while (   !s_bFailed
+	       && (   s_nDrained < NUM_CLIPS
+		   || CVCHIQSoundBaseDevice_IsActive (&s_Sound)))
+	{
+		SchedulerYield ();
+	}
+
+	int bOK =    !s_bFailed
+		  && s_nDrained == NUM_CLIPS
+		  && s_nFramesRendered == nFramesExpected;
+
+	printf ("%-9s %5u %8u %15llu %9s\n", pModeName, (unsigned) NUM_CLIPS, s_nDrained,
+		s_nFramesRendered, bOK ? "ok" : "FAILED");
+
+	return bOK ? 0 : 1;
+}
+
+static int TestMain (void *pParam)
+{
+	if (!CVCHIQDevice_Initialize (&s_VCHIQ, 0, 0))
+	{
+		fprintf (stderr, "Cannot initialize VCHIQ\n");
+
+		return 1;
+	}
+
+	CVCHIQSoundBaseDevice_Ctor (&s_Sound, &s_VCHIQ, SAMPLE_RATE, CHUNK_SIZE,
+				    VCHIQSoundDestinationAuto);
+	CVCHIQSoundBaseDevice_SetDrainCallback (&s_Sound, DrainHandler, 0);
+
+	CSoundOscillator_Ctor (&s_Oscillator, SoundWaveformSine, SAMPLE_RATE);
+	CSoundOscillator_SetFrequency (&s_Oscillator, 440.0f);
+
+	s_Sound.chunk_cb = Render;
+
+	printf ("mode      clips  drained  frames rendered    result\n");
+
+	int nResult = PlayClips (VCHIQSoundTransferMessages, "messages");
+	nResult |= PlayClips (VCHIQSoundTransferBulk, "bulk");
+
+	VPUSimFinish ();
+
+	return nResult;
+}
+
+int main (void)
+{
+	// a deadlock in the restart does not return
+	alarm (TIMEOUT_SECS);
+
+	TVPUSimConfig Config = {2, 0, 0, 0};
+	VPUSimInit (&Config);
+
+	return HostRun (TestMain, 0);
+}
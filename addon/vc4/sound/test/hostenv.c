@@ -0,0 +1,378 @@
+//
+// hostenv.c
+//
+// Host implementation of the environment (<linux/env.h>) for the render harness
+//
+// The threads are cooperative (ucontext), like the coroutines on the target. The main
+// context is the scheduler, which runs the threads in turn and delivers the periodic
+// timer and the interrupts between them. All memory is allocated from static pools,
+// which are linked below 1 GByte, so that the 32-bit bus addresses of VCHIQ are valid.
+//
+#include <linux/env.h>
+#include "hostenv.h"
+
+#include <ucontext.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS		16		// incl. the main context (see kthread.c)
+#define STACK_SIZE		(256 * 1024)
+
+#define PERIODIC_INTERVAL_US	10000		// 100 Hz, like on the target
+
+#define MAX_IRQS		128
+
+static ucontext_t s_MainContext;
+static ucontext_t s_Context[MAX_THREADS];
+static char s_Stack[MAX_THREADS][STACK_SIZE] __attribute__ ((aligned (16)));
+static int (*s_pThreadFunc[MAX_THREADS]) (void *);
+static void *s_pThreadParam[MAX_THREADS];
+static int s_bUsed[MAX_THREADS];
+static int s_bFinished[MAX_THREADS];
+static int s_nResult[MAX_THREADS];
+static int s_nCurrent = 0;			// 0 for the main context
+
+static void (*s_pSwitchHandler) (int) = 0;
+
+static TPeriodicTimerHandler *s_pPeriodicHandler = 0;
+static unsigned s_nNextPeriodicTicks;
+
+static TInterruptHandler *s_pIRQHandler[MAX_IRQS];
+static void *s_pIRQParam[MAX_IRQS];
+static volatile int s_bIRQPending[MAX_IRQS];
+static volatile int s_bAnyIRQPending = 0;
+
+static volatile unsigned s_nCriticalLevel = 0;
+
+static int s_bVerbose = 0;
+
+// Threads
+
+static void ThreadEntry (int nThread)
+{
+	s_nResult[nThread] = (*s_pThreadFunc[nThread]) (s_pThreadParam[nThread]);
+	s_bFinished[nThread] = 1;
+
+	while (1)
+	{
+		swapcontext (&s_Context[nThread], &s_MainContext);
+	}
+}
+
+void SchedulerInitialize ()
+{
+}
+
+int SchedulerCreateThread (int (*fn) (void *), void *param)
+{
+	for (int i = 1; i < MAX_THREADS; i++)
+	{
+		if (s_bUsed[i])
+		{
+			continue;
+		}
+
+		s_pThreadFunc[i] = fn;
+		s_pThreadParam[i] = param;
+		s_bFinished[i] = 0;
+
+		getcontext (&s_Context[i]);
+		s_Context[i].uc_stack.ss_sp = s_Stack[i];
+		s_Context[i].uc_stack.ss_size = STACK_SIZE;
+		s_Context[i].uc_link = 0;
+		makecontext (&s_Context[i], (void (*) (void)) ThreadEntry, 1, i);
+
+		s_bUsed[i] = 1;
+
+		return i;
+	}
+
+	fprintf (stderr, "hostenv: too many threads\n");
+	abort ();
+}
+
+void SchedulerRegisterSwitchHandler (void (*fn) (int))
+{
+	s_pSwitchHandler = fn;
+}
+
+void SchedulerYield ()
+{
+	if (s_nCurrent == 0)
+	{
+		return;
+	}
+
+	swapcontext (&s_Context[s_nCurrent], &s_MainContext);
+}
+
+static void SwitchTo (int nThread)
+{
+	s_nCurrent = nThread;
+	if (s_pSwitchHandler != 0)
+	{
+		(*s_pSwitchHandler) (nThread);
+	}
+
+	if (nThread != 0)
+	{
+		swapcontext (&s_MainContext, &s_Context[nThread]);
+
+		SwitchTo (0);
+	}
+}
+
+// Timer
+
+unsigned GetClockTicks (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (unsigned) ((unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void usDelay (unsigned nMicroSeconds)
+{
+	unsigned nStartTicks = GetClockTicks ();
+
+	// other threads run meanwhile, the VPU does on the target too
+	while (GetClockTicks () - nStartTicks < nMicroSeconds)
+	{
+		SchedulerYield ();
+	}
+}
+
+void MsDelay (unsigned nMilliSeconds)
+{
+	usDelay (nMilliSeconds * 1000);
+}
+
+void RegisterPeriodicHandler (TPeriodicTimerHandler *pHandler)
+{
+	s_nNextPeriodicTicks = GetClockTicks () + PERIODIC_INTERVAL_US;
+	s_pPeriodicHandler = pHandler;
+}
+
+// Interrupts
+
+void ConnectInterrupt (unsigned nIRQ, TInterruptHandler *pHandler, void *pParam)
+{
+	if (nIRQ >= MAX_IRQS)
+	{
+		fprintf (stderr, "hostenv: invalid IRQ %u\n", nIRQ);
+		abort ();
+	}
+
+	s_pIRQHandler[nIRQ] = pHandler;
+	s_pIRQParam[nIRQ] = pParam;
+}
+
+void HostRaiseInterrupt (unsigned nIRQ)
+{
+	if (nIRQ < MAX_IRQS)
+	{
+		s_bIRQPending[nIRQ] = 1;
+		s_bAnyIRQPending = 1;
+	}
+}
+
+void linuxemu_EnterCritical (void)
+{
+	s_nCriticalLevel++;
+}
+
+void linuxemu_LeaveCritical (void)
+{
+	if (s_nCriticalLevel == 0)
+	{
+		fprintf (stderr, "hostenv: unbalanced critical section\n");
+		abort ();
+	}
+
+	s_nCriticalLevel--;
+}
+
+void linuxemu_CleanAndInvalidateDataCacheRange (uintptr_t nAddress, size_t nLength)
+{
+	// the host is cache coherent with the simulated VPU
+}
+
+// called in the main context between the threads
+static void ServiceInterrupts (void)
+{
+	if (s_nCriticalLevel != 0)
+	{
+		return;
+	}
+
+	if (   s_pPeriodicHandler != 0
+	    && (int) (GetClockTicks () - s_nNextPeriodicTicks) >= 0)
+	{
+		s_nNextPeriodicTicks += PERIODIC_INTERVAL_US;
+		(*s_pPeriodicHandler) ();
+	}
+
+	while (s_bAnyIRQPending)
+	{
+		s_bAnyIRQPending = 0;
+
+		for (unsigned nIRQ = 0; nIRQ < MAX_IRQS; nIRQ++)
+		{
+			if (!s_bIRQPending[nIRQ])
+			{
+				continue;
+			}
+
+			s_bIRQPending[nIRQ] = 0;
+			if (s_pIRQHandler[nIRQ] != 0)
+			{
+				(*s_pIRQHandler[nIRQ]) (s_pIRQParam[nIRQ]);
+			}
+		}
+	}
+}
+
+int HostRun (int (*pMain) (void *), void *pParam)
+{
+	int nMainThread = SchedulerCreateThread (pMain, pParam);
+
+	while (!s_bFinished[nMainThread])
+	{
+		for (int i = 1; i < MAX_THREADS && !s_bFinished[nMainThread]; i++)
+		{
+			if (s_bUsed[i] && !s_bFinished[i])
+			{
+				SwitchTo (i);
+			}
+
+			ServiceInterrupts ();
+		}
+	}
+
+	return s_nResult[nMainThread];
+}
+
+// Memory
+
+static char s_CoherentRegion[512 * 1024] __attribute__ ((aligned (4096)));
+
+void *GetCoherentRegion512K ()
+{
+	return s_CoherentRegion;
+}
+
+#define POOL_SIZE		(64 * 1024 * 1024)
+#define POOL_MIN_ORDER		4		// 16 bytes
+#define POOL_ORDERS		28
+
+// freed blocks are kept in a list per power of two and reused
+typedef struct TPoolBlock
+{
+	unsigned nOrder;
+	unsigned nPadding[3];			// keeps the data 16-byte aligned
+	struct TPoolBlock *pNext;		// while free, overlaps the data
+}
+TPoolBlock;
+
+static char s_Pool[POOL_SIZE] __attribute__ ((aligned (16)));
+static size_t s_nPoolUsed = 0;
+static TPoolBlock *s_pFreeList[POOL_ORDERS];
+
+void *qwq_malloc (size_t size)
+{
+	unsigned nOrder = POOL_MIN_ORDER;
+	while (((size_t) 1 << nOrder) < size)
+	{
+		nOrder++;
+	}
+
+	if (nOrder >= POOL_ORDERS)
+	{
+		return 0;
+	}
+
+	TPoolBlock *pBlock = s_pFreeList[nOrder];
+	if (pBlock != 0)
+	{
+		s_pFreeList[nOrder] = pBlock->pNext;
+	}
+	else
+	{
+		size_t nBlockSize = offsetof (TPoolBlock, pNext) + ((size_t) 1 << nOrder);
+		if (s_nPoolUsed + nBlockSize > POOL_SIZE)
+		{
+			return 0;
+		}
+
+		pBlock = (TPoolBlock *) (s_Pool + s_nPoolUsed);
+		s_nPoolUsed += nBlockSize;
+		pBlock->nOrder = nOrder;
+	}
+
+	return &pBlock->pNext;
+}
+
+void qwq_free (void *ptr)
+{
+	if (ptr == 0)
+	{
+		return;
+	}
+
+	TPoolBlock *pBlock = (TPoolBlock *) ((char *) ptr - offsetof (TPoolBlock, pNext));
+	pBlock->pNext = s_pFreeList[pBlock->nOrder];
+	s_pFreeList[pBlock->nOrder] = pBlock;
+}
+
+// Logging
+
+void HostSetVerbose (int bVerbose)
+{
+	s_bVerbose = bVerbose;
+}
+
+void LogWrite (const char *pSource, unsigned Severity, const char *pMessage, ...)
+{
+	if (!s_bVerbose && Severity > LOG_ERROR)
+	{
+		return;
+	}
+
+	va_list var;
+	va_start (var, pMessage);
+
+	fprintf (stderr, "%s: ", pSource);
+	vfprintf (stderr, pMessage, var);
+	fprintf (stderr, "\n");
+
+	va_end (var);
+}
+
+// replaces printk.c, which is limited by the target's sprintf()
+int printk (const char *fmt, ...)
+{
+	if (!s_bVerbose)
+	{
+		return 0;
+	}
+
+	va_list var;
+	va_start (var, fmt);
+
+	int nResult = vfprintf (stderr, fmt, var);
+
+	va_end (var);
+
+	return nResult;
+}
+
+void qwq_assertion_failed (const char *pExpr, const char *pFile, unsigned nLine)
+{
+	fprintf (stderr, "assertion failed: %s (%s:%u)\n", pExpr, pFile, nLine);
+
+	abort ();
+}
@@ -0,0 +1,27 @@
+//
+// hostenv.h
+//
+// Host implementation of the environment (<linux/env.h>) for the render harness
+//
+#ifndef _hostenv_h
+#define _hostenv_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runs pMain in a new thread and schedules all threads, until it returns
+// returns the result of pMain
+int HostRun (int (*pMain) (void *), void *pParam);
+
+// The interrupt is delivered on the next thread switch, when no critical section is held
+void HostRaiseInterrupt (unsigned nIRQ);
+
+// Log messages and printk() are written to stderr, if enabled
+void HostSetVerbose (int bVerbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
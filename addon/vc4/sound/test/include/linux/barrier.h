@@ -0,0 +1,20 @@
+//
+// barrier.h
+//
+// Host replacement of <linux/barrier.h> for the render harness
+//
+#ifndef _linux_barrier_h
+#define _linux_barrier_h
+
+#define dsb()		__sync_synchronize ()
+#define dmb()		__sync_synchronize ()
+
+#define wmb		dsb
+#define rmb		dmb
+#define mb		dsb
+
+#define smp_wmb		wmb
+#define smp_rmb		rmb
+#define smp_mb		mb
+
+#endif
@@ -0,0 +1,30 @@
+//
+// synchronize.h
+//
+// Host replacement of <linux/synchronize.h> for the render harness,
+// implemented in hostenv.c
+//
+#ifndef _linuxemu_synchronize_h
+#define _linuxemu_synchronize_h
+
+#include <linux/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void linuxemu_EnterCritical (void);		// defer interrupts (nested calls possible)
+void linuxemu_LeaveCritical (void);		// allow interrupts again (nested calls possible)
+
+void linuxemu_CleanAndInvalidateDataCacheRange (uintptr nAddress, size_t nLength);
+
+#define DataSyncBarrier()	__sync_synchronize ()
+#define DataMemBarrier()	__sync_synchronize ()
+
+#define CompilerBarrier()	__asm volatile ("" ::: "memory")
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+//
+// mixerbench.c
+//
+// Benchmark of CSoundMixer: how many voices can be mixed per millisecond of CPU time
+//
+// One voice for one millisecond is 48 frames at 48 kHz. The result is the number of
+// such voice milliseconds, which are mixed in one millisecond of CPU time, this is the
+// number of voices, which one core could mix in real time, if it did nothing else.
+//
+#include <vc4/sound/soundmixer.h>
+#include "bench.h"
+
+#include <stdio.h>
+
+#define SAMPLE_RATE		48000
+#define CHUNK_SIZE		4000		// words, like the sample program
+#define SOUND_FRAMES		(SAMPLE_RATE / 2)
+#define MIN_SECONDS		0.2
+
+static int16_t s_MonoSound[SOUND_FRAMES];
+static int16_t s_StereoSound[SOUND_FRAMES * 2];
+static int16_t s_Buffer[CHUNK_SIZE];
+
+static CSoundMixer s_Mixer;
+
+static void Render (void *pParam)
+{
+	CSoundMixer_Render (&s_Mixer, s_Buffer, CHUNK_SIZE);
+}
+
+static double Measure (unsigned nVoices, unsigned nChannels)
+{
+	CSoundMixer_Ctor (&s_Mixer);
+
+	for (unsigned i = 0; i < nVoices; i++)
+	{
+		// the pan is spread over all voices, so that both halves are saturated
+		int nPan = SOUND_MIXER_PAN_LEFT + (int) (i * 2 * SOUND_MIXER_PAN_RIGHT / SOUND_MIXER_MAX_VOICES);
+
+		if (CSoundMixer_Play (&s_Mixer, nChannels == 1 ? s_MonoSound : s_StereoSound,
+				      SOUND_FRAMES, nChannels, SOUND_MIXER_GAIN_UNITY, nPan, TRUE) < 0)
+		{
+			return 0.0;
+		}
+	}
+
+	double fSeconds = BenchRun (Render, 0, MIN_SECONDS);
+
+	double fVoiceMs = nVoices * (CHUNK_SIZE / 2) * 1000.0 / SAMPLE_RATE;
+
+	return fVoiceMs / (fSeconds * 1000.0);
+}
+
+int main (void)
+{
+	unsigned nRandom = 1;
+	for (unsigned i = 0; i < SOUND_FRAMES; i++)
+	{
+		s_MonoSound[i] = (int16_t) BenchRandom (&nRandom);
+		s_StereoSound[i*2] = (int16_t) BenchRandom (&nRandom);
+		s_StereoSound[i*2+1] = (int16_t) BenchRandom (&nRandom);
+	}
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+	const char *pPath = "NEON";
+#elif RASPPI == 1 && defined (__arm__)
+	const char *pPath = "ARMv6 SIMD";
+#else
+	const char *pPath = "scalar";
+#endif
+	printf ("CSoundMixer, %s path, chunk %u words at %u Hz\n\n", pPath, CHUNK_SIZE, SAMPLE_RATE);
+	printf ("voices    mono voices/ms   stereo voices/ms\n");
+
+	for (unsigned nVoices = 1; nVoices <= SOUND_MIXER_MAX_VOICES; nVoices *= 2)
+	{
+		printf ("%6u %17.1f %18.1f\n", nVoices, Measure (nVoices, 1), Measure (nVoices, 2));
+	}
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+//
+// oscbench.c
+//
+// Benchmark of CSoundOscillator against the sin() synthesis, which the sample program used
+//
+// The sin() path is the former synth() of sample/main.c: one double precision sin() call
+// per frame, written to both channels. The results are frames (stereo samples) per second
+// of CPU time. The peak error of the sine table is shown too.
+//
+#include <vc4/sound/soundoscillator.h>
+#include "bench.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#define SAMPLE_RATE		48000
+#define CHUNK_SIZE		4000		// words, like the sample program
+#define FREQUENCY		440.0f
+#define MIN_SECONDS		0.2
+
+static int16_t s_Buffer[CHUNK_SIZE];
+
+static CSoundOscillator s_Oscillator;
+
+static const char *s_pWaveformName[SoundWaveformUnknown] =
+{
+	"sine", "sawtooth", "square", "triangle"
+};
+
+// the former synth() of sample/main.c
+static void SinPath (void *pParam)
+{
+	static uint8_t phase = 0;
+
+	for (unsigned i = 0; i < CHUNK_SIZE; i += 2)
+	{
+		int16_t sample = (int16_t) (32767 * sin (phase / 255.0 * M_PI * 2));
+		s_Buffer[i] = s_Buffer[i + 1] = sample;
+		phase += 2;
+	}
+}
+
+static void OscillatorPath (void *pParam)
+{
+	CSoundOscillator_Render (&s_Oscillator, s_Buffer, CHUNK_SIZE);
+}
+
+// peak deviation of the sine table from sin() in LSB
+static double SineError (void)
+{
+	CSoundOscillator_Ctor (&s_Oscillator, SoundWaveformSine, SAMPLE_RATE);
+	CSoundOscillator_SetFrequency (&s_Oscillator, FREQUENCY);
+
+	double fMaxError = 0.0;
+	unsigned nFrame = 0;
+	for (unsigned nChunk = 0; nChunk < 24; nChunk++)
+	{
+		CSoundOscillator_Render (&s_Oscillator, s_Buffer, CHUNK_SIZE);
+
+		for (unsigned i = 0; i < CHUNK_SIZE; i += 2, nFrame++)
+		{
+			double fExpected = 32767.0 * sin (2.0 * M_PI * FREQUENCY * nFrame / SAMPLE_RATE);
+			double fError = fabs (s_Buffer[i] - fExpected);
+			if (fError > fMaxError)
+			{
+				fMaxError = fError;
+			}
+		}
+	}
+
+	return fMaxError;
+}
+
+int main (void)
+{
+	const double fFrames = CHUNK_SIZE / 2;
+
+#if RASPPI >= 2 && (defined (__ARM_NEON__) || defined (__ARM_NEON))
+	const char *pPath = "NEON";
+#else
+	const char *pPath = "scalar";
+#endif
+	printf ("CSoundOscillator, %s path, chunk %u words at %u Hz\n\n", pPath, CHUNK_SIZE, SAMPLE_RATE);
+	printf ("source               Mframes/s   x sin()\n");
+
+	double fSinRate = fFrames / BenchRun (SinPath, 0, MIN_SECONDS);
+	printf ("%-20s %10.2f %9.1f\n", "sin() (sample)", fSinRate / 1e6, 1.0);
+
+	for (unsigned w = 0; w < SoundWaveformUnknown; w++)
+	{
+		CSoundOscillator_Ctor (&s_Oscillator, (enum TSoundWaveform) w, SAMPLE_RATE);
+		CSoundOscillator_SetFrequency (&s_Oscillator, FREQUENCY);
+
+		double fRate = fFrames / BenchRun (OscillatorPath, 0, MIN_SECONDS);
+		printf ("%-20s %10.2f %9.1f\n", s_pWaveformName[w], fRate / 1e6, fRate / fSinRate);
+	}
+
+	printf ("\npeak error of the sine table: %.1f LSB\n", SineError ());
+
+	return 0;
+}
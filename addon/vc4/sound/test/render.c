@@ -0,0 +1,403 @@
+//
+// render.c
+//
+// Render harness: plays a test tone through CVCHIQSoundBaseDevice and the VCHIQ core
+// into the simulated VPU and reports the throughput and the latency of the data path
+//
+#include <vc4/vchiq/vchiqdevice.h>
+#include <vc4/vchiq/vchiq_if.h>
+#include <vc4/sound/vchiqsoundbasedevice.h>
+#include <vc4/sound/soundoscillator.h>
+#include <linux/env.h>
+#include "hostenv.h"
+#include "vpusim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct TOptions
+{
+	unsigned nSampleRate;
+	unsigned nChunkSize;			// words
+	unsigned nDurationMs;			// of the rendered sound
+	enum TVCHIQSoundTransferMode TransferMode;
+	unsigned nMinLatencyMs;			// adaptive mode, if nMaxLatencyMs != 0
+	unsigned nMaxLatencyMs;
+	unsigned nSlotsPerSide;			// 0 for the default
+	unsigned nDoorbellWindowUs;
+	unsigned nRenderLoadUs;			// busy time added to each chunk_cb() call
+	const char *pTimingFile;
+	TVPUSimConfig VPU;
+}
+TOptions;
+
+static TOptions s_Options =
+{
+	48000, 4000, 5000, VCHIQSoundTransferAuto, 0, 0, 0, 0, 0, 0,
+	{2, 1, 0}
+};
+
+static CVCHIQDevice s_VCHIQ;
+static CVCHIQSoundBaseDevice s_Sound;
+static CSoundOscillator s_Oscillator;
+
+static unsigned long long s_nFramesLeft;
+static unsigned s_nChunks;
+static unsigned s_nChunkWords;			// rendered of the current chunk
+static unsigned s_RenderTicks[VPUSIM_MAX_CHUNKS];
+
+static unsigned Render (int16_t *pBuffer, unsigned nChunkSize)
+{
+	if (s_nFramesLeft == 0)
+	{
+		return 0;
+	}
+
+	// in message mode a chunk is rendered in packets, the first one starts the chunk
+	unsigned nTicks = GetClockTicks ();
+	if (s_nChunkWords == 0)
+	{
+		if (s_nChunks < VPUSIM_MAX_CHUNKS)
+		{
+			s_RenderTicks[s_nChunks] = nTicks;
+		}
+		s_nChunks++;
+	}
+
+	s_nChunkWords += nChunkSize;
+	if (s_nChunkWords >= s_Sound.m_nChunkSize)
+	{
+		s_nChunkWords = 0;
+	}
+
+	if (nChunkSize / 2 > s_nFramesLeft)
+	{
+		nChunkSize = (unsigned) s_nFramesLeft * 2;
+	}
+	s_nFramesLeft -= nChunkSize / 2;
+
+	CSoundOscillator_Render (&s_Oscillator, pBuffer, nChunkSize);
+
+	// simulates a more expensive sound source
+	while (GetClockTicks () - nTicks < s_Options.nRenderLoadUs)
+	{
+		// just wait
+	}
+
+	return nChunkSize;
+}
+
+typedef struct TMinMax
+{
+	unsigned nCount;
+	unsigned nMin;
+	unsigned nMax;
+	unsigned long long nSum;
+}
+TMinMax;
+
+static void AddValue (TMinMax *pMinMax, unsigned nValue)
+{
+	if (pMinMax->nCount == 0 || nValue < pMinMax->nMin)
+	{
+		pMinMax->nMin = nValue;
+	}
+
+	if (pMinMax->nCount == 0 || nValue > pMinMax->nMax)
+	{
+		pMinMax->nMax = nValue;
+	}
+
+	pMinMax->nSum += nValue;
+	pMinMax->nCount++;
+}
+
+static void PrintMinMax (const char *pName, const TMinMax *pMinMax)
+{
+	if (pMinMax->nCount == 0)
+	{
+		printf ("%-24s n/a\n", pName);
+
+		return;
+	}
+
+	printf ("%-24s min %u, avg %llu, max %u us\n", pName, pMinMax->nMin,
+		pMinMax->nSum / pMinMax->nCount, pMinMax->nMax);
+}
+
+// the timing of each chunk, relative to the start of the stream
+static void WriteTimingFile (const char *pFileName, unsigned nStartTicks)
+{
+	FILE *pFile = fopen (pFileName, "w");
+	if (pFile == 0)
+	{
+		fprintf (stderr, "Cannot create %s\n", pFileName);
+
+		return;
+	}
+
+	fprintf (pFile, "chunk,bytes,silence,render_us,arrival_us,ready_us,play_us,complete_us\n");
+
+	for (unsigned i = 0; i < s_nChunks && i < VPUSIM_MAX_CHUNKS; i++)
+	{
+		const TVPUSimChunk *pChunk = VPUSimGetChunk (i);
+		if (pChunk == 0)
+		{
+			break;
+		}
+
+		fprintf (pFile, "%u,%u,%d,%u,%u,%u,%u,%u\n", i, pChunk->nBytes, pChunk->bSilence,
+			 s_RenderTicks[i] - nStartTicks,
+			 pChunk->nArrivalTicks - nStartTicks,
+			 pChunk->nReadyTicks - nStartTicks,
+			 pChunk->nPlayTicks - nStartTicks,
+			 pChunk->nCompleteTicks - nStartTicks);
+	}
+
+	fclose (pFile);
+}
+
+static void PrintResults (unsigned nStartTicks, unsigned nEndTicks, clock_t nCPUTime)
+{
+	const TOptions *pOpt = &s_Options;
+
+	TMinMax RenderToPlay = {0}, WriteToComplete = {0}, RenderToComplete = {0};
+	for (unsigned i = 0; i < s_nChunks && i < VPUSIM_MAX_CHUNKS; i++)
+	{
+		const TVPUSimChunk *pChunk = VPUSimGetChunk (i);
+		if (pChunk == 0 || pChunk->nCompleteTicks == 0)
+		{
+			break;
+		}
+
+		AddValue (&RenderToPlay, pChunk->nPlayTicks - s_RenderTicks[i]);
+		AddValue (&WriteToComplete, pChunk->nCompleteTicks - pChunk->nArrivalTicks);
+		AddValue (&RenderToComplete, pChunk->nCompleteTicks - s_RenderTicks[i]);
+	}
+
+	TVCHIQSoundStats Stats;
+	CVCHIQSoundBaseDevice_GetStats (&s_Sound, &Stats);
+
+	TVPUSimStats VPUStats;
+	VPUSimGetStats (&VPUStats);
+
+	VCHIQ_DOORBELL_STATS_T Doorbell;
+	vchiq_get_doorbell_stats (&Doorbell);
+
+	VCHIQ_SLOT_STATS_T Slots;
+	vchiq_get_slot_stats (&Slots);
+
+	double fWallSecs = (nEndTicks - nStartTicks) / 1000000.0;
+	double fCPUSecs = (double) nCPUTime / CLOCKS_PER_SEC;
+	double fSoundSecs = (double) VPUStats.nFramesPlayed / pOpt->nSampleRate;
+
+	printf ("transfer mode           %s\n", s_Sound.m_bBulkMode ? "bulk" : "messages");
+	printf ("VPU                     %s\n", pOpt->VPU.bRealtime ? "realtime" : "fast");
+	printf ("chunk size              %u words, %u chunks\n", s_Sound.m_nChunkSize, s_nChunks);
+	printf ("frames played           %llu (%.3f s)\n", VPUStats.nFramesPlayed, fSoundSecs);
+	printf ("wall time               %.3f s (%.2fx realtime)\n", fWallSecs,
+		fWallSecs > 0.0 ? fSoundSecs / fWallSecs : 0.0);
+	printf ("CPU time                %.3f s\n", fCPUSecs);
+	if (fWallSecs > 0.0)
+	{
+		printf ("throughput              %.0f frames/s, %.2f MByte/s\n",
+			VPUStats.nFramesPlayed / fWallSecs,
+			VPUStats.nFramesPlayed * 4.0 / fWallSecs / 1000000.0);
+	}
+
+	PrintMinMax ("render to DAC", &RenderToPlay);
+	PrintMinMax ("render to COMPLETE", &RenderToComplete);
+	PrintMinMax ("WRITE to COMPLETE", &WriteToComplete);
+
+	printf ("DAC underruns           %u (%llu frames)\n", VPUStats.nUnderruns,
+		VPUStats.nUnderrunFrames);
+	printf ("device underruns        %u, source underruns %u\n", Stats.nUnderruns,
+		Stats.nSourceUnderruns);
+	printf ("device latency          last %u, max %u us\n", Stats.nLatencyUs, Stats.nLatencyMaxUs);
+	printf ("messages                ARM->VPU %u, VPU->ARM %u, bulks %u\n",
+		VPUStats.nMessagesRx, VPUStats.nMessagesTx, VPUStats.nBulks);
+	printf ("doorbells               rung %u (signals %u, coalesced %u, deferred %u), "
+		"seen %u, ARM interrupts %u\n",
+		Doorbell.doorbells, Doorbell.signals, Doorbell.coalesced, Doorbell.deferred,
+		VPUStats.nDoorbells, VPUStats.nInterrupts);
+	printf ("slots                   %u per side, data quota %u, slot stalls %u, "
+		"data stalls %u, quota stalls %u, VPU stalls %u\n",
+		Slots.slots_per_side, Slots.data_quota, Slots.slot_stalls, Slots.data_stalls,
+		Slots.quota_stalls, VPUStats.nTxStalls);
+}
+
+static int RenderMain (void *pParam)
+{
+	const TOptions *pOpt = &s_Options;
+
+	if (!CVCHIQDevice_Initialize (&s_VCHIQ, pOpt->nSlotsPerSide, 0))
+	{
+		fprintf (stderr, "Cannot initialize VCHIQ\n");
+
+		return 1;
+	}
+
+	vchiq_set_doorbell_window (pOpt->nDoorbellWindowUs);
+
+	CVCHIQSoundBaseDevice_Ctor (&s_Sound, &s_VCHIQ, pOpt->nSampleRate, pOpt->nChunkSize,
+				    VCHIQSoundDestinationAuto);
+	CVCHIQSoundBaseDevice_SetTransferMode (&s_Sound, pOpt->TransferMode);
+	if (pOpt->nMaxLatencyMs != 0)
+	{
+		CVCHIQSoundBaseDevice_SetAdaptive (&s_Sound, pOpt->nMinLatencyMs, pOpt->nMaxLatencyMs);
+	}
+
+	CSoundOscillator_Ctor (&s_Oscillator, SoundWaveformSine, pOpt->nSampleRate);
+	CSoundOscillator_SetFrequency (&s_Oscillator, 440.0f);
+
+	s_nFramesLeft = (unsigned long long) pOpt->nSampleRate * pOpt->nDurationMs / 1000;
+	s_Sound.chunk_cb = Render;
+
+	unsigned nStartTicks = GetClockTicks ();
+	clock_t nStartClock = clock ();
+
+	if (!CVCHIQSoundBaseDevice_Start (&s_Sound))
+	{
+		fprintf (stderr, "Cannot start sound device\n");
+
+		return 1;
+	}
+
+	while (CVCHIQSoundBaseDevice_IsActive (&s_Sound))
+	{
+		SchedulerYield ();
+	}
+
+	unsigned nEndTicks = GetClockTicks ();
+	clock_t nCPUTime = clock () - nStartClock;
+
+	VPUSimFinish ();
+
+	PrintResults (nStartTicks, nEndTicks, nCPUTime);
+
+	if (pOpt->pTimingFile != 0)
+	{
+		WriteTimingFile (pOpt->pTimingFile, nStartTicks);
+	}
+
+	return s_Sound.m_State == VCHIQSoundError ? 1 : 0;
+}
+
+static void Usage (void)
+{
+	fprintf (stderr,
+		 "usage: render [options]\n"
+		 "  -r rate       sample rate in Hz (48000)\n"
+		 "  -c words      chunk size (4000)\n"
+		 "  -t ms         duration of the sound (5000)\n"
+		 "  -m mode       transfer mode: auto, messages, bulk (auto)\n"
+		 "  -a min,max    adaptive mode with latency bounds in ms\n"
+		 "  -s slots      slots per side, 5..63 (32)\n"
+		 "  -b us         doorbell window (0)\n"
+		 "  -l us         busy time in each chunk_cb() call (0)\n"
+		 "  -p version    AUDS version of the VPU, < 2 for bulk only (2)\n"
+		 "  -d us         VPU handles the doorbell at most every us (0)\n"
+		 "  -f            fast VPU, completes the data at once (realtime)\n"
+		 "  -w file       write the received sound to a WAV file\n"
+		 "  -o file       write the timing of each chunk to a CSV file\n"
+		 "  -v            verbose, log messages to stderr\n");
+}
+
+int main (int argc, char **argv)
+{
+	TOptions *pOpt = &s_Options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *pArg = argv[i];
+		const char *pValue = i + 1 < argc ? argv[i + 1] : "";
+		int nValue = 0;
+
+		if (strcmp (pArg, "-f") == 0)
+		{
+			pOpt->VPU.bRealtime = 0;
+			continue;
+		}
+		else if (strcmp (pArg, "-v") == 0)
+		{
+			HostSetVerbose (1);
+			continue;
+		}
+
+		if (pArg[0] != '-' || pArg[1] == '\0' || pArg[2] != '\0' || i + 1 == argc)
+		{
+			Usage ();
+
+			return 2;
+		}
+		i++;
+
+		switch (pArg[1])
+		{
+		case 'w':	pOpt->VPU.pWAVFile = pValue;	continue;
+		case 'o':	pOpt->pTimingFile = pValue;	continue;
+
+		case 'm':
+			if (strcmp (pValue, "auto") == 0)
+			{
+				pOpt->TransferMode = VCHIQSoundTransferAuto;
+			}
+			else if (strcmp (pValue, "messages") == 0)
+			{
+				pOpt->TransferMode = VCHIQSoundTransferMessages;
+			}
+			else if (strcmp (pValue, "bulk") == 0)
+			{
+				pOpt->TransferMode = VCHIQSoundTransferBulk;
+			}
+			else
+			{
+				Usage ();
+
+				return 2;
+			}
+			continue;
+
+		case 'a':
+			if (sscanf (pValue, "%u,%u", &pOpt->nMinLatencyMs, &pOpt->nMaxLatencyMs) != 2)
+			{
+				Usage ();
+
+				return 2;
+			}
+			continue;
+
+		default:
+			break;
+		}
+
+		if (sscanf (pValue, "%d", &nValue) != 1 || nValue < 0)
+		{
+			Usage ();
+
+			return 2;
+		}
+
+		switch (pArg[1])
+		{
+		case 'r':	pOpt->nSampleRate = nValue;		break;
+		case 'c':	pOpt->nChunkSize = nValue & ~1;		break;
+		case 't':	pOpt->nDurationMs = nValue;		break;
+		case 's':	pOpt->nSlotsPerSide = nValue;		break;
+		case 'b':	pOpt->nDoorbellWindowUs = nValue;	break;
+		case 'l':	pOpt->nRenderLoadUs = nValue;		break;
+		case 'p':	pOpt->VPU.nPeerVersion = (short) nValue; break;
+		case 'd':	pOpt->VPU.nServiceUs = nValue;		break;
+
+		default:
+			Usage ();
+
+			return 2;
+		}
+	}
+
+	VPUSimInit (&pOpt->VPU);
+
+	return HostRun (RenderMain, 0);
+}
@@ -0,0 +1,260 @@
+//
+// resamplertest.c
+//
+// THD+N test and throughput benchmark of CSoundResampler
+//
+// A 1 kHz sine wave at the source rate is converted to 48 kHz. The fundamental is fitted
+// by least squares to the output and the rest (harmonics, images, aliases, noise) is
+// reported relative to it. The 96 kHz source is checked with a 40 kHz tone too, which
+// must be removed, because it is above the Nyquist frequency of the output. The input is
+// passed in small pieces too, which must give the same output, because all input frames
+// are consumed. The program fails (exit code 1), if a result is worse than the limit of
+// its quality or the output of the pieces differs.
+//
+#include <vc4/sound/soundresampler.h>
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define OUTPUT_RATE		48000
+#define TEST_FREQUENCY		1000.0
+#define ALIAS_FREQUENCY		40000.0
+#define AMPLITUDE		16384.0		// -6 dBFS
+
+#define INPUT_FRAMES		96000		// one second at the highest source rate
+#define BLOCK_FRAMES		2000		// output frames per call, like a chunk of 4000 words
+#define SETTLE_FRAMES		1000		// skipped at the start of the output
+#define PIECE_FRAMES		7		// input frames per call in the piece test
+#define PIECE_RATE		44100
+#define MIN_SECONDS		0.2
+
+static const unsigned s_InputRates[] = {8000, 11025, 22050, 32000, 44100, 96000};
+#define NUM_RATES		(sizeof s_InputRates / sizeof s_InputRates[0])
+
+// worst allowed results in dB (THD+N at 1 kHz, level of the 40 kHz tone),
+// the linear interpolation has no anti-aliasing filter
+static const double s_fTHDNLimit[SoundResamplerUnknown]  = {-30.0, -80.0};
+static const double s_fAliasLimit[SoundResamplerUnknown] = {  6.0, -60.0};
+
+static const char *s_pQualityName[SoundResamplerUnknown] = {"linear", "sinc"};
+
+static int16_t s_Input[INPUT_FRAMES * 2];
+static int16_t s_Output[OUTPUT_RATE * 2 * 2];
+static int16_t s_Reference[OUTPUT_RATE * 2 * 2];
+
+static CSoundResampler s_Resampler;
+
+static void GenerateSine (unsigned nRate, double fFrequency)
+{
+	for (unsigned i = 0; i < INPUT_FRAMES; i++)
+	{
+		int16_t nSample = (int16_t) lrint (AMPLITUDE * sin (2.0 * M_PI * fFrequency * i / nRate));
+		s_Input[i*2] = nSample;
+		s_Input[i*2+1] = nSample;
+	}
+}
+
+// converts nInFrames of s_Input into s_Output in blocks, returns the output frames
+static unsigned Convert (unsigned nInFrames)
+{
+	CSoundResampler_Reset (&s_Resampler);
+
+	unsigned nIn = 0;
+	unsigned nOut = 0;
+	while (   nIn < nInFrames
+	       && nOut + BLOCK_FRAMES <= sizeof s_Output / sizeof s_Output[0] / 2)
+	{
+		unsigned nUsed;
+		unsigned nFrames = CSoundResampler_Process (&s_Resampler, s_Input + nIn*2, nInFrames - nIn,
+							    &nUsed, s_Output + nOut*2, BLOCK_FRAMES);
+		nOut += nFrames;
+		nIn += nUsed;
+	}
+
+	return nOut;
+}
+
+// converts nInFrames in pieces of PIECE_FRAMES, the output must be the same as with one block
+static int CheckPieces (unsigned nInFrames)
+{
+	unsigned nOutFrames = Convert (nInFrames);
+	memcpy (s_Reference, s_Output, nOutFrames * 2 * sizeof (int16_t));
+
+	CSoundResampler_Reset (&s_Resampler);
+
+	unsigned nOut = 0;
+	for (unsigned nIn = 0; nIn < nInFrames; nIn += PIECE_FRAMES)
+	{
+		unsigned nPiece = nInFrames - nIn < PIECE_FRAMES ? nInFrames - nIn : PIECE_FRAMES;
+
+		unsigned nUsed;
+		nOut += CSoundResampler_Process (&s_Resampler, s_Input + nIn*2, nPiece, &nUsed,
+						 s_Output + nOut*2, sizeof s_Output / sizeof s_Output[0] / 2 - nOut);
+		if (nUsed != nPiece)
+		{
+			return 0;
+		}
+	}
+
+	return    nOut == nOutFrames
+	       && memcmp (s_Output, s_Reference, nOutFrames * 2 * sizeof (int16_t)) == 0;
+}
+
+// THD+N of the left channel in dB relative to the fitted fundamental
+static double MeasureTHDN (unsigned nFrames, double fFrequency)
+{
+	const int16_t *pOut = s_Output + SETTLE_FRAMES*2;
+	nFrames -= SETTLE_FRAMES;
+
+	// the fundamental is a*sin + b*cos + c, solved with the normal equations
+	double S[3][3] = {{0}}, R[3] = {0};
+	for (unsigned i = 0; i < nFrames; i++)
+	{
+		double fPhase = 2.0 * M_PI * fFrequency * i / OUTPUT_RATE;
+		double v[3] = {sin (fPhase), cos (fPhase), 1.0};
+		for (unsigned j = 0; j < 3; j++)
+		{
+			for (unsigned k = 0; k < 3; k++)
+			{
+				S[j][k] += v[j] * v[k];
+			}
+			R[j] += v[j] * pOut[i*2];
+		}
+	}
+
+	for (unsigned j = 0; j < 3; j++)		// Gauss-Jordan, S is positive definite
+	{
+		for (unsigned k = 0; k < 3; k++)
+		{
+			if (k != j)
+			{
+				double f = S[k][j] / S[j][j];
+				for (unsigned l = 0; l < 3; l++)
+				{
+					S[k][l] -= f * S[j][l];
+				}
+				R[k] -= f * R[j];
+			}
+		}
+	}
+	double a = R[0] / S[0][0], b = R[1] / S[1][1], c = R[2] / S[2][2];
+
+	double fResidual = 0.0;
+	for (unsigned i = 0; i < nFrames; i++)
+	{
+		double fPhase = 2.0 * M_PI * fFrequency * i / OUTPUT_RATE;
+		double e = pOut[i*2] - (a * sin (fPhase) + b * cos (fPhase) + c);
+		fResidual += e * e;
+	}
+
+	double fSignal = (a * a + b * b) / 2.0 * nFrames;
+
+	return 10.0 * log10 (fResidual / fSignal);
+}
+
+// level of the output relative to the input tone in dB
+static double MeasureLevel (unsigned nFrames)
+{
+	const int16_t *pOut = s_Output + SETTLE_FRAMES*2;
+	nFrames -= SETTLE_FRAMES;
+
+	double fPower = 0.0;
+	for (unsigned i = 0; i < nFrames; i++)
+	{
+		fPower += (double) pOut[i*2] * pOut[i*2];
+	}
+
+	fPower /= nFrames;
+	if (fPower < 1e-3)
+	{
+		fPower = 1e-3;
+	}
+
+	return 10.0 * log10 (fPower / (AMPLITUDE * AMPLITUDE / 2.0));
+}
+
+static unsigned s_nBenchFrames;
+
+static void BenchConvert (void *pParam)
+{
+	Convert (s_nBenchFrames);
+}
+
+int main (void)
+{
+	int nResult = 0;
+
+	printf ("CSoundResampler to %u Hz, %u taps, %u phases\n\n",
+		OUTPUT_RATE, SOUND_RESAMPLER_TAPS, SOUND_RESAMPLER_PHASES);
+	printf ("quality  input Hz   THD+N dB   40k tone dB   Mframes/s   x realtime\n");
+
+	for (unsigned q = 0; q < SoundResamplerUnknown; q++)
+	{
+		enum TSoundResamplerQuality Quality = (enum TSoundResamplerQuality) q;
+
+		for (unsigned r = 0; r < NUM_RATES; r++)
+		{
+			unsigned nRate = s_InputRates[r];
+			CSoundResampler_Ctor (&s_Resampler, nRate, OUTPUT_RATE, Quality);
+
+			unsigned nInFrames = nRate < INPUT_FRAMES ? nRate : INPUT_FRAMES;
+
+			GenerateSine (nRate, TEST_FREQUENCY);
+			unsigned nOutFrames = Convert (nInFrames);
+			double fTHDN = MeasureTHDN (nOutFrames, TEST_FREQUENCY);
+			int bFailed = fTHDN > s_fTHDNLimit[q];
+
+			double fAlias = 0.0;
+			int bAliasTested = ALIAS_FREQUENCY < nRate / 2;
+			if (bAliasTested)
+			{
+				GenerateSine (nRate, ALIAS_FREQUENCY);
+				fAlias = MeasureLevel (Convert (nInFrames));
+				bFailed |= fAlias > s_fAliasLimit[q];
+			}
+
+			// output frames per second of CPU time
+			GenerateSine (nRate, TEST_FREQUENCY);
+			s_nBenchFrames = nInFrames;
+			double fSeconds = BenchRun (BenchConvert, 0, MIN_SECONDS);
+			double fFramesPerSecond = nOutFrames / fSeconds;
+
+			printf ("%-7s %9u %10.1f ", s_pQualityName[q], nRate, fTHDN);
+			if (bAliasTested)
+			{
+				printf ("%13.1f", fAlias);
+			}
+			else
+			{
+				printf ("%13s", "-");
+			}
+			printf (" %11.2f %12.0f%s\n", fFramesPerSecond / 1e6, fFramesPerSecond / OUTPUT_RATE,
+				bFailed ? "   FAILED" : "");
+
+			if (bFailed)
+			{
+				nResult = 1;
+			}
+		}
+	}
+
+	printf ("\n%u Hz input in pieces of %u frames:", PIECE_RATE, PIECE_FRAMES);
+	for (unsigned q = 0; q < SoundResamplerUnknown; q++)
+	{
+		CSoundResampler_Ctor (&s_Resampler, PIECE_RATE, OUTPUT_RATE, (enum TSoundResamplerQuality) q);
+		GenerateSine (PIECE_RATE, TEST_FREQUENCY);
+
+		int bOK = CheckPieces (PIECE_RATE);
+		printf (" %s %s", s_pQualityName[q], bOK ? "ok" : "FAILED");
+
+		if (!bOK)
+		{
+			nResult = 1;
+		}
+	}
+	printf ("\n");
+
+	return nResult;
+}
@@ -0,0 +1,165 @@
+//
+// servicebench.c
+//
+// Benchmark of the service table of VCHIQ: cost of a lookup by port and by handle
+//
+// VCHIQ is brought up against the simulated VPU and a number of listening services is
+// added. port_to_service() of the grouped table is compared with a flat table of all
+// ports, as VCHIQ_STATE_T had it before. The ports are looked up in random order. The
+// host caches hide most of the difference, which the ARM1176 with its 16K L1 would see.
+//
+#include <vc4/vchiq/vchiqdevice.h>
+#include <vc4/vchiq/vchiq_core.h>
+#include <vc4/vchiq/vchiq_arm.h>
+#include "hostenv.h"
+#include "vpusim.h"
+#include "bench.h"
+
+#include <stdio.h>
+
+#define MAX_SERVICES		1024
+#define LOOKUPS			4096		// per call of the benchmark function
+#define MIN_SECONDS		0.2
+
+static const unsigned s_ServiceCounts[] = {2, 8, 32, 128, 1024};
+#define NUM_COUNTS		(sizeof s_ServiceCounts / sizeof s_ServiceCounts[0])
+
+static CVCHIQDevice s_VCHIQ;
+
+static VCHIQ_STATE_T *s_pState;
+static VCHIQ_SERVICE_HANDLE_T s_hService[MAX_SERVICES];
+
+static VCHIQ_SERVICE_T *s_FlatTable[VCHIQ_MAX_SERVICES];	// the former layout
+
+static unsigned s_Port[LOOKUPS];
+static VCHIQ_SERVICE_HANDLE_T s_Handle[LOOKUPS];
+
+static volatile uintptr_t s_nSink;
+
+static VCHIQ_STATUS_T ServiceCallback (VCHIQ_REASON_T Reason, VCHIQ_HEADER_T *pHeader,
+				       VCHIQ_SERVICE_HANDLE_T hService, void *pParam)
+{
+	return VCHIQ_SUCCESS;
+}
+
+static void LookupFlat (void *pParam)
+{
+	uintptr_t nSum = 0;
+	for (unsigned i = 0; i < LOOKUPS; i++)
+	{
+		nSum += (uintptr_t) s_FlatTable[s_Port[i]];
+	}
+
+	s_nSink = nSum;
+}
+
+static void LookupGrouped (void *pParam)
+{
+	uintptr_t nSum = 0;
+	for (unsigned i = 0; i < LOOKUPS; i++)
+	{
+		nSum += (uintptr_t) port_to_service (s_pState, s_Port[i]);
+	}
+
+	s_nSink = nSum;
+}
+
+// the whole path of the API functions
+static void FindByHandle (void *pParam)
+{
+	uintptr_t nSum = 0;
+	for (unsigned i = 0; i < LOOKUPS; i++)
+	{
+		VCHIQ_SERVICE_T *pService = find_service_by_handle (s_Handle[i]);
+		nSum += (uintptr_t) pService;
+		unlock_service (pService);
+	}
+
+	s_nSink = nSum;
+}
+
+static int BenchMain (void *pParam)
+{
+	if (!CVCHIQDevice_Initialize (&s_VCHIQ, 0, 0))
+	{
+		fprintf (stderr, "Cannot initialize VCHIQ\n");
+
+		return 1;
+	}
+
+	VCHIQ_INSTANCE_T Instance;
+	if (vchiq_initialise (&Instance) != VCHIQ_SUCCESS)
+	{
+		fprintf (stderr, "Cannot initialise VCHIQ instance\n");
+
+		return 1;
+	}
+
+	s_pState = vchiq_get_state ();
+
+	unsigned nFlatSize =   VCHIQ_MAX_SERVICES * (sizeof (VCHIQ_SERVICE_T *) + sizeof (VCHIQ_SERVICE_QUOTA_T))
+			     + BITSET_SIZE (VCHIQ_MAX_SERVICES) * sizeof (atomic_t);
+	printf ("VCHIQ service table, %u ports, groups of %u\n\n",
+		VCHIQ_MAX_SERVICES, VCHIQ_SERVICE_GROUP_SIZE);
+	printf ("services   table bytes (flat)   flat ns   grouped ns   by handle ns\n");
+
+	unsigned nServices = 0;
+	for (unsigned c = 0; c < NUM_COUNTS; c++)
+	{
+		for (; nServices < s_ServiceCounts[c]; nServices++)
+		{
+			VCHIQ_SERVICE_PARAMS_T Params;
+			Params.fourcc = VCHIQ_MAKE_FOURCC ('B', 'N', 'C', 'H');
+			Params.callback = ServiceCallback;
+			Params.userdata = 0;
+			Params.version = 1;
+			Params.version_min = 1;
+
+			if (vchiq_add_service (Instance, &Params, &s_hService[nServices]) != VCHIQ_SUCCESS)
+			{
+				fprintf (stderr, "Cannot add service %u\n", nServices);
+
+				return 1;
+			}
+
+			VCHIQ_SERVICE_T *pService = find_service_by_handle (s_hService[nServices]);
+			s_FlatTable[pService->localport] = pService;
+			unlock_service (pService);
+		}
+
+		unsigned nRandom = 1;
+		for (unsigned i = 0; i < LOOKUPS; i++)
+		{
+			unsigned nIndex = BenchRandom (&nRandom) % nServices;
+			s_Handle[i] = s_hService[nIndex];
+			s_Port[i] = s_hService[nIndex] & (VCHIQ_MAX_SERVICES - 1);
+		}
+
+		unsigned nGroups = 0;
+		for (unsigned i = 0; i < VCHIQ_SERVICE_GROUPS; i++)
+		{
+			if (s_pState->service_groups[i] != 0)
+			{
+				nGroups++;
+			}
+		}
+		unsigned nGroupedSize = sizeof s_pState->service_groups + nGroups * sizeof (VCHIQ_SERVICE_GROUP_T);
+
+		double fFlat = BenchRun (LookupFlat, 0, MIN_SECONDS) / LOOKUPS;
+		double fGrouped = BenchRun (LookupGrouped, 0, MIN_SECONDS) / LOOKUPS;
+		double fHandle = BenchRun (FindByHandle, 0, MIN_SECONDS) / LOOKUPS;
+
+		printf ("%8u %13u (%u) %9.2f %12.2f %14.2f\n", nServices, nGroupedSize, nFlatSize,
+			fFlat * 1e9, fGrouped * 1e9, fHandle * 1e9);
+	}
+
+	return 0;
+}
+
+int main (void)
+{
+	TVPUSimConfig Config = {2, 1, 0, 0};
+	VPUSimInit (&Config);
+
+	return HostRun (BenchMain, 0);
+}
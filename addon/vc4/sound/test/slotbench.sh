@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# slotbench.sh
+#
+# Measures the slot stalls and the throughput of the render harness against the number
+# of VCHIQ slots per side. The VPU completes the data at once (-f), but handles the
+# doorbell at most every SERVICE_US, so that the ARM has to wait for free slots, when
+# there are not enough of them.
+#
+# usage: ./slotbench.sh [render options]
+#
+
+SLOTS="${SLOTS:-5 6 8 12 16 24 32 48 62}"
+SERVICE_US="${SERVICE_US:-1000}"
+
+[ -x ./render ] || make -s || exit 1
+
+printf "%5s %12s %10s %10s %10s %10s\n" slots "frames/s" "slot" "data" "quota" "VPU"
+
+for s in $SLOTS
+do
+	./render -f -d "$SERVICE_US" -s "$s" "$@" | awk -v s="$s" '
+		/^throughput/	{ fps = $2 }
+		/^slots/	{ gsub (",", ""); slot = $10; data = $13; quota = $16; vpu = $19 }
+		END		{ printf "%5d %12d %10d %10d %10d %10d\n", s, fps, slot, data, quota, vpu }'
+done
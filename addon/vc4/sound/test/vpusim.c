@@ -0,0 +1,1043 @@
+//
+// vpusim.c
+//
+// Simulated VideoCore for the render harness
+//
+// The core of vchiq is built for one state (VCHIQ_MAX_STATES) with the platform state in
+// globals, so it cannot run a second time as master in the same process. The master
+// side of the slot protocol is implemented here instead, it is small: the VPU reads the
+// messages of the ARM from the slave slots and returns these slots to the slave's
+// recycle queue, it writes its own messages to the master slots, which the ARM returns
+// in the same way, and it signals the remote events like remote_event_signal() does.
+//
+#include <vc4/vchiq/vchiq_core.h>
+#include <vc4/vchiq/vchiq_pagelist.h>
+#include <vc4/vchi/vchi.h>
+#include <vc4/sound/vc_vchi_audioserv_defs.h>
+#include <linux/envdefs.h>
+#include <linux/barrier.h>
+#include <linux/env.h>
+#include "hostenv.h"
+#include "vpusim.h"
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+
+// see vchiqdevice.c
+#if RASPPI == 1
+#define ARM_IO_BASE		0x20000000
+#elif RASPPI <= 3
+#define ARM_IO_BASE		0x3F000000
+#else
+#define ARM_IO_BASE		0xFE000000
+#endif
+#define ARM_VCHIQ_BASE		(ARM_IO_BASE + 0xB840)
+#define ARM_IRQ_ARM_DOORBELL_0	66
+
+#define BELL0			0x00		// see vchiq_2835_arm.c
+#define BELL2			0x08
+#define BELL2_IDLE		0xFFFFFFFFU	// the ARM writes 0 to ring
+
+#define BUS_TO_HOST(addr)	((void *) (uintptr_t) ((unsigned) (addr) - GPU_MEM_BASE))
+
+#define MAX_TX_MESSAGES		1024
+#define MAX_TX_SIZE		32
+
+#define MAX_AUDS		4
+#define AUDS_VERSION_MIN	1
+#define MAX_CHUNKS		256		// queued in one AUDS service
+#define PCM_BUFFER_SIZE		(4 * 1024 * 1024)
+#define FRAME_SIZE		4		// 16-bit stereo
+
+typedef struct TTxMessage
+{
+	int nMsgID;
+	unsigned nSize;
+	unsigned char Data[MAX_TX_SIZE];
+}
+TTxMessage;
+
+typedef struct TChunk
+{
+	unsigned nSeq;
+	unsigned nBytes;
+	unsigned nReceived;
+	unsigned nPlayed;
+	int bSilence;
+	int bBulk;
+}
+TChunk;
+
+typedef struct TAUDS
+{
+	int bUsed;
+	unsigned nPort;				// VPU side
+	unsigned nARMPort;
+	unsigned nIndex;			// order of the OPEN messages
+
+	unsigned nSampleRate;
+	int bStarted;
+	int bDraining;
+
+	TChunk Chunk[MAX_CHUNKS];
+	unsigned nChunkIn;
+	unsigned nChunkOut;
+	unsigned nChunkSeq;
+
+	unsigned char *pPCM;
+	unsigned nPCMIn;
+	unsigned nPCMOut;
+
+	int bDACRunning;
+	unsigned nDACAnchorTicks;
+	unsigned long long nDACFrames;		// since nDACAnchorTicks
+	int bDry;				// ran out of data, while running
+	unsigned nDryTicks;
+}
+TAUDS;
+
+static TVPUSimConfig s_Config;
+static TVPUSimStats s_Stats;
+
+static volatile u32 *s_pRegs;
+
+static VCHIQ_SLOT_ZERO_T *s_pSlotZero;
+static VCHIQ_SHARED_STATE_T *s_pLocal;		// master
+static VCHIQ_SHARED_STATE_T *s_pRemote;		// slave (ARM)
+static int s_nRxPos;
+static int s_nTxPos;
+
+static TTxMessage s_TxQueue[MAX_TX_MESSAGES];
+static unsigned s_nTxIn;
+static unsigned s_nTxOut;
+
+static TAUDS s_AUDS[MAX_AUDS];
+static unsigned s_nAUDSOpened;
+
+static unsigned char s_PCMBuffer[MAX_AUDS][PCM_BUFFER_SIZE];
+
+static TVPUSimChunk s_ChunkRecord[VPUSIM_MAX_CHUNKS];
+
+static FILE *s_pWAVFile;
+static unsigned s_nWAVSampleRate;
+static unsigned long long s_nWAVBytes;
+
+// WAV file
+
+static void WriteLE (FILE *pFile, unsigned nValue, unsigned nBytes)
+{
+	for (unsigned i = 0; i < nBytes; i++)
+	{
+		fputc ((nValue >> (i * 8)) & 0xFF, pFile);
+	}
+}
+
+static void WriteWAVHeader (void)
+{
+	unsigned nDataSize =   s_nWAVBytes < 0xFFFFFFFFULL - 36
+			     ? (unsigned) s_nWAVBytes : 0xFFFFFFFFU - 36;
+
+	fseek (s_pWAVFile, 0, SEEK_SET);
+	fwrite ("RIFF", 1, 4, s_pWAVFile);
+	WriteLE (s_pWAVFile, 36 + nDataSize, 4);
+	fwrite ("WAVEfmt ", 1, 8, s_pWAVFile);
+	WriteLE (s_pWAVFile, 16, 4);			// format chunk size
+	WriteLE (s_pWAVFile, 1, 2);			// PCM
+	WriteLE (s_pWAVFile, 2, 2);			// channels
+	WriteLE (s_pWAVFile, s_nWAVSampleRate, 4);
+	WriteLE (s_pWAVFile, s_nWAVSampleRate * FRAME_SIZE, 4);
+	WriteLE (s_pWAVFile, FRAME_SIZE, 2);
+	WriteLE (s_pWAVFile, 16, 2);			// bits per sample
+	fwrite ("data", 1, 4, s_pWAVFile);
+	WriteLE (s_pWAVFile, nDataSize, 4);
+	fseek (s_pWAVFile, 0, SEEK_END);
+}
+
+// writes PCM data (or silence, if pData is 0) of the first AUDS service
+static void WriteWAV (TAUDS *pAUDS, const void *pData, unsigned nBytes)
+{
+	if (s_pWAVFile == 0 || pAUDS->nIndex != 0)
+	{
+		return;
+	}
+
+	if (pData != 0)
+	{
+		fwrite (pData, 1, nBytes, s_pWAVFile);
+	}
+	else
+	{
+		static const unsigned char Zero[4096];
+		for (unsigned n = nBytes; n > 0;)
+		{
+			unsigned nPart = n < sizeof Zero ? n : sizeof Zero;
+			fwrite (Zero, 1, nPart, s_pWAVFile);
+			n -= nPart;
+		}
+	}
+
+	s_nWAVBytes += nBytes;
+}
+
+static TVPUSimChunk *GetRecord (TAUDS *pAUDS, unsigned nSeq)
+{
+	if (pAUDS->nIndex != 0 || nSeq >= VPUSIM_MAX_CHUNKS)
+	{
+		return 0;
+	}
+
+	return &s_ChunkRecord[nSeq];
+}
+
+// Slot protocol
+
+static inline unsigned CalcStride (unsigned nSize)
+{
+	return (nSize + sizeof (VCHIQ_HEADER_T) + 7) & ~7;	// see calc_stride()
+}
+
+static inline VCHIQ_HEADER_T *GetHeader (VCHIQ_SHARED_STATE_T *pState, int nPos)
+{
+	int nSlot = pState->slot_queue[(nPos / VCHIQ_SLOT_SIZE) & VCHIQ_SLOT_QUEUE_MASK];
+
+	return (VCHIQ_HEADER_T *) (  (char *) s_pSlotZero + nSlot * VCHIQ_SLOT_SIZE
+				   + (nPos & VCHIQ_SLOT_MASK));
+}
+
+// like remote_event_signal() on the VPU
+static void SignalARM (REMOTE_EVENT_T *pEvent)
+{
+	wmb ();
+
+	pEvent->fired = 1;
+
+	dsb ();
+
+	if (pEvent->armed)
+	{
+		s_pRegs[BELL0 / 4] = 0x4;
+		HostRaiseInterrupt (ARM_IRQ_ARM_DOORBELL_0);
+
+		s_Stats.nInterrupts++;
+	}
+}
+
+static void QueueMessage (int nMsgID, const void *pData, unsigned nSize)
+{
+	if (s_nTxIn - s_nTxOut == MAX_TX_MESSAGES)
+	{
+		fprintf (stderr, "vpusim: transmit queue overflow\n");
+
+		return;
+	}
+
+	TTxMessage *pMessage = &s_TxQueue[s_nTxIn % MAX_TX_MESSAGES];
+	pMessage->nMsgID = nMsgID;
+	pMessage->nSize = nSize;
+	if (nSize > 0)
+	{
+		memcpy (pMessage->Data, pData, nSize);
+	}
+
+	s_nTxIn++;
+}
+
+// the slot at this position may be written, when the ARM has returned it
+static inline int IsSlotAvailable (int nPos)
+{
+	return (int) (nPos / VCHIQ_SLOT_SIZE - s_pLocal->slot_queue_recycle) < 0;
+}
+
+static void FlushMessages (void)
+{
+	int nTxPos = s_nTxPos;
+
+	while (s_nTxOut != s_nTxIn)
+	{
+		TTxMessage *pMessage = &s_TxQueue[s_nTxOut % MAX_TX_MESSAGES];
+		unsigned nStride = CalcStride (pMessage->nSize);
+
+		unsigned nSpace = VCHIQ_SLOT_SIZE - (nTxPos & VCHIQ_SLOT_MASK);
+		if (nSpace < nStride)
+		{
+			if (!IsSlotAvailable (nTxPos + nSpace))
+			{
+				s_Stats.nTxStalls++;
+
+				break;
+			}
+
+			VCHIQ_HEADER_T *pHeader = GetHeader (s_pLocal, nTxPos);
+			pHeader->msgid = VCHIQ_MSGID_PADDING;
+			pHeader->size = nSpace - sizeof (VCHIQ_HEADER_T);
+
+			nTxPos += nSpace;
+		}
+
+		if (   (nTxPos & VCHIQ_SLOT_MASK) == 0
+		    && !IsSlotAvailable (nTxPos))
+		{
+			s_Stats.nTxStalls++;
+
+			break;
+		}
+
+		VCHIQ_HEADER_T *pHeader = GetHeader (s_pLocal, nTxPos);
+		pHeader->msgid = pMessage->nMsgID;
+		pHeader->size = pMessage->nSize;
+		memcpy (pHeader->data, pMessage->Data, pMessage->nSize);
+
+		nTxPos += nStride;
+		s_nTxOut++;
+
+		s_Stats.nMessagesTx++;
+	}
+
+	if (nTxPos != s_nTxPos)
+	{
+		s_nTxPos = nTxPos;
+
+		wmb ();
+
+		s_pLocal->tx_pos = nTxPos;
+
+		SignalARM (&s_pRemote->trigger);
+	}
+}
+
+// returns a slave slot, which has been parsed completely
+static void ReleaseSlot (int nSlot)
+{
+	int nRecycle = s_pRemote->slot_queue_recycle;
+	s_pRemote->slot_queue[nRecycle & VCHIQ_SLOT_QUEUE_MASK] = nSlot;
+
+	wmb ();
+
+	s_pRemote->slot_queue_recycle = nRecycle + 1;
+
+	SignalARM (&s_pRemote->recycle);
+}
+
+// Audio service
+
+static void SendResult (TAUDS *pAUDS, int nSuccess)
+{
+	VC_AUDIO_MSG_T Msg;
+	memset (&Msg, 0, sizeof Msg);
+	Msg.type = VC_AUDIO_MSG_TYPE_RESULT;
+	Msg.u.result.success = nSuccess;
+
+	QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_DATA, pAUDS->nPort, pAUDS->nARMPort),
+		      &Msg, sizeof Msg);
+}
+
+static void SendComplete (TAUDS *pAUDS, TChunk *pChunk)
+{
+	VC_AUDIO_MSG_T Msg;
+	memset (&Msg, 0, sizeof Msg);
+	Msg.type = VC_AUDIO_MSG_TYPE_COMPLETE;
+	Msg.u.complete.count = pChunk->nBytes;
+	Msg.u.complete.cookie1 = VC_AUDIO_WRITE_COOKIE1;
+	Msg.u.complete.cookie2 = VC_AUDIO_WRITE_COOKIE2;
+
+	QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_DATA, pAUDS->nPort, pAUDS->nARMPort),
+		      &Msg, sizeof Msg);
+
+	TVPUSimChunk *pRecord = GetRecord (pAUDS, pChunk->nSeq);
+	if (pRecord != 0)
+	{
+		pRecord->nCompleteTicks = GetClockTicks ();
+	}
+}
+
+static inline int IsChunkReady (TChunk *pChunk)
+{
+	return pChunk->bSilence || pChunk->nReceived == pChunk->nBytes;
+}
+
+// the chunk currently received (0 if none)
+static TChunk *GetRxChunk (TAUDS *pAUDS)
+{
+	if (pAUDS->nChunkIn == pAUDS->nChunkOut)
+	{
+		return 0;
+	}
+
+	TChunk *pChunk = &pAUDS->Chunk[(pAUDS->nChunkIn - 1) % MAX_CHUNKS];
+
+	return IsChunkReady (pChunk) ? 0 : pChunk;
+}
+
+static void DiscardChunks (TAUDS *pAUDS)
+{
+	pAUDS->nChunkOut = pAUDS->nChunkIn;
+	pAUDS->nPCMOut = pAUDS->nPCMIn;
+	pAUDS->bDACRunning = 0;
+	pAUDS->bDry = 0;
+}
+
+// plays the first nBytes of the oldest chunk
+static void PlayChunk (TAUDS *pAUDS, TChunk *pChunk, unsigned nBytes)
+{
+	if (pChunk->nPlayed == 0)
+	{
+		TVPUSimChunk *pRecord = GetRecord (pAUDS, pChunk->nSeq);
+		if (pRecord != 0)
+		{
+			pRecord->nPlayTicks = pAUDS->bDACRunning
+					      ?   pAUDS->nDACAnchorTicks
+						+ (unsigned) (  pAUDS->nDACFrames * 1000000
+							      / pAUDS->nSampleRate)
+					      : GetClockTicks ();
+		}
+	}
+
+	if (pChunk->bSilence)
+	{
+		WriteWAV (pAUDS, 0, nBytes);
+
+		pChunk->nPlayed += nBytes;
+	}
+	else
+	{
+		while (nBytes > 0)
+		{
+			unsigned nOffset = pAUDS->nPCMOut % PCM_BUFFER_SIZE;
+			unsigned nPart = PCM_BUFFER_SIZE - nOffset;
+			if (nPart > nBytes)
+			{
+				nPart = nBytes;
+			}
+
+			WriteWAV (pAUDS, pAUDS->pPCM + nOffset, nPart);
+
+			pAUDS->nPCMOut += nPart;
+			pChunk->nPlayed += nPart;
+			nBytes -= nPart;
+		}
+	}
+
+	if (pChunk->nPlayed == pChunk->nBytes)
+	{
+		SendComplete (pAUDS, pChunk);
+
+		pAUDS->nChunkOut++;
+	}
+}
+
+// the DAC consumes the frames, which are due since the last call
+static void PlayOut (TAUDS *pAUDS)
+{
+	if (!pAUDS->bStarted)
+	{
+		return;
+	}
+
+	if (!s_Config.bRealtime)
+	{
+		// the data is completed, as soon as it has arrived
+		while (   pAUDS->nChunkOut != pAUDS->nChunkIn
+		       && IsChunkReady (&pAUDS->Chunk[pAUDS->nChunkOut % MAX_CHUNKS]))
+		{
+			TChunk *pChunk = &pAUDS->Chunk[pAUDS->nChunkOut % MAX_CHUNKS];
+			PlayChunk (pAUDS, pChunk, pChunk->nBytes);
+
+			s_Stats.nFramesPlayed += pChunk->nBytes / FRAME_SIZE;
+		}
+
+		return;
+	}
+
+	unsigned nTicks = GetClockTicks ();
+
+	if (!pAUDS->bDACRunning)
+	{
+		if (   pAUDS->nChunkOut == pAUDS->nChunkIn
+		    || !IsChunkReady (&pAUDS->Chunk[pAUDS->nChunkOut % MAX_CHUNKS]))
+		{
+			return;
+		}
+
+		if (pAUDS->bDry)
+		{
+			// the gap is played as silence
+			unsigned long long nFrames =   (unsigned long long) (nTicks - pAUDS->nDryTicks)
+						     * pAUDS->nSampleRate / 1000000;
+			WriteWAV (pAUDS, 0, (unsigned) nFrames * FRAME_SIZE);
+
+			s_Stats.nUnderruns++;
+			s_Stats.nUnderrunFrames += nFrames;
+
+			pAUDS->bDry = 0;
+		}
+
+		pAUDS->bDACRunning = 1;
+		pAUDS->nDACAnchorTicks = nTicks;
+		pAUDS->nDACFrames = 0;
+	}
+
+	unsigned long long nDue =   (unsigned long long) (nTicks - pAUDS->nDACAnchorTicks)
+				  * pAUDS->nSampleRate / 1000000;
+
+	while (pAUDS->nDACFrames < nDue)
+	{
+		if (   pAUDS->nChunkOut == pAUDS->nChunkIn
+		    || !IsChunkReady (&pAUDS->Chunk[pAUDS->nChunkOut % MAX_CHUNKS]))
+		{
+			pAUDS->bDACRunning = 0;
+
+			if (pAUDS->bDraining)
+			{
+				pAUDS->bDraining = 0;
+				pAUDS->bStarted = 0;
+			}
+			else
+			{
+				pAUDS->bDry = 1;
+				pAUDS->nDryTicks =   pAUDS->nDACAnchorTicks
+						   + (unsigned) (  pAUDS->nDACFrames * 1000000
+								 / pAUDS->nSampleRate);
+			}
+
+			return;
+		}
+
+		TChunk *pChunk = &pAUDS->Chunk[pAUDS->nChunkOut % MAX_CHUNKS];
+
+		unsigned long long nFrames = (pChunk->nBytes - pChunk->nPlayed) / FRAME_SIZE;
+		if (nFrames > nDue - pAUDS->nDACFrames)
+		{
+			nFrames = nDue - pAUDS->nDACFrames;
+		}
+
+		PlayChunk (pAUDS, pChunk, (unsigned) nFrames * FRAME_SIZE);
+
+		pAUDS->nDACFrames += nFrames;
+		s_Stats.nFramesPlayed += nFrames;
+	}
+}
+
+static void ReceiveData (TAUDS *pAUDS, TChunk *pChunk, const void *pData, unsigned nBytes)
+{
+	if (nBytes > pChunk->nBytes - pChunk->nReceived)
+	{
+		fprintf (stderr, "vpusim: too much data for WRITE (%u bytes)\n", nBytes);
+
+		nBytes = pChunk->nBytes - pChunk->nReceived;
+	}
+
+	if (pAUDS->nPCMIn - pAUDS->nPCMOut + nBytes > PCM_BUFFER_SIZE)
+	{
+		fprintf (stderr, "vpusim: PCM buffer overflow\n");
+
+		return;
+	}
+
+	const unsigned char *pData8 = (const unsigned char *) pData;
+	while (nBytes > 0)
+	{
+		unsigned nOffset = pAUDS->nPCMIn % PCM_BUFFER_SIZE;
+		unsigned nPart = PCM_BUFFER_SIZE - nOffset;
+		if (nPart > nBytes)
+		{
+			nPart = nBytes;
+		}
+
+		memcpy (pAUDS->pPCM + nOffset, pData8, nPart);
+
+		pAUDS->nPCMIn += nPart;
+		pChunk->nReceived += nPart;
+		pData8 += nPart;
+		nBytes -= nPart;
+	}
+
+	if (IsChunkReady (pChunk))
+	{
+		TVPUSimChunk *pRecord = GetRecord (pAUDS, pChunk->nSeq);
+		if (pRecord != 0)
+		{
+			pRecord->nReadyTicks = GetClockTicks ();
+		}
+	}
+}
+
+static void HandleWrite (TAUDS *pAUDS, const VC_AUDIO_WRITE_T *pWrite)
+{
+	if (   pWrite->cookie1 != VC_AUDIO_WRITE_COOKIE1
+	    || pWrite->cookie2 != VC_AUDIO_WRITE_COOKIE2
+	    || pWrite->count % FRAME_SIZE != 0)
+	{
+		fprintf (stderr, "vpusim: invalid WRITE message\n");
+
+		return;
+	}
+
+	if (pAUDS->nChunkIn - pAUDS->nChunkOut == MAX_CHUNKS)
+	{
+		fprintf (stderr, "vpusim: too many chunks queued\n");
+
+		return;
+	}
+
+	TChunk *pChunk = &pAUDS->Chunk[pAUDS->nChunkIn % MAX_CHUNKS];
+	pChunk->nSeq = pAUDS->nChunkSeq++;
+	pChunk->nBytes = pWrite->count;
+	pChunk->nReceived = 0;
+	pChunk->nPlayed = 0;
+	pChunk->bSilence = pWrite->silence;
+	pChunk->bBulk = !pWrite->silence && pWrite->max_packet == 0;
+	pAUDS->nChunkIn++;
+
+	s_Stats.nChunks++;
+
+	TVPUSimChunk *pRecord = GetRecord (pAUDS, pChunk->nSeq);
+	if (pRecord != 0)
+	{
+		memset (pRecord, 0, sizeof *pRecord);
+		pRecord->nBytes = pChunk->nBytes;
+		pRecord->bSilence = pChunk->bSilence;
+		pRecord->nArrivalTicks = GetClockTicks ();
+		if (pChunk->bSilence)
+		{
+			pRecord->nReadyTicks = pRecord->nArrivalTicks;
+		}
+	}
+}
+
+// a DATA message to the AUDS service
+static void HandleAUDSMessage (TAUDS *pAUDS, const void *pData, unsigned nSize)
+{
+	// while a WRITE is pending, the data packets follow
+	TChunk *pChunk = GetRxChunk (pAUDS);
+	if (pChunk != 0 && !pChunk->bBulk)
+	{
+		ReceiveData (pAUDS, pChunk, pData, nSize);
+
+		return;
+	}
+
+	VC_AUDIO_MSG_T Msg;
+	memset (&Msg, 0, sizeof Msg);
+	memcpy (&Msg, pData, nSize < sizeof Msg ? nSize : sizeof Msg);
+
+	switch (Msg.type)
+	{
+	case VC_AUDIO_MSG_TYPE_CONFIG:
+		if (   Msg.u.config.channels != 2
+		    || Msg.u.config.bps != 16
+		    || Msg.u.config.samplerate == 0)
+		{
+			SendResult (pAUDS, -1);
+
+			break;
+		}
+
+		pAUDS->nSampleRate = Msg.u.config.samplerate;
+		if (pAUDS->nIndex == 0)
+		{
+			s_nWAVSampleRate = pAUDS->nSampleRate;
+		}
+
+		SendResult (pAUDS, 0);
+		break;
+
+	case VC_AUDIO_MSG_TYPE_CONTROL:
+		SendResult (pAUDS, 0);
+		break;
+
+	case VC_AUDIO_MSG_TYPE_OPEN:
+	case VC_AUDIO_MSG_TYPE_CLOSE:
+		break;
+
+	case VC_AUDIO_MSG_TYPE_START:
+		pAUDS->bStarted = 1;
+		pAUDS->bDraining = 0;
+		pAUDS->bDry = 0;
+		break;
+
+	case VC_AUDIO_MSG_TYPE_STOP:
+		if (Msg.u.stop.draining)
+		{
+			pAUDS->bDraining = 1;
+		}
+		else
+		{
+			// no COMPLETE for the discarded data
+			DiscardChunks (pAUDS);
+			pAUDS->bStarted = 0;
+		}
+		break;
+
+	case VC_AUDIO_MSG_TYPE_WRITE:
+		HandleWrite (pAUDS, &Msg.u.write);
+		break;
+
+	default:
+		fprintf (stderr, "vpusim: unknown AUDS message (%d)\n", (int) Msg.type);
+		break;
+	}
+}
+
+// reads the data of a bulk transfer through the page list
+static int ReadBulk (TAUDS *pAUDS, unsigned nPageListBusAddress, int nSize)
+{
+	TChunk *pChunk = GetRxChunk (pAUDS);
+	if (pChunk == 0 || !pChunk->bBulk)
+	{
+		fprintf (stderr, "vpusim: unexpected bulk transfer\n");
+
+		return VCHIQ_BULK_ACTUAL_ABORTED;
+	}
+
+	const PAGELIST_T *pPageList = (const PAGELIST_T *) BUS_TO_HOST (nPageListBusAddress);
+	if (   pPageList->type != PAGELIST_WRITE
+	    || (int) pPageList->length != nSize)
+	{
+		fprintf (stderr, "vpusim: invalid page list\n");
+
+		return VCHIQ_BULK_ACTUAL_ABORTED;
+	}
+
+	unsigned nOffset = pPageList->offset;
+	unsigned nRemaining = pPageList->length;
+	for (unsigned i = 0; nRemaining > 0; i++)
+	{
+		unsigned nAddress = pPageList->addrs[i] & ~(PAGE_SIZE - 1);
+		unsigned nPages = (pPageList->addrs[i] & (PAGE_SIZE - 1)) + 1;
+
+		unsigned nBytes = nPages * PAGE_SIZE - nOffset;
+		if (nBytes > nRemaining)
+		{
+			nBytes = nRemaining;
+		}
+
+		ReceiveData (pAUDS, pChunk, (const char *) BUS_TO_HOST (nAddress) + nOffset, nBytes);
+
+		nRemaining -= nBytes;
+		nOffset = 0;
+	}
+
+	s_Stats.nBulks++;
+
+	return nSize;
+}
+
+static TAUDS *FindAUDS (unsigned nPort)
+{
+	for (unsigned i = 0; i < MAX_AUDS; i++)
+	{
+		if (s_AUDS[i].bUsed && s_AUDS[i].nPort == nPort)
+		{
+			return &s_AUDS[i];
+		}
+	}
+
+	return 0;
+}
+
+static void HandleOpen (unsigned nARMPort, const void *pPayload, unsigned nSize)
+{
+	struct
+	{
+		int fourcc;
+		int client_id;
+		short version;
+		short version_min;
+	}
+	Open;
+
+	memset (&Open, 0, sizeof Open);
+	memcpy (&Open, pPayload, nSize < sizeof Open ? nSize : sizeof Open);
+
+	if (   Open.fourcc == VC_AUDIO_SERVER_NAME
+	    && Open.version >= AUDS_VERSION_MIN
+	    && Open.version_min <= s_Config.nPeerVersion)
+	{
+		for (unsigned i = 0; i < MAX_AUDS; i++)
+		{
+			TAUDS *pAUDS = &s_AUDS[i];
+			if (pAUDS->bUsed)
+			{
+				continue;
+			}
+
+			memset (pAUDS, 0, sizeof *pAUDS);
+			pAUDS->bUsed = 1;
+			pAUDS->nPort = i + 1;
+			pAUDS->nARMPort = nARMPort;
+			pAUDS->nIndex = s_nAUDSOpened++;
+			pAUDS->nSampleRate = 44100;
+			pAUDS->pPCM = s_PCMBuffer[i];
+
+			short nVersion = s_Config.nPeerVersion;
+			QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_OPENACK, pAUDS->nPort, nARMPort),
+				      &nVersion, sizeof nVersion);
+
+			return;
+		}
+	}
+
+	// service not available
+	QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_CLOSE, 0, nARMPort), 0, 0);
+}
+
+static void HandleMessage (VCHIQ_HEADER_T *pHeader)
+{
+	int nType = VCHIQ_MSG_TYPE (pHeader->msgid);
+	unsigned nSrcPort = VCHIQ_MSG_SRCPORT (pHeader->msgid);
+	unsigned nDstPort = VCHIQ_MSG_DSTPORT (pHeader->msgid);
+
+	if (nType == VCHIQ_MSG_PADDING)
+	{
+		return;
+	}
+
+	s_Stats.nMessagesRx++;
+
+	TAUDS *pAUDS = FindAUDS (nDstPort);
+
+	switch (nType)
+	{
+	case VCHIQ_MSG_CONNECT:
+		QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_CONNECT, 0, 0), 0, 0);
+		break;
+
+	case VCHIQ_MSG_OPEN:
+		HandleOpen (nSrcPort, pHeader->data, pHeader->size);
+		break;
+
+	case VCHIQ_MSG_CLOSE:
+		QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_CLOSE, nDstPort, nSrcPort), 0, 0);
+		if (pAUDS != 0)
+		{
+			DiscardChunks (pAUDS);
+			pAUDS->bUsed = 0;
+		}
+		break;
+
+	case VCHIQ_MSG_DATA:
+		if (pAUDS != 0)
+		{
+			HandleAUDSMessage (pAUDS, pHeader->data, pHeader->size);
+		}
+		break;
+
+	case VCHIQ_MSG_BULK_TX: {
+		const int *pData = (const int *) pHeader->data;
+		int nActual =   pAUDS != 0
+			      ? ReadBulk (pAUDS, (unsigned) pData[0], pData[1])
+			      : VCHIQ_BULK_ACTUAL_ABORTED;
+
+		QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_BULK_TX_DONE, nDstPort, nSrcPort),
+			      &nActual, sizeof nActual);
+		} break;
+
+	case VCHIQ_MSG_BULK_RX: {
+		int nActual = VCHIQ_BULK_ACTUAL_ABORTED;
+		QueueMessage (VCHIQ_MAKE_MSG (VCHIQ_MSG_BULK_RX_DONE, nDstPort, nSrcPort),
+			      &nActual, sizeof nActual);
+		} break;
+
+	default:
+		// REMOTE_USE, REMOTE_RELEASE etc. are not needed here
+		break;
+	}
+}
+
+static void ParseMessages (void)
+{
+	int nTxPos = s_pRemote->tx_pos;
+
+	rmb ();
+
+	while (s_nRxPos != nTxPos)
+	{
+		int nSlot = s_pRemote->slot_queue[(s_nRxPos / VCHIQ_SLOT_SIZE) & VCHIQ_SLOT_QUEUE_MASK];
+		VCHIQ_HEADER_T *pHeader = GetHeader (s_pRemote, s_nRxPos);
+
+		HandleMessage (pHeader);
+
+		s_nRxPos += CalcStride (pHeader->size);
+		if ((s_nRxPos & VCHIQ_SLOT_MASK) == 0)
+		{
+			ReleaseSlot (nSlot);
+		}
+	}
+}
+
+// handles the events, which have been fired, and arms them again
+static void HandleEvents (void)
+{
+	do
+	{
+		s_pLocal->trigger.armed = 0;
+		s_pLocal->recycle.armed = 0;
+
+		dsb ();
+
+		if (s_pLocal->trigger.fired)
+		{
+			s_pLocal->trigger.fired = 0;
+
+			ParseMessages ();
+		}
+
+		// the recycled slots are seen in FlushMessages()
+		s_pLocal->recycle.fired = 0;
+
+		FlushMessages ();
+
+		s_pLocal->trigger.armed = 1;
+		s_pLocal->recycle.armed = 1;
+
+		dsb ();
+	}
+	while (s_pLocal->trigger.fired || s_pLocal->recycle.fired);
+}
+
+static int VPUThread (void *pParam)
+{
+	unsigned nServiceTicks = GetClockTicks ();
+
+	while (1)
+	{
+		// the VPU sleeps with its events armed, until the ARM rings the doorbell,
+		// a busy VPU does not handle it at once
+		if (   s_pRegs[BELL2 / 4] != BELL2_IDLE
+		    && GetClockTicks () - nServiceTicks >= s_Config.nServiceUs)
+		{
+			nServiceTicks = GetClockTicks ();
+
+			s_pRegs[BELL2 / 4] = BELL2_IDLE;
+			s_Stats.nDoorbells++;
+
+			HandleEvents ();
+		}
+
+		for (unsigned i = 0; i < MAX_AUDS; i++)
+		{
+			if (s_AUDS[i].bUsed)
+			{
+				PlayOut (&s_AUDS[i]);
+			}
+		}
+
+		FlushMessages ();
+
+		SchedulerYield ();
+	}
+
+	return 0;
+}
+
+// mailbox property tag 0x48010 (see raspberrypi-firmware.c)
+uint32_t EnableVCHIQ (uint32_t buf)
+{
+	s_pSlotZero = (VCHIQ_SLOT_ZERO_T *) BUS_TO_HOST (buf);
+	if (   s_pSlotZero->magic != VCHIQ_MAGIC
+	    || s_pSlotZero->slot_size != VCHIQ_SLOT_SIZE)
+	{
+		fprintf (stderr, "vpusim: invalid slot zero\n");
+
+		return 1;
+	}
+
+	s_pLocal = &s_pSlotZero->master;
+	s_pRemote = &s_pSlotZero->slave;
+
+	int nSlots = s_pLocal->slot_last - s_pLocal->slot_first + 1;
+	for (int i = 0; i < nSlots; i++)
+	{
+		s_pLocal->slot_queue[i] = s_pLocal->slot_first + i;
+	}
+	s_pLocal->slot_queue_recycle = nSlots;
+
+	s_pLocal->tx_pos = 0;
+	s_nTxPos = 0;
+	s_nRxPos = 0;
+
+	s_pLocal->trigger.fired = 0;
+	s_pLocal->trigger.armed = 1;
+	s_pLocal->recycle.fired = 0;
+	s_pLocal->recycle.armed = 1;
+
+	wmb ();
+
+	s_pLocal->initialised = 1;
+
+	SchedulerCreateThread (VPUThread, 0);
+
+	return 0;
+}
+
+void VPUSimInit (const TVPUSimConfig *pConfig)
+{
+	s_Config = *pConfig;
+	memset (&s_Stats, 0, sizeof s_Stats);
+
+	// the doorbell registers are accessed at their physical address
+	void *pPage = (void *) (uintptr_t) (ARM_VCHIQ_BASE & ~(PAGE_SIZE - 1));
+	if (mmap (pPage, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+	    != pPage)
+	{
+		fprintf (stderr, "vpusim: cannot map the doorbell registers\n");
+	}
+
+	s_pRegs = (volatile u32 *) (uintptr_t) ARM_VCHIQ_BASE;
+	s_pRegs[BELL0 / 4] = 0;
+	s_pRegs[BELL2 / 4] = BELL2_IDLE;
+
+	s_nWAVSampleRate = 44100;
+	s_nWAVBytes = 0;
+	s_pWAVFile = 0;
+	if (pConfig->pWAVFile != 0)
+	{
+		s_pWAVFile = fopen (pConfig->pWAVFile, "wb");
+		if (s_pWAVFile == 0)
+		{
+			fprintf (stderr, "vpusim: cannot create %s\n", pConfig->pWAVFile);
+		}
+		else
+		{
+			WriteWAVHeader ();
+		}
+	}
+}
+
+void VPUSimFinish (void)
+{
+	if (s_pWAVFile != 0)
+	{
+		WriteWAVHeader ();
+
+		fclose (s_pWAVFile);
+		s_pWAVFile = 0;
+	}
+}
+
+void VPUSimGetStats (TVPUSimStats *pStats)
+{
+	*pStats = s_Stats;
+}
+
+const TVPUSimChunk *VPUSimGetChunk (unsigned nChunk)
+{
+	if (   s_nAUDSOpened == 0
+	    || nChunk >= VPUSIM_MAX_CHUNKS)
+	{
+		return 0;
+	}
+
+	for (unsigned i = 0; i < MAX_AUDS; i++)
+	{
+		if (   s_AUDS[i].bUsed
+		    && s_AUDS[i].nIndex == 0
+		    && nChunk >= s_AUDS[i].nChunkSeq)
+		{
+			return 0;
+		}
+	}
+
+	return &s_ChunkRecord[nChunk];
+}
@@ -0,0 +1,70 @@
+//
+// vpusim.h
+//
+// Simulated VideoCore for the render harness
+//
+// The VPU is the VCHIQ master. It answers the mailbox call of vchiq_platform_init(),
+// exchanges messages through the slots in the coherent region, reads bulk transfers
+// through the page lists and rings the ARM doorbell (IRQ 66). It implements the AUDS
+// service like the firmware does and plays the received PCM data at the sample rate.
+//
+#ifndef _vpusim_h
+#define _vpusim_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VPUSIM_MAX_CHUNKS	(1 << 18)	// timing records of the first AUDS service
+
+typedef struct TVPUSimConfig
+{
+	short nPeerVersion;		// AUDS version sent in OPENACK (< 2 for bulk transfers only)
+	int bRealtime;			// play at the sample rate, otherwise complete at once
+	unsigned nServiceUs;		// the doorbell is handled at most this often (0 at once)
+	const char *pWAVFile;		// PCM of the first AUDS service is written here (0 for none)
+}
+TVPUSimConfig;
+
+typedef struct TVPUSimChunk		// one WRITE message with its data
+{
+	unsigned nBytes;
+	int bSilence;
+	unsigned nArrivalTicks;		// WRITE message received (GetClockTicks())
+	unsigned nReadyTicks;		// all data received
+	unsigned nPlayTicks;		// first frame played at the DAC
+	unsigned nCompleteTicks;	// COMPLETE message queued
+}
+TVPUSimChunk;
+
+typedef struct TVPUSimStats
+{
+	unsigned nDoorbells;		// BELL2 rung by the ARM, seen by the VPU
+	unsigned nInterrupts;		// doorbell interrupts raised on the ARM
+	unsigned nMessagesRx;		// from the ARM, without padding
+	unsigned nMessagesTx;		// to the ARM, without padding
+	unsigned nTxStalls;		// no free slot for a message to the ARM
+	unsigned nBulks;		// bulk transfers read from the ARM
+	unsigned nChunks;		// WRITE messages
+	unsigned nUnderruns;		// the DAC ran dry, while the stream was running
+	unsigned long long nUnderrunFrames;
+	unsigned long long nFramesPlayed;
+}
+TVPUSimStats;
+
+// must be called before CVCHIQDevice_Initialize()
+void VPUSimInit (const TVPUSimConfig *pConfig);
+
+// writes the remaining data of the WAV file
+void VPUSimFinish (void);
+
+void VPUSimGetStats (TVPUSimStats *pStats);
+
+// returns the timing record of a chunk of the first AUDS service (0 if not available)
+const TVPUSimChunk *VPUSimGetChunk (unsigned nChunk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,11 +24,23 @@
 #include <vc4/sound/vchiqsoundbasedevice.h>
 #include <linux/assert.h>
 #include <linux/env.h>
+#include <string.h>
+#include <linux/slab.h>
+#include <linux/barrier.h>
 
 #define LOG(...)
 
+#define VCHIQ_SOUND_CHANNELS        2
+#define VCHIQ_SOUND_MAX_PACKET        4000        // bytes of sound data per DATA message
+
+// the VCHI instance is shared by all devices, each device opens its own AUDS service
+static VCHI_INSTANCE_T s_VCHIInstance = 0;
+
 #define VOLUME_TO_CHIP(volume)        ((unsigned) -(((volume) << 8) / 100))
 
+// GetClockTicks() wraps around, more than half of its range cannot be distinguished
+#define FRAME_TICKS_MAX_DELTA        0x7FFFFFFF    // microseconds
+
 // protected and private functions
 int CVCHIQSoundBaseDevice_QueueMessage (CVCHIQSoundBaseDevice *_this, VC_AUDIO_MSG_T *pMessage)
 {
@@ -42,42 +54,370 @@ int CVCHIQSoundBaseDevice_QueueMessage (CVCHIQSoundBaseDevice *_this, VC_AUDIO_M
     return nResult;
 }
 
-int CVCHIQSoundBaseDevice_CallMessage (CVCHIQSoundBaseDevice *_this, VC_AUDIO_MSG_T *pMessage)
+// queues a message, which is answered with a RESULT message, returns the token (0 on error)
+static unsigned CVCHIQSoundBaseDevice_SendRequest (CVCHIQSoundBaseDevice *_this, VC_AUDIO_MSG_T *pMessage,
+                           request_cb_t pCallback, void *pParam)
 {
-    _this->m_Event = false;
+    unsigned nIndex = _this->m_nRequestIn;
+    if (nIndex - _this->m_nRequestOut == VCHIQ_SOUND_MAX_REQUESTS)
+    {
+        return 0;
+    }
+
+    unsigned nToken = ++_this->m_nNextToken;
+    if (nToken == 0)
+    {
+        nToken = ++_this->m_nNextToken;
+    }
+
+    TVCHIQSoundRequest *pRequest = &_this->m_Request[nIndex % VCHIQ_SOUND_MAX_REQUESTS];
+    pRequest->nToken = nToken;
+    pRequest->pCallback = pCallback;
+    pRequest->pParam = pParam;
+    pRequest->bFailed = FALSE;
+
+    // the RESULT may arrive, before vchi_msg_queue() returns
+    _this->m_nRequestIn = nIndex + 1;
 
     int nResult = CVCHIQSoundBaseDevice_QueueMessage (_this, pMessage);
-    if (nResult == 0)
+    if (nResult != 0)
+    {
+        if (_this->m_nRequestIn == nIndex + 1)
+        {
+            _this->m_nRequestIn = nIndex;
+        }
+        else
+        {
+            // another request has been queued meanwhile, skip this one on the next RESULT
+            pRequest->bFailed = TRUE;
+        }
+
+        return 0;
+    }
+
+    return nToken;
+}
+
+// called on the RESULT message, which belongs to the oldest request
+static void CVCHIQSoundBaseDevice_CompleteRequest (CVCHIQSoundBaseDevice *_this, int nResult)
+{
+    while (_this->m_nRequestOut != _this->m_nRequestIn)
+    {
+        TVCHIQSoundRequest Request = _this->m_Request[_this->m_nRequestOut % VCHIQ_SOUND_MAX_REQUESTS];
+        _this->m_nRequestOut++;
+
+        if (Request.bFailed)
+        {
+            continue;
+        }
+
+        // the slot is free now, the callback may send the next request
+        if (Request.pCallback != 0)
+        {
+            (*Request.pCallback) (Request.nToken, nResult, Request.pParam);
+        }
+
+        return;
+    }
+
+    LOG (FromVCHIQSound, LogWarning, "Unexpected result");
+}
+
+typedef struct TVCHIQSoundResult
+{
+    volatile boolean bDone;
+    int nResult;
+    unsigned nToken;                // of the request, which has been answered
+}
+TVCHIQSoundResult;
+
+static void CVCHIQSoundBaseDevice_ResultCallback (unsigned nToken, int nResult, void *pParam)
+{
+    TVCHIQSoundResult *pResult = (TVCHIQSoundResult *) pParam;
+    assert (pResult != 0);
+
+    // the RESULT may arrive, before the token has been returned to the caller
+    pResult->nToken = nToken;
+    pResult->nResult = nResult;
+    pResult->bDone = TRUE;
+}
+
+int CVCHIQSoundBaseDevice_CallMessage (CVCHIQSoundBaseDevice *_this, VC_AUDIO_MSG_T *pMessage)
+{
+    TVCHIQSoundResult Result = {FALSE, 0, 0};
+
+    unsigned nToken = CVCHIQSoundBaseDevice_SendRequest (_this, pMessage,
+                                 CVCHIQSoundBaseDevice_ResultCallback, &Result);
+    if (nToken == 0)
+    {
+        return -1;
+    }
+
+    while (!Result.bDone) SchedulerYield ();
+
+    assert (Result.nToken == nToken);
+
+    return Result.nResult;
+}
+
+static void AddToHistogram (unsigned *pHistogram, unsigned nValue)
+{
+    unsigned nBucket = nValue > 1 ? 31 - __builtin_clz (nValue) : 0;
+    if (nBucket >= VCHIQ_SOUND_HISTOGRAM_SIZE)
+    {
+        nBucket = VCHIQ_SOUND_HISTOGRAM_SIZE-1;
+    }
+
+    pHistogram[nBucket]++;
+}
+
+// drains the queue filled by CVCHIQSoundBaseDevice_Write(), runs on the slot handler thread
+static unsigned CVCHIQSoundBaseDevice_ReadQueue (CVCHIQSoundBaseDevice *_this, s16 *pBuffer, unsigned nWords)
+{
+    unsigned nOutPtr = _this->m_nQueueOutPtr;
+    unsigned nAvail = _this->m_nQueueInPtr - nOutPtr;
+    rmb ();
+
+    unsigned nCopy = nAvail < nWords ? nAvail : nWords;
+    unsigned nStart = nOutPtr & (_this->m_nQueueSize-1);
+    unsigned nFirst = _this->m_nQueueSize - nStart;
+    if (nFirst > nCopy)
+    {
+        nFirst = nCopy;
+    }
+
+    memcpy (pBuffer, _this->m_pQueue + nStart, nFirst * sizeof (s16));
+    memcpy (pBuffer + nFirst, _this->m_pQueue, (nCopy - nFirst) * sizeof (s16));
+
+    mb ();
+    _this->m_nQueueOutPtr = nOutPtr + nCopy;
+
+    if (nCopy < nWords)
+    {
+        _this->m_Stats.nSourceUnderruns++;
+    }
+
+    // on underrun play silence, the stream continues until it is cancelled
+    memset (pBuffer + nCopy, 0, (nWords - nCopy) * sizeof (s16));
+
+    return nWords;
+}
+
+static unsigned CVCHIQSoundBaseDevice_GetChunk (CVCHIQSoundBaseDevice *_this, s16 *pBuffer, unsigned nWords)
+{
+    unsigned nStartTicks = GetClockTicks ();
+
+    unsigned nResult;
+    if (_this->chunk_cb != 0)
     {
-        while (!_this->m_Event) SchedulerYield ();
+        nResult = (*_this->chunk_cb) (pBuffer, nWords);
     }
     else
     {
-        _this->m_nResult = nResult;
+        nResult = CVCHIQSoundBaseDevice_ReadQueue (_this, pBuffer, nWords);
+    }
+
+    CSoundGain_Process (&_this->m_Gain, pBuffer, nResult);
+
+    unsigned nDuration = GetClockTicks () - nStartTicks;
+
+    TVCHIQSoundStats *pStats = &_this->m_Stats;
+    pStats->nCallbackCount++;
+    pStats->nCallbackTotalUs += nDuration;
+    if (nDuration < pStats->nCallbackMinUs)
+    {
+        pStats->nCallbackMinUs = nDuration;
+    }
+    if (nDuration > pStats->nCallbackMaxUs)
+    {
+        pStats->nCallbackMaxUs = nDuration;
+    }
+    AddToHistogram (pStats->CallbackHistogram, nDuration);
+
+    return nResult;
+}
+
+// called, when all written data has been completed in the draining state
+static void CVCHIQSoundBaseDevice_EndDrain (CVCHIQSoundBaseDevice *_this)
+{
+    assert (_this->m_State == VCHIQSoundDraining);
+    _this->m_State = VCHIQSoundIdle;
+
+    if (_this->m_pDrainCallback != 0)
+    {
+        (*_this->m_pDrainCallback) (_this->m_pDrainParam);
     }
+}
 
-    return _this->m_nResult;
+// no more data is written, the queued data is played
+// Is called from WriteChunk() with m_WriteMutex held. If nothing is pending, the drain is
+// ended in Refill() after the mutex has been released, because the callback may call Start().
+static void CVCHIQSoundBaseDevice_StartDrain (CVCHIQSoundBaseDevice *_this)
+{
+    _this->m_State = VCHIQSoundDraining;
 }
 
-int CVCHIQSoundBaseDevice_WriteChunk (CVCHIQSoundBaseDevice *_this)
+static boolean IsSilent (const s16 *pBuffer, unsigned nWords, unsigned nThreshold)
 {
-    if (_this->chunk_cb == 0) return 0;
-    s16 Buffer[_this->m_nChunkSize];
-    unsigned nWords = (*_this->chunk_cb) (Buffer, _this->m_nChunkSize);
+    int nMax = (int) nThreshold;
+
+    for (unsigned i = 0; i < nWords; i++)
+    {
+        if (   pBuffer[i] > nMax
+            || pBuffer[i] < -nMax)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// consumes the next nWords from the write queue, if they are silent (missing data is silent too)
+static boolean CVCHIQSoundBaseDevice_SkipSilentQueue (CVCHIQSoundBaseDevice *_this, unsigned nWords)
+{
+    // a running ramp has to be applied to the data
+    if (CSoundGain_IsRamping (&_this->m_Gain))
+    {
+        return FALSE;
+    }
+
+    unsigned nOutPtr = _this->m_nQueueOutPtr;
+    unsigned nAvail = _this->m_nQueueInPtr - nOutPtr;
+    rmb ();
+
+    if (nAvail > nWords)
+    {
+        nAvail = nWords;
+    }
+
+    if (CSoundGain_GetGain (&_this->m_Gain) != 0)
+    {
+        unsigned nStart = nOutPtr & (_this->m_nQueueSize-1);
+        unsigned nFirst = _this->m_nQueueSize - nStart;
+        if (nFirst > nAvail)
+        {
+            nFirst = nAvail;
+        }
+
+        if (   !IsSilent (_this->m_pQueue + nStart, nFirst, _this->m_nSilenceThreshold)
+            || !IsSilent (_this->m_pQueue, nAvail - nFirst, _this->m_nSilenceThreshold))
+        {
+            return FALSE;
+        }
+    }
+
+    mb ();
+    _this->m_nQueueOutPtr = nOutPtr + nAvail;
+
+    if (nAvail < nWords)
+    {
+        _this->m_Stats.nSourceUnderruns++;
+    }
+
+    return TRUE;
+}
+
+// announces nBytes of silence, no data follows
+static int CVCHIQSoundBaseDevice_WriteSilence (CVCHIQSoundBaseDevice *_this, unsigned nBytes)
+{
+    VC_AUDIO_MSG_T Msg;
+
+    Msg.type = VC_AUDIO_MSG_TYPE_WRITE;
+    Msg.u.write.count = nBytes;
+    Msg.u.write.max_packet = 0;
+    Msg.u.write.cookie1 = VC_AUDIO_WRITE_COOKIE1;
+    Msg.u.write.cookie2 = VC_AUDIO_WRITE_COOKIE2;
+    Msg.u.write.silence = 1;
+
+    int nResult = vchi_msg_queue (_this->m_hService, &Msg, sizeof Msg, VCHI_FLAGS_BLOCK_UNTIL_QUEUED, 0);
+    if (nResult != 0)
+    {
+        return nResult;
+    }
+
+    _this->m_nWritePos += nBytes;
+    _this->m_Stats.nChunks++;
+    _this->m_Stats.nSilentChunks++;
+
+    return 0;
+}
+
+// called by vchi_msg_queue_batch() with the slot mutex held, renders one data packet
+// into the slot memory, after the end of the stream the packet is filled with silence
+static int CVCHIQSoundBaseDevice_RenderPacket (void *pParam, void *pDest, unsigned nOffset, unsigned nMaxSize)
+{
+    CVCHIQSoundBaseDevice *_this = (CVCHIQSoundBaseDevice *) pParam;
+    assert (_this != 0);
+    assert (pDest != 0);
+    (void) nOffset;                // the whole packet is rendered at once
+
+    s16 *pBuffer = (s16 *) pDest;
+    unsigned nWords = nMaxSize / sizeof (s16);
+    unsigned nWordsRendered = 0;
+
+    if (!_this->m_bEndOfStream)
+    {
+        nWordsRendered = CVCHIQSoundBaseDevice_GetChunk (_this, pBuffer, nWords);
+        assert (nWordsRendered <= nWords);
+
+        if (nWordsRendered < nWords)
+        {
+            _this->m_bEndOfStream = TRUE;
+        }
+    }
+
+    // the size of the chunk has been announced in the WRITE message already
+    memset (pBuffer + nWordsRendered, 0, (nWords - nWordsRendered) * sizeof (s16));
+
+    return (int) nMaxSize;
+}
+
+// the whole chunk is rendered into a bulk buffer, which is read by the VPU
+static int CVCHIQSoundBaseDevice_WriteChunkBulk (CVCHIQSoundBaseDevice *_this)
+{
+    if (_this->m_nBulkPending == VCHIQ_SOUND_BULK_BUFFERS)
+    {
+        // all buffers are in use, continue when the next one has been sent
+        _this->m_bWriteDeferred = TRUE;
+
+        return 0;
+    }
+
+    s16 *pBuffer = _this->m_pBulkBuffer[_this->m_nBulkNext];
+    assert (pBuffer != 0);
+
+    unsigned nWords = 0;
+    if (!_this->m_bEndOfStream)
+    {
+        nWords = CVCHIQSoundBaseDevice_GetChunk (_this, pBuffer, _this->m_nChunkSize);
+        if (nWords < _this->m_nChunkSize)
+        {
+            _this->m_bEndOfStream = TRUE;
+        }
+    }
+
     if (nWords == 0)
     {
-        _this->m_State = VCHIQSoundIdle;
+        CVCHIQSoundBaseDevice_StartDrain (_this);
 
         return 0;
     }
 
     unsigned nBytes = nWords * sizeof (s16);
 
+    if (   _this->m_bSilenceDetection
+        && IsSilent (pBuffer, nWords, _this->m_nSilenceThreshold))
+    {
+        // the bulk buffer is not used
+        return CVCHIQSoundBaseDevice_WriteSilence (_this, nBytes);
+    }
+
     VC_AUDIO_MSG_T Msg;
 
     Msg.type = VC_AUDIO_MSG_TYPE_WRITE;
     Msg.u.write.count = nBytes;
-    Msg.u.write.max_packet = 4000;
+    Msg.u.write.max_packet = 0;        // data follows as bulk transfer
     Msg.u.write.cookie1 = VC_AUDIO_WRITE_COOKIE1;
     Msg.u.write.cookie2 = VC_AUDIO_WRITE_COOKIE2;
     Msg.u.write.silence = 0;
@@ -88,31 +428,374 @@ int CVCHIQSoundBaseDevice_WriteChunk (CVCHIQSoundBaseDevice *_this)
         return nResult;
     }
 
+    nResult = vchi_bulk_queue_transmit (_this->m_hService, pBuffer, nBytes,
+                        VCHI_FLAGS_CALLBACK_WHEN_OP_COMPLETE | VCHI_FLAGS_BLOCK_UNTIL_QUEUED,
+                        pBuffer);
+    if (nResult != 0)
+    {
+        return nResult;
+    }
+
+    _this->m_nBulkPending++;
+    _this->m_nBulkNext = (_this->m_nBulkNext + 1) % VCHIQ_SOUND_BULK_BUFFERS;
+
     _this->m_nWritePos += nBytes;
+    _this->m_Stats.nChunks++;
+
+    return 0;
+}
+
+int CVCHIQSoundBaseDevice_WriteChunk (CVCHIQSoundBaseDevice *_this)
+{
+    if (_this->chunk_cb == 0 && _this->m_pQueue == 0) return 0;
+    if (_this->m_bBulkMode)
+    {
+        return CVCHIQSoundBaseDevice_WriteChunkBulk (_this);
+    }
 
-    u8 *pBuffer8 = (u8 *) Buffer;
-    while (nBytes > 0)
+    if (_this->m_bEndOfStream)
     {
-        unsigned nBytesToQueue =   nBytes <= Msg.u.write.max_packet
-                     ? nBytes
+        CVCHIQSoundBaseDevice_StartDrain (_this);
+
+        return 0;
+    }
+
+    // silent data of the write queue is skipped without copying it
+    if (   _this->m_bSilenceDetection
+        && _this->chunk_cb == 0
+        && CVCHIQSoundBaseDevice_SkipSilentQueue (_this, _this->m_nChunkSize))
+    {
+        return CVCHIQSoundBaseDevice_WriteSilence (_this, _this->m_nChunkSize * sizeof (s16));
+    }
+
+    unsigned nBytes = _this->m_nChunkSize * sizeof (s16);
+
+    VC_AUDIO_MSG_T Msg;
+
+    Msg.type = VC_AUDIO_MSG_TYPE_WRITE;
+    Msg.u.write.count = nBytes;
+    Msg.u.write.max_packet = VCHIQ_SOUND_MAX_PACKET;
+    Msg.u.write.cookie1 = VC_AUDIO_WRITE_COOKIE1;
+    Msg.u.write.cookie2 = VC_AUDIO_WRITE_COOKIE2;
+    Msg.u.write.silence = 0;
+
+    // the WRITE message and the data packets are published to the VPU together
+    VCHI_MSG_BATCH_T *Batch = _this->m_pBatch;
+    assert (Batch != 0);
+    unsigned nMessages = 0;
+
+    Batch[nMessages].data = &Msg;
+    Batch[nMessages].copy_callback = 0;
+    Batch[nMessages].context = 0;
+    Batch[nMessages].data_size = sizeof Msg;
+    nMessages++;
+
+    // the data packets are rendered directly into the slot memory
+    unsigned nBytesLeft = nBytes;
+    while (nBytesLeft > 0)
+    {
+        unsigned nBytesToQueue =   nBytesLeft <= Msg.u.write.max_packet
+                     ? nBytesLeft
                      : Msg.u.write.max_packet;
 
-        nResult = vchi_msg_queue (_this->m_hService, pBuffer8, nBytesToQueue,
-                      VCHI_FLAGS_BLOCK_UNTIL_QUEUED, 0);
+        Batch[nMessages].data = 0;
+        Batch[nMessages].copy_callback = CVCHIQSoundBaseDevice_RenderPacket;
+        Batch[nMessages].context = _this;
+        Batch[nMessages].data_size = nBytesToQueue;
+        nMessages++;
+
+        nBytesLeft -= nBytesToQueue;
+    }
+
+    int nResult = vchi_msg_queue_batch (_this->m_hService, Batch, nMessages);
+    if (nResult != 0)
+    {
+        return nResult;
+    }
+
+    _this->m_nWritePos += nBytes;
+    _this->m_Stats.nChunks++;
+
+    return 0;
+}
+
+static unsigned CVCHIQSoundBaseDevice_BytesToMicroseconds (CVCHIQSoundBaseDevice *_this, unsigned nBytes)
+{
+    unsigned nBytesPerMillisecond = _this->m_nSampleRate * VCHIQ_SOUND_CHANNELS * sizeof (s16) / 1000;
+
+    return (unsigned) ((uint64_t) nBytes * 1000 / nBytesPerMillisecond);
+}
+
+// chunk size and queue depth, which keep at least nLatencyUs of sound data queued
+static void CVCHIQSoundBaseDevice_SetLatency (CVCHIQSoundBaseDevice *_this, unsigned nLatencyUs)
+{
+    // 64 bits, the product exceeds 32 bits above 4.4 s at 96 kHz
+    unsigned nWords = (unsigned) (  (uint64_t) _this->m_nSampleRate * nLatencyUs / 1000000
+                      * VCHIQ_SOUND_CHANNELS);
+
+    unsigned nChunkSize = nWords / 2 & ~1U;
+    if (nChunkSize < VCHIQ_SOUND_MIN_CHUNK_SIZE)
+    {
+        nChunkSize = VCHIQ_SOUND_MIN_CHUNK_SIZE;
+    }
+    if (nChunkSize > _this->m_nMaxChunkSize)
+    {
+        nChunkSize = _this->m_nMaxChunkSize;
+    }
+
+    // the refill takes place, when one chunk less than the depth is queued
+    unsigned nDepth = (nWords + nChunkSize-1) / nChunkSize + 1;
+    unsigned nMaxDepth = _this->m_bBulkMode ? VCHIQ_SOUND_BULK_BUFFERS : VCHIQ_SOUND_MAX_QUEUE_DEPTH;
+    if (nDepth < 2)
+    {
+        nDepth = 2;
+    }
+    if (nDepth > nMaxDepth)
+    {
+        nDepth = nMaxDepth;
+    }
+
+    _this->m_nChunkSize = nChunkSize;
+    _this->m_nQueueDepth = nDepth;
+}
+
+// called on each COMPLETE message, returns the deviation of the arrival time
+// from the play time of the completed data in microseconds (-1 for the first one)
+static int CVCHIQSoundBaseDevice_UpdateStats (CVCHIQSoundBaseDevice *_this, unsigned nBytesCompleted)
+{
+    TVCHIQSoundStats *pStats = &_this->m_Stats;
+    pStats->nCompletions++;
+    pStats->nBytesCompleted += nBytesCompleted;
+
+    unsigned nQueued = _this->m_nWritePos - _this->m_nCompletePos;
+    AddToHistogram (pStats->QueuedHistogram, nQueued);
+
+    if (   nQueued == 0
+        && _this->m_State == VCHIQSoundRunning)
+    {
+        pStats->nUnderruns++;
+    }
+
+    // the data in the write queue has to be played before new data
+    if (_this->m_pQueue != 0)
+    {
+        nQueued += (_this->m_nQueueInPtr - _this->m_nQueueOutPtr) * sizeof (s16);
+    }
+
+    pStats->nLatencyUs = CVCHIQSoundBaseDevice_BytesToMicroseconds (_this, nQueued);
+    if (pStats->nLatencyUs > pStats->nLatencyMaxUs)
+    {
+        pStats->nLatencyMaxUs = pStats->nLatencyUs;
+    }
+
+    unsigned nTicks = GetClockTicks ();
+    int nResult = -1;
+
+    if (_this->m_bLastCompleteValid)
+    {
+        unsigned nInterval = nTicks - _this->m_nLastCompleteTicks;
+        unsigned nExpected = CVCHIQSoundBaseDevice_BytesToMicroseconds (_this, nBytesCompleted);
+        unsigned nJitter = nInterval > nExpected ? nInterval - nExpected : nExpected - nInterval;
+
+        if (nJitter > pStats->nJitterMaxUs)
+        {
+            pStats->nJitterMaxUs = nJitter;
+        }
+        AddToHistogram (pStats->JitterHistogram, nJitter);
+
+        nResult = (int) nJitter;
+    }
+
+    _this->m_nLastCompleteTicks = nTicks;
+    _this->m_bLastCompleteValid = TRUE;
+
+    return nResult;
+}
+
+// called on each COMPLETE message after CVCHIQSoundBaseDevice_UpdateStats()
+static void CVCHIQSoundBaseDevice_UpdateClock (CVCHIQSoundBaseDevice *_this, unsigned nBytesCompleted)
+{
+    _this->m_nFramesCompleted += nBytesCompleted / (VCHIQ_SOUND_CHANNELS * sizeof (s16));
+
+    unsigned nTicks = _this->m_nLastCompleteTicks;
+    double fFrame = (double) _this->m_nFramesCompleted;
+
+    if (!_this->m_bClockValid)
+    {
+        _this->m_nClockAnchorTicks = nTicks;
+        _this->m_fClockAnchorFrame = fFrame;
+        _this->m_nClockTicks = nTicks;
+        _this->m_fClockFrame = fFrame;
+        _this->m_fClockJitter = 0.0;
+        _this->m_nClockCount = 0;
+        _this->m_bClockValid = TRUE;
+    }
+    else
+    {
+        double fPredicted =   _this->m_fClockFrame
+                    + (double) (nTicks - _this->m_nClockTicks) * _this->m_fClockRate;
+        double fError = fFrame - fPredicted;
+
+        // The messages arrive with a variable delay, but never early. The estimation
+        // follows early messages quickly and late messages slowly.
+        _this->m_fClockFrame = fPredicted + fError * (fError > 0.0 ? 0.5 : 1.0/16);
+        _this->m_nClockTicks = nTicks;
+
+        _this->m_fClockJitter += ((fError > 0.0 ? fError : -fError) - _this->m_fClockJitter) / 16;
+
+        // the rate is measured over a long period to average out the arrival delay
+        unsigned nElapsed = nTicks - _this->m_nClockAnchorTicks;
+        if (nElapsed >= 1000000)
+        {
+            double fNominal = _this->m_nSampleRate / 1000000.0;
+            double fMaxDrift = fNominal * VCHIQ_SOUND_CLOCK_MAX_DRIFT / 1000000.0;
+
+            double fRate = (fFrame - _this->m_fClockAnchorFrame) / nElapsed;
+            if (fRate > fNominal + fMaxDrift)
+            {
+                fRate = fNominal + fMaxDrift;
+            }
+            else if (fRate < fNominal - fMaxDrift)
+            {
+                fRate = fNominal - fMaxDrift;
+            }
+
+            _this->m_fClockRate = fRate;
+        }
+
+        // restart the measurement with the estimation, before the timer difference overflows
+        if (nElapsed >= 1U << 30)
+        {
+            _this->m_nClockAnchorTicks = nTicks;
+            _this->m_fClockAnchorFrame = _this->m_fClockFrame;
+        }
+
+        _this->m_nClockCount++;
+    }
+
+    // the VPU stops playing on underrun, the clock is restarted with the next data
+    if (   _this->m_nWritePos == _this->m_nCompletePos
+        && _this->m_State == VCHIQSoundRunning)
+    {
+        _this->m_bClockValid = FALSE;
+    }
+}
+
+// called on each COMPLETE message in adaptive mode
+static void CVCHIQSoundBaseDevice_Adapt (CVCHIQSoundBaseDevice *_this, int nJitter)
+{
+    if (nJitter >= 0)
+    {
+        // peak hold with slow decay
+        if ((unsigned) nJitter > _this->m_nJitterPeakUs)
+        {
+            _this->m_nJitterPeakUs = nJitter;
+        }
+        else
+        {
+            _this->m_nJitterPeakUs -= (_this->m_nJitterPeakUs - nJitter) / 64;
+        }
+    }
+
+    // grow at once, if a late completion would not be covered by the queued data,
+    // re-evaluate the latency periodically otherwise
+    unsigned nQueuedUs = CVCHIQSoundBaseDevice_BytesToMicroseconds (_this,
+                _this->m_nWritePos - _this->m_nCompletePos);
+    if (   nQueuedUs >= _this->m_nJitterPeakUs
+        && ++_this->m_nAdaptCount % 32 != 1)
+    {
+        return;
+    }
+
+    _this->m_nAdaptCount = 1;
+
+    unsigned nLatencyUs = 3 * _this->m_nJitterPeakUs;
+    if (nLatencyUs < _this->m_nMinLatencyUs)
+    {
+        nLatencyUs = _this->m_nMinLatencyUs;
+    }
+    if (nLatencyUs > _this->m_nMaxLatencyUs)
+    {
+        nLatencyUs = _this->m_nMaxLatencyUs;
+    }
+
+    CVCHIQSoundBaseDevice_SetLatency (_this, nLatencyUs);
+}
+
+// keeps m_nQueueDepth chunks in flight
+// Called by the application in Start() and on the slot handler thread. A WRITE message must
+// be followed by its data, so the chunks are written under m_WriteMutex. A queued message
+// may wait for a slot, which releases slot_mutex and would let the other thread in.
+static int CVCHIQSoundBaseDevice_Refill (CVCHIQSoundBaseDevice *_this)
+{
+    int nResult = 0;
+
+    mutex_lock (&_this->m_WriteMutex);
+
+    while (   _this->m_State == VCHIQSoundRunning
+           && !_this->m_bWriteDeferred
+           &&    _this->m_nWritePos-_this->m_nCompletePos
+              <= (_this->m_nQueueDepth-1) * _this->m_nChunkSize*sizeof (s16))
+    {
+        unsigned nWritePos = _this->m_nWritePos;
+
+        nResult = CVCHIQSoundBaseDevice_WriteChunk (_this);
         if (nResult != 0)
         {
-            return nResult;
+            break;
+        }
+
+        if (_this->m_nWritePos == nWritePos)
+        {
+            break;
         }
+    }
+
+    mutex_unlock (&_this->m_WriteMutex);
 
-        pBuffer8 += nBytesToQueue;
-        nBytes -= nBytesToQueue;
+    // the end of the stream has been reached and all written data is completed already
+    if (   _this->m_State == VCHIQSoundDraining
+        && _this->m_nCompletePos == _this->m_nWritePos)
+    {
+        CVCHIQSoundBaseDevice_EndDrain (_this);
     }
 
-    return 0;
+    return nResult;
 }
 
 void CVCHIQSoundBaseDevice_Callback (CVCHIQSoundBaseDevice *_this, const VCHI_CALLBACK_REASON_T Reason, void *hMessage)
 {
+    (void) hMessage;                // the messages are dequeued below
+    if (   Reason == VCHI_CALLBACK_BULK_SENT
+        || Reason == VCHI_CALLBACK_BULK_TRANSMIT_ABORTED)
+    {
+        assert (_this->m_nBulkPending > 0);
+        _this->m_nBulkPending--;
+
+        if (Reason == VCHI_CALLBACK_BULK_TRANSMIT_ABORTED)
+        {
+            _this->m_State = VCHIQSoundError;
+        }
+        else if (   _this->m_bWriteDeferred
+             && _this->m_State == VCHIQSoundRunning)
+        {
+            _this->m_bWriteDeferred = FALSE;
+
+            vchi_service_use (_this->m_hService);
+
+            if (CVCHIQSoundBaseDevice_Refill (_this) != 0)
+            {
+                assert (0);
+
+                _this->m_State = VCHIQSoundError;
+            }
+
+            vchi_service_release (_this->m_hService);
+        }
+
+        return;
+    }
+
     if (Reason != VCHI_CALLBACK_MSG_AVAILABLE)
     {
         assert (0);
@@ -137,8 +820,7 @@ void CVCHIQSoundBaseDevice_Callback (CVCHIQSoundBaseDevice *_this, const VCHI_CA
     switch (Msg.type)
     {
     case VC_AUDIO_MSG_TYPE_RESULT:
-        _this->m_nResult = Msg.u.result.success;
-        _this->m_Event = true;
+        CVCHIQSoundBaseDevice_CompleteRequest (_this, Msg.u.result.success);
         break;
 
     case VC_AUDIO_MSG_TYPE_COMPLETE:
@@ -149,8 +831,8 @@ void CVCHIQSoundBaseDevice_Callback (CVCHIQSoundBaseDevice *_this, const VCHI_CA
         }
         assert (_this->m_State >= VCHIQSoundRunning);
 
-        if (   Msg.u.complete.cookie1 != VC_AUDIO_WRITE_COOKIE1
-            || Msg.u.complete.cookie2 != VC_AUDIO_WRITE_COOKIE2)
+        if (   Msg.u.complete.cookie1 != (uint32_t) VC_AUDIO_WRITE_COOKIE1
+            || Msg.u.complete.cookie2 != (uint32_t) VC_AUDIO_WRITE_COOKIE2)
         {
             _this->m_State = VCHIQSoundError;
 
@@ -160,8 +842,27 @@ void CVCHIQSoundBaseDevice_Callback (CVCHIQSoundBaseDevice *_this, const VCHI_CA
 
         _this->m_nCompletePos += Msg.u.complete.count & 0x3FFFFFFF;
 
-        // if there is no more than one chunk left queued
-        if (_this->m_nWritePos-_this->m_nCompletePos <= _this->m_nChunkSize*sizeof (s16))
+        int nJitter = CVCHIQSoundBaseDevice_UpdateStats (_this, Msg.u.complete.count & 0x3FFFFFFF);
+        CVCHIQSoundBaseDevice_UpdateClock (_this, Msg.u.complete.count & 0x3FFFFFFF);
+
+        if (_this->m_bAdaptive)
+        {
+            CVCHIQSoundBaseDevice_Adapt (_this, nJitter);
+        }
+
+        if (_this->m_State == VCHIQSoundDraining)
+        {
+            if (_this->m_nCompletePos == _this->m_nWritePos)
+            {
+                CVCHIQSoundBaseDevice_EndDrain (_this);
+            }
+
+            break;
+        }
+
+        // if there is no more than (depth-1) chunks left queued
+        if (   _this->m_nWritePos-_this->m_nCompletePos
+            <= (_this->m_nQueueDepth-1) * _this->m_nChunkSize*sizeof (s16))
         {
             if (_this->m_State == VCHIQSoundCancelled)
             {
@@ -170,7 +871,7 @@ void CVCHIQSoundBaseDevice_Callback (CVCHIQSoundBaseDevice *_this, const VCHI_CA
                 break;
             }
 
-            if (CVCHIQSoundBaseDevice_WriteChunk (_this) != 0)
+            if (CVCHIQSoundBaseDevice_Refill (_this) != 0)
             {
                 assert (0);
 
@@ -203,14 +904,64 @@ void CVCHIQSoundBaseDevice_Ctor (CVCHIQSoundBaseDevice *_this, CVCHIQDevice *pVC
 {
     //assert (44100 <= nSampleRate && nSampleRate <= 48000);
     assert (Destination < VCHIQSoundDestinationUnknown);
+    (void) pVCHIQDevice;            // VCHIQ is accessed through the VCHI instance
 
     _this->chunk_cb = 0;
     _this->m_nSampleRate = nSampleRate;
     _this->m_nChunkSize = nChunkSize;
+    _this->m_nMaxChunkSize = nChunkSize;
+    _this->m_nQueueDepth = 2;
     _this->m_Destination = Destination;
+    mutex_init (&_this->m_WriteMutex);
     _this->m_State = VCHIQSoundCreated;
     _this->m_VCHIInstance = 0;
     _this->m_hService = 0;
+    _this->m_nSlotQuota = 0;
+    _this->m_nRequestIn = 0;
+    _this->m_nRequestOut = 0;
+    _this->m_nNextToken = 0;
+    _this->m_TransferMode = VCHIQSoundTransferAuto;
+    _this->m_bBulkMode = FALSE;
+    for (unsigned i = 0; i < VCHIQ_SOUND_BULK_BUFFERS; i++)
+    {
+        _this->m_pBulkBuffer[i] = 0;
+    }
+    _this->m_nBulkNext = 0;
+    _this->m_nBulkPending = 0;
+    _this->m_bWriteDeferred = FALSE;
+    _this->m_pBatch = 0;
+    _this->m_bEndOfStream = FALSE;
+    _this->m_bAdaptive = FALSE;
+    _this->m_nMinLatencyUs = 0;
+    _this->m_nMaxLatencyUs = 0;
+    _this->m_nLastCompleteTicks = 0;
+    _this->m_bLastCompleteValid = FALSE;
+    _this->m_nJitterPeakUs = 0;
+    _this->m_nAdaptCount = 0;
+    _this->m_bClockValid = FALSE;
+    _this->m_nClockCount = 0;
+    _this->m_nClockAnchorTicks = 0;
+    _this->m_fClockAnchorFrame = 0.0;
+    _this->m_nClockTicks = 0;
+    _this->m_fClockFrame = 0.0;
+    _this->m_fClockRate = nSampleRate / 1000000.0;    // kept from stream to stream
+    _this->m_fClockJitter = 0.0;
+    _this->m_nFramesCompleted = 0;
+    _this->m_nOutputDelayUs = 0;
+    _this->m_pDrainCallback = 0;
+    _this->m_pDrainParam = 0;
+    _this->m_bSilenceDetection = FALSE;
+    _this->m_nSilenceThreshold = 0;
+    CSoundGain_Ctor (&_this->m_Gain, SOUND_GAIN_UNITY);
+    _this->m_nGain = SOUND_GAIN_UNITY;
+    _this->m_nCancelFadeMs = 0;
+    CVCHIQSoundBaseDevice_ResetStats (_this);
+    _this->m_pQueue = 0;
+    _this->m_nQueueSize = 0;
+    _this->m_nQueueInPtr = 0;
+    _this->m_nQueueOutPtr = 0;
+    _this->m_WriteFormat = SoundFormatSigned16;
+    _this->m_nWriteChannels = VCHIQ_SOUND_CHANNELS;
 
     //CDeviceNameService::Get ()->AddDevice ("sndvchiq", this, FALSE);
 }
@@ -227,28 +978,36 @@ boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this)
 
     if (_this->m_State == VCHIQSoundCreated)
     {
-        nResult = vchi_initialise (&_this->m_VCHIInstance);
-        if (nResult != 0)
+        if (s_VCHIInstance == 0)
         {
-            LOG (FromVCHIQSound, LogError,
-                        "Cannot initialize VCHI (%d)", nResult);
+            VCHI_INSTANCE_T VCHIInstance;
+            nResult = vchi_initialise (&VCHIInstance);
+            if (nResult != 0)
+            {
+                LOG (FromVCHIQSound, LogError,
+                            "Cannot initialize VCHI (%d)", nResult);
 
-            _this->m_State = VCHIQSoundError;
+                _this->m_State = VCHIQSoundError;
 
-            return FALSE;
-        }
+                return FALSE;
+            }
 
-        nResult = vchi_connect (0, 0, _this->m_VCHIInstance);
-        if (nResult != 0)
-        {
-            LOG (FromVCHIQSound, LogError,
-                        "Cannot connect VCHI (%d)", nResult);
+            nResult = vchi_connect (0, 0, VCHIInstance);
+            if (nResult != 0)
+            {
+                LOG (FromVCHIQSound, LogError,
+                            "Cannot connect VCHI (%d)", nResult);
 
-            _this->m_State = VCHIQSoundError;
+                _this->m_State = VCHIQSoundError;
 
-            return FALSE;
+                return FALSE;
+            }
+
+            s_VCHIInstance = VCHIInstance;
         }
 
+        _this->m_VCHIInstance = s_VCHIInstance;
+
         SERVICE_CREATION_T Params =
         {
             VCHI_VERSION_EX (VC_AUDIOSERV_VER, VC_AUDIOSERV_MIN_VER),
@@ -269,42 +1028,87 @@ boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this)
             return FALSE;
         }
 
+        if (_this->m_nSlotQuota != 0)
+        {
+            nResult = vchi_service_set_option (_this->m_hService, VCHI_SERVICE_OPTION_SLOT_QUOTA,
+                               _this->m_nSlotQuota);
+            if (nResult != 0)
+            {
+                LOG (FromVCHIQSound, LogWarning,
+                            "Cannot set slot quota (%d)", nResult);
+            }
+        }
+
+        // the sound data must not wait for slots, used by other services
+        nResult = vchi_service_set_option (_this->m_hService, VCHI_SERVICE_OPTION_PRIORITY,
+                           VCHI_PRIORITY_REALTIME);
+        if (nResult != 0)
+        {
+            LOG (FromVCHIQSound, LogWarning, "Cannot set priority (%d)", nResult);
+        }
+
         vchi_service_release (_this->m_hService);
 
+        // the requests are pipelined, the VPU processes the messages in order
+        TVCHIQSoundResult ConfigResult = {FALSE, 0, 0};
         Msg.type = VC_AUDIO_MSG_TYPE_CONFIG;
         Msg.u.config.channels = 2;
         Msg.u.config.samplerate = _this->m_nSampleRate;
         Msg.u.config.bps = 16;
 
-        nResult = CVCHIQSoundBaseDevice_CallMessage (_this, &Msg);
-        if (nResult != 0)
+        unsigned nConfigToken = CVCHIQSoundBaseDevice_SendRequest (_this, &Msg,
+                            CVCHIQSoundBaseDevice_ResultCallback, &ConfigResult);
+
+        TVCHIQSoundResult ControlResult = {FALSE, 0, 0};
+        unsigned nControlToken = 0;
+        if (nConfigToken != 0)
+        {
+            Msg.type = VC_AUDIO_MSG_TYPE_CONTROL;
+            Msg.u.control.dest = _this->m_Destination;
+            Msg.u.control.volume = VOLUME_TO_CHIP (VCHIQ_SOUND_VOLUME_DEFAULT);
+
+            nControlToken = CVCHIQSoundBaseDevice_SendRequest (_this, &Msg,
+                            CVCHIQSoundBaseDevice_ResultCallback, &ControlResult);
+        }
+
+        nResult = -1;
+        if (nControlToken != 0)
+        {
+            Msg.type = VC_AUDIO_MSG_TYPE_OPEN;
+
+            nResult = CVCHIQSoundBaseDevice_QueueMessage(_this, &Msg);
+        }
+
+        // the results are written to local variables, wait for all queued requests
+        while (   (nConfigToken != 0 && !ConfigResult.bDone)
+               || (nControlToken != 0 && !ControlResult.bDone))
+        {
+            SchedulerYield ();
+        }
+
+        assert (nConfigToken == 0 || ConfigResult.nToken == nConfigToken);
+        assert (nControlToken == 0 || ControlResult.nToken == nControlToken);
+
+        if (nConfigToken == 0 || ConfigResult.nResult != 0)
         {
             LOG (FromVCHIQSound, LogError,
-                        "Cannot set config (%d)", nResult);
+                        "Cannot set config (%d)", ConfigResult.nResult);
 
             _this->m_State = VCHIQSoundError;
 
             return FALSE;
         }
 
-        Msg.type = VC_AUDIO_MSG_TYPE_CONTROL;
-        Msg.u.control.dest = _this->m_Destination;
-        Msg.u.control.volume = VOLUME_TO_CHIP (VCHIQ_SOUND_VOLUME_DEFAULT);
-
-        nResult = CVCHIQSoundBaseDevice_CallMessage (_this, &Msg);
-        if (nResult != 0)
+        if (nControlToken == 0 || ControlResult.nResult != 0)
         {
             LOG (FromVCHIQSound, LogError,
-                        "Cannot set control (%d)", nResult);
+                        "Cannot set control (%d)", ControlResult.nResult);
 
             _this->m_State = VCHIQSoundError;
 
             return FALSE;
         }
 
-        Msg.type = VC_AUDIO_MSG_TYPE_OPEN;
-
-        nResult = CVCHIQSoundBaseDevice_QueueMessage(_this, &Msg);
         if (nResult != 0)
         {
             LOG (FromVCHIQSound, LogError,
@@ -351,8 +1155,11 @@ boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this)
         return FALSE;
     }
 
-    // we need peer version 2, because we do not support bulk transfers
-    if (usPeerVersion < 2)
+    // peer versions before 2 support bulk transfers only
+    _this->m_bBulkMode =    _this->m_TransferMode == VCHIQSoundTransferBulk
+                 || (   _this->m_TransferMode == VCHIQSoundTransferAuto
+                     && usPeerVersion < 2);
+    if (!_this->m_bBulkMode && usPeerVersion < 2)
     {
         vchi_service_release (_this->m_hService);
 
@@ -364,15 +1171,66 @@ boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this)
         return FALSE;
     }
 
+    if (_this->m_bBulkMode)
+    {
+        for (unsigned i = 0; i < VCHIQ_SOUND_BULK_BUFFERS; i++)
+        {
+            if (_this->m_pBulkBuffer[i] == 0)
+            {
+                _this->m_pBulkBuffer[i] = (s16 *) kmalloc (_this->m_nMaxChunkSize * sizeof (s16),
+                                       GFP_KERNEL);
+                if (_this->m_pBulkBuffer[i] == 0)
+                {
+                    vchi_service_release (_this->m_hService);
+
+                    LOG (FromVCHIQSound, LogError, "Cannot allocate bulk buffer");
+
+                    _this->m_State = VCHIQSoundError;
+
+                    return FALSE;
+                }
+            }
+        }
+    }
+    else if (_this->m_pBatch == 0)
+    {
+        // the WRITE message and the data packets of the largest chunk
+        unsigned nPackets = (_this->m_nMaxChunkSize * sizeof (s16) + VCHIQ_SOUND_MAX_PACKET-1)
+                    / VCHIQ_SOUND_MAX_PACKET;
+
+        _this->m_pBatch = (VCHI_MSG_BATCH_T *) kmalloc ((1 + nPackets) * sizeof (VCHI_MSG_BATCH_T),
+                                GFP_KERNEL);
+        if (_this->m_pBatch == 0)
+        {
+            vchi_service_release (_this->m_hService);
+
+            LOG (FromVCHIQSound, LogError, "Cannot allocate message batch");
+
+            _this->m_State = VCHIQSoundError;
+
+            return FALSE;
+        }
+    }
+
     _this->m_nWritePos = 0;
     _this->m_nCompletePos = 0;
+    _this->m_bWriteDeferred = FALSE;
+    _this->m_bEndOfStream = FALSE;
+    _this->m_bLastCompleteValid = FALSE;
+    _this->m_bClockValid = FALSE;
+    _this->m_nFramesCompleted = 0;
 
-    nResult = CVCHIQSoundBaseDevice_WriteChunk (_this);
-    if (nResult == 0)
+    if (_this->m_bAdaptive)
     {
-        nResult = CVCHIQSoundBaseDevice_WriteChunk (_this);
+        // start with the upper bound, the latency is reduced, when the timing is stable
+        CVCHIQSoundBaseDevice_SetLatency (_this, _this->m_nMaxLatencyUs);
+
+        _this->m_nJitterPeakUs = _this->m_nMaxLatencyUs / 3;
+        _this->m_nAdaptCount = 0;
     }
 
+    nResult = CVCHIQSoundBaseDevice_Refill (_this);
+
     if (nResult != 0)
     {
         vchi_service_release (_this->m_hService);
@@ -390,10 +1248,106 @@ boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this)
     return TRUE;
 }
 
+boolean CVCHIQSoundBaseDevice_Drain (CVCHIQSoundBaseDevice *_this)
+{
+    if (_this->m_State != VCHIQSoundRunning)
+    {
+        return FALSE;
+    }
+
+    // stops the refill at once
+    _this->m_State = VCHIQSoundDraining;
+
+    VC_AUDIO_MSG_T Msg;
+
+    Msg.type = VC_AUDIO_MSG_TYPE_STOP;
+    Msg.u.stop.draining = 1;
+
+    int nResult = CVCHIQSoundBaseDevice_QueueMessage(_this, &Msg);
+    if (nResult != 0)
+    {
+        LOG (FromVCHIQSound, LogError,
+                    "Cannot stop audio (%d)", nResult);
+    }
+
+    // the last COMPLETE may have arrived already
+    if (   _this->m_State == VCHIQSoundDraining
+        && _this->m_nCompletePos == _this->m_nWritePos)
+    {
+        CVCHIQSoundBaseDevice_EndDrain (_this);
+    }
+
+    return TRUE;
+}
+
+void CVCHIQSoundBaseDevice_SetDrainCallback (CVCHIQSoundBaseDevice *_this, drain_cb_t pCallback, void *pParam)
+{
+    _this->m_pDrainCallback = 0;
+
+    _this->m_pDrainParam = pParam;
+    _this->m_pDrainCallback = pCallback;
+}
+
+static void CVCHIQSoundBaseDevice_CancelDrain (CVCHIQSoundBaseDevice *_this)
+{
+    assert (_this->m_State == VCHIQSoundDraining);
+
+    // nothing is written any more, the queued data is discarded
+    VC_AUDIO_MSG_T Msg;
+
+    Msg.type = VC_AUDIO_MSG_TYPE_STOP;
+    Msg.u.stop.draining = 0;
+
+    CVCHIQSoundBaseDevice_QueueMessage(_this, &Msg);
+
+    _this->m_State = VCHIQSoundIdle;
+}
+
 void CVCHIQSoundBaseDevice_Cancel (CVCHIQSoundBaseDevice *_this)
 {
+    if (_this->m_State == VCHIQSoundDraining)
+    {
+        CVCHIQSoundBaseDevice_CancelDrain (_this);
+
+        return;
+    }
+
+    if (_this->m_State != VCHIQSoundRunning)
+    {
+        return;
+    }
+
+    if (_this->m_nCancelFadeMs > 0)
+    {
+        CSoundGain_Ramp (&_this->m_Gain, 0, _this->m_nSampleRate / 1000 * _this->m_nCancelFadeMs,
+                 SoundRampExponential);
+
+        while (   CSoundGain_IsRamping (&_this->m_Gain)
+               && _this->m_State == VCHIQSoundRunning)
+        {
+            SchedulerYield ();
+        }
+
+        // the queued data ends with the fade-out, which has to be played before it is cut,
+        // the stream may end during the fade-out (state draining)
+        unsigned nWritePos = _this->m_nWritePos;
+        while (   (int) (nWritePos - _this->m_nCompletePos) > 0
+               && (   _this->m_State == VCHIQSoundRunning
+                   || _this->m_State == VCHIQSoundDraining))
+        {
+            SchedulerYield ();
+        }
+
+        if (_this->m_State == VCHIQSoundDraining)
+        {
+            CVCHIQSoundBaseDevice_CancelDrain (_this);
+        }
+    }
+
     if (_this->m_State != VCHIQSoundRunning)
     {
+        CSoundGain_SetGain (&_this->m_Gain, _this->m_nGain);
+
         return;
     }
 
@@ -421,30 +1375,272 @@ void CVCHIQSoundBaseDevice_Cancel (CVCHIQSoundBaseDevice *_this)
 
     vchi_service_release (_this->m_hService);
 
+    CSoundGain_SetGain (&_this->m_Gain, _this->m_nGain);
+
     _this->m_State = VCHIQSoundIdle;
 }
 
+boolean CVCHIQSoundBaseDevice_AllocateQueue (CVCHIQSoundBaseDevice *_this, unsigned nSizeMsecs)
+{
+    assert (_this->m_pQueue == 0);
+    assert (1 <= nSizeMsecs && nSizeMsecs <= 1000);
+
+    unsigned nWords = _this->m_nSampleRate * nSizeMsecs / 1000 * VCHIQ_SOUND_CHANNELS;
+
+    // the size must be a power of two for the free running pointers
+    unsigned nSize = 1;
+    while (nSize < nWords)
+    {
+        nSize <<= 1;
+    }
+
+    _this->m_pQueue = (s16 *) kmalloc (nSize * sizeof (s16), GFP_KERNEL);
+    if (_this->m_pQueue == 0)
+    {
+        return FALSE;
+    }
+
+    _this->m_nQueueSize = nSize;
+    _this->m_nQueueInPtr = 0;
+    _this->m_nQueueOutPtr = 0;
+
+    return TRUE;
+}
+
+unsigned CVCHIQSoundBaseDevice_GetQueueSizeFrames (CVCHIQSoundBaseDevice *_this)
+{
+    return _this->m_nQueueSize / VCHIQ_SOUND_CHANNELS;
+}
+
+unsigned CVCHIQSoundBaseDevice_GetQueueFramesAvail (CVCHIQSoundBaseDevice *_this)
+{
+    return (_this->m_nQueueInPtr - _this->m_nQueueOutPtr) / VCHIQ_SOUND_CHANNELS;
+}
+
+int CVCHIQSoundBaseDevice_Write (CVCHIQSoundBaseDevice *_this, const void *pBuffer, size_t nCount)
+{
+    assert (pBuffer != 0);
+    if (_this->m_pQueue == 0)
+    {
+        return -1;
+    }
+
+    unsigned nInPtr = _this->m_nQueueInPtr;
+    unsigned nFree = _this->m_nQueueSize - (nInPtr - _this->m_nQueueOutPtr);
+    mb ();
+
+    // only whole frames are queued
+    unsigned nFrameSize = SoundConvertGetFrameSize (_this->m_WriteFormat, _this->m_nWriteChannels);
+    unsigned nFrames = nCount / nFrameSize;
+    if (nFrames > nFree / VCHIQ_SOUND_CHANNELS)
+    {
+        nFrames = nFree / VCHIQ_SOUND_CHANNELS;
+    }
+
+    unsigned nStart = nInPtr & (_this->m_nQueueSize-1);
+    unsigned nFirst = (_this->m_nQueueSize - nStart) / VCHIQ_SOUND_CHANNELS;
+    if (nFirst > nFrames)
+    {
+        nFirst = nFrames;
+    }
+
+    const u8 *pData = (const u8 *) pBuffer;
+    SoundConvertToStereo16 (_this->m_pQueue + nStart, pData, nFirst,
+                _this->m_WriteFormat, _this->m_nWriteChannels);
+    SoundConvertToStereo16 (_this->m_pQueue, pData + nFirst * nFrameSize, nFrames - nFirst,
+                _this->m_WriteFormat, _this->m_nWriteChannels);
+
+    wmb ();
+    _this->m_nQueueInPtr = nInPtr + nFrames * VCHIQ_SOUND_CHANNELS;
+
+    return nFrames * nFrameSize;
+}
+
+void CVCHIQSoundBaseDevice_SetWriteFormat (CVCHIQSoundBaseDevice *_this, enum TSoundFormat Format, unsigned nChannels)
+{
+    assert (Format < SoundFormatUnknown);
+    assert (nChannels == 1 || nChannels == 2);
+
+    _this->m_WriteFormat = Format;
+    _this->m_nWriteChannels = nChannels;
+}
+
+void CVCHIQSoundBaseDevice_SetAdaptive (CVCHIQSoundBaseDevice *_this, unsigned nMinLatencyMs, unsigned nMaxLatencyMs)
+{
+    assert (nMinLatencyMs <= nMaxLatencyMs);
+    assert (_this->m_State <= VCHIQSoundIdle);
+
+    _this->m_bAdaptive = nMaxLatencyMs > 0;
+    _this->m_nMinLatencyUs = nMinLatencyMs * 1000;
+    _this->m_nMaxLatencyUs = nMaxLatencyMs * 1000;
+
+    if (!_this->m_bAdaptive)
+    {
+        _this->m_nChunkSize = _this->m_nMaxChunkSize;
+        _this->m_nQueueDepth = 2;
+    }
+}
+
+void CVCHIQSoundBaseDevice_SetSilenceDetection (CVCHIQSoundBaseDevice *_this, boolean bEnable, unsigned nThreshold)
+{
+    assert (nThreshold <= 32767);
+
+    _this->m_nSilenceThreshold = nThreshold;
+    _this->m_bSilenceDetection = bEnable;
+}
+
+void CVCHIQSoundBaseDevice_SetGain (CVCHIQSoundBaseDevice *_this, unsigned nGain, unsigned nRampMs,
+                    enum TSoundRamp Ramp)
+{
+    _this->m_nGain = nGain;
+
+    CSoundGain_Ramp (&_this->m_Gain, nGain, _this->m_nSampleRate / 1000 * nRampMs, Ramp);
+}
+
+boolean CVCHIQSoundBaseDevice_IsFading (CVCHIQSoundBaseDevice *_this)
+{
+    return CSoundGain_IsRamping (&_this->m_Gain);
+}
+
+void CVCHIQSoundBaseDevice_SetCancelFade (CVCHIQSoundBaseDevice *_this, unsigned nFadeMs)
+{
+    _this->m_nCancelFadeMs = nFadeMs;
+}
+
+void CVCHIQSoundBaseDevice_SetSlotQuota (CVCHIQSoundBaseDevice *_this, unsigned nSlots)
+{
+    assert (_this->m_State == VCHIQSoundCreated);
+
+    _this->m_nSlotQuota = nSlots;
+}
+
+void CVCHIQSoundBaseDevice_GetStats (CVCHIQSoundBaseDevice *_this, TVCHIQSoundStats *pStats)
+{
+    assert (pStats != 0);
+
+    memcpy (pStats, &_this->m_Stats, sizeof *pStats);
+}
+
+void CVCHIQSoundBaseDevice_ResetStats (CVCHIQSoundBaseDevice *_this)
+{
+    memset (&_this->m_Stats, 0, sizeof _this->m_Stats);
+    _this->m_Stats.nCallbackMinUs = (unsigned) -1;
+}
+
+boolean CVCHIQSoundBaseDevice_GetPlaybackPosition (CVCHIQSoundBaseDevice *_this, TVCHIQSoundPosition *pPosition)
+{
+    assert (pPosition != 0);
+
+    if (!_this->m_bClockValid)
+    {
+        return FALSE;
+    }
+
+    unsigned nTicks = GetClockTicks ();
+
+    double fFrame =   _this->m_fClockFrame
+            + ((double) (int) (nTicks - _this->m_nClockTicks) - _this->m_nOutputDelayUs)
+              * _this->m_fClockRate;
+
+    // the VPU cannot play more than has been completed so far
+    if (fFrame > (double) _this->m_nFramesCompleted)
+    {
+        fFrame = (double) _this->m_nFramesCompleted;
+    }
+    if (fFrame < 0.0)
+    {
+        fFrame = 0.0;
+    }
+
+    pPosition->nFrame = (uint64_t) fFrame;
+    pPosition->nTicks = nTicks;
+    pPosition->bLocked = _this->m_nClockCount >= VCHIQ_SOUND_CLOCK_LOCK_COUNT;
+
+    unsigned nUncertainty = (unsigned) (3.0 * _this->m_fClockJitter) + 1;
+    if (!pPosition->bLocked)
+    {
+        nUncertainty += _this->m_nChunkSize / VCHIQ_SOUND_CHANNELS;
+    }
+    pPosition->nUncertaintyFrames = nUncertainty;
+
+    double fNominal = _this->m_nSampleRate / 1000000.0;
+    pPosition->nDriftPPM = (int) ((_this->m_fClockRate - fNominal) / fNominal * 1000000.0);
+
+    return TRUE;
+}
+
+boolean CVCHIQSoundBaseDevice_GetFrameTicks (CVCHIQSoundBaseDevice *_this, uint64_t nFrame, unsigned *pTicks)
+{
+    assert (pTicks != 0);
+
+    if (!_this->m_bClockValid)
+    {
+        return FALSE;
+    }
+
+    double fDelta = ((double) nFrame - _this->m_fClockFrame) / _this->m_fClockRate;
+    if (fDelta > FRAME_TICKS_MAX_DELTA)
+    {
+        fDelta = FRAME_TICKS_MAX_DELTA;
+    }
+    else if (fDelta < -FRAME_TICKS_MAX_DELTA)
+    {
+        fDelta = -FRAME_TICKS_MAX_DELTA;
+    }
+
+    *pTicks = _this->m_nClockTicks + (unsigned) (int) fDelta + _this->m_nOutputDelayUs;
+
+    return TRUE;
+}
+
+void CVCHIQSoundBaseDevice_SetOutputDelay (CVCHIQSoundBaseDevice *_this, unsigned nDelayUs)
+{
+    _this->m_nOutputDelayUs = nDelayUs;
+}
+
+void CVCHIQSoundBaseDevice_SetTransferMode (CVCHIQSoundBaseDevice *_this, enum TVCHIQSoundTransferMode Mode)
+{
+    assert (Mode < VCHIQSoundTransferUnknown);
+    assert (_this->m_State <= VCHIQSoundIdle);
+
+    _this->m_TransferMode = Mode;
+}
+
 boolean CVCHIQSoundBaseDevice_IsActive (CVCHIQSoundBaseDevice *_this)
 {
     return _this->m_State >= VCHIQSoundRunning;
 }
 
-void CVCHIQSoundBaseDevice_SetControl (CVCHIQSoundBaseDevice *_this, int nVolume, enum TVCHIQSoundDestination Destination)
+static void CVCHIQSoundBaseDevice_GetControlMessage (CVCHIQSoundBaseDevice *_this, VC_AUDIO_MSG_T *pMessage,
+                             int nVolume, enum TVCHIQSoundDestination Destination)
 {
     if (!(VCHIQ_SOUND_VOLUME_MIN <= nVolume && nVolume <= VCHIQ_SOUND_VOLUME_MAX))
     {
         nVolume = VCHIQ_SOUND_VOLUME_DEFAULT;
     }
 
-    if (Destination < VCHIQSoundDestinationUnknown)
+    if (!(Destination < VCHIQSoundDestinationUnknown))
     {
-        _this->m_Destination = Destination;
+        Destination = _this->m_Destination;
     }
 
+    pMessage->type = VC_AUDIO_MSG_TYPE_CONTROL;
+    pMessage->u.control.dest = Destination;
+    pMessage->u.control.volume = VOLUME_TO_CHIP (nVolume);
+}
+
+void CVCHIQSoundBaseDevice_SetControl (CVCHIQSoundBaseDevice *_this, int nVolume, enum TVCHIQSoundDestination Destination)
+{
     VC_AUDIO_MSG_T Msg;
-    Msg.type = VC_AUDIO_MSG_TYPE_CONTROL;
-    Msg.u.control.dest = _this->m_Destination;
-    Msg.u.control.volume = VOLUME_TO_CHIP (nVolume);
+    CVCHIQSoundBaseDevice_GetControlMessage (_this, &Msg, nVolume, Destination);
+
+    _this->m_Destination = Msg.u.control.dest;
+
+    // the destination is sent on CVCHIQSoundBaseDevice_Start()
+    if (_this->m_hService == 0)
+    {
+        return;
+    }
 
     int nResult = CVCHIQSoundBaseDevice_CallMessage (_this, &Msg);
     if (nResult != 0)
@@ -453,3 +1649,39 @@ void CVCHIQSoundBaseDevice_SetControl (CVCHIQSoundBaseDevice *_this, int nVolume
                     "Cannot set control (%d)", nResult);
     }
 }
+
+unsigned CVCHIQSoundBaseDevice_SetControlAsync (CVCHIQSoundBaseDevice *_this, int nVolume,
+                        enum TVCHIQSoundDestination Destination,
+                        request_cb_t pCallback, void *pParam)
+{
+    VC_AUDIO_MSG_T Msg;
+    CVCHIQSoundBaseDevice_GetControlMessage (_this, &Msg, nVolume, Destination);
+
+    if (_this->m_hService == 0)
+    {
+        return 0;
+    }
+
+    unsigned nToken = CVCHIQSoundBaseDevice_SendRequest (_this, &Msg, pCallback, pParam);
+    if (nToken != 0)
+    {
+        _this->m_Destination = Msg.u.control.dest;
+    }
+
+    return nToken;
+}
+
+boolean CVCHIQSoundBaseDevice_IsRequestPending (CVCHIQSoundBaseDevice *_this, unsigned nToken)
+{
+    for (unsigned i = _this->m_nRequestOut; i != _this->m_nRequestIn; i++)
+    {
+        TVCHIQSoundRequest *pRequest = &_this->m_Request[i % VCHIQ_SOUND_MAX_REQUESTS];
+        if (   pRequest->nToken == nToken
+            && !pRequest->bFailed)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
@@ -25,9 +25,13 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <vc4/vchiq/vchiqdevice.h>
 #include <vc4/vchi/vchi.h>
+#include <linux/mutex.h>
 #include "vc_vchi_audioserv_defs.h"
+#include "soundconvert.h"
+#include "soundgain.h"
 
 #define VCHIQ_SOUND_VOLUME_MIN        -10000
 #define VCHIQ_SOUND_VOLUME_DEFAULT    0
@@ -46,39 +50,187 @@ enum TVCHIQSoundState
     VCHIQSoundCreated,
     VCHIQSoundIdle,
     VCHIQSoundRunning,
+    VCHIQSoundDraining,
     VCHIQSoundCancelled,
     VCHIQSoundTerminating,
     VCHIQSoundError,
     VCHIQSoundUnknown
 };
 
+enum TVCHIQSoundTransferMode
+{
+    VCHIQSoundTransferAuto,        ///< bulk transfers, if the peer does not support messages
+    VCHIQSoundTransferMessages,    ///< sound data is sent in the VCHIQ message slots
+    VCHIQSoundTransferBulk,        ///< sound data is read by the VPU using bulk transfers
+    VCHIQSoundTransferUnknown
+};
+
+#define VCHIQ_SOUND_BULK_BUFFERS    3
+
+#define VCHIQ_SOUND_MIN_CHUNK_SIZE    256        // words, used in adaptive mode
+#define VCHIQ_SOUND_MAX_QUEUE_DEPTH    8        // chunks in flight
+
+#define VCHIQ_SOUND_HISTOGRAM_SIZE    16        // buckets, log2 scale
+
+/// \brief Statistics of the sound data path, returned by CVCHIQSoundBaseDevice_GetStats()
+/// \note Bucket n of a histogram counts the values from 2^n to 2^(n+1)-1 (bucket 0 from 0 to 1),\n
+///       the last bucket counts all greater values too.
+typedef struct TVCHIQSoundStats
+{
+    unsigned nChunks;                // number of chunks written
+    unsigned nSilentChunks;            // sent as silence without data
+    unsigned nCompletions;            // number of COMPLETE messages received
+    uint64_t nBytesCompleted;            // sound data played by the VPU
+
+    unsigned nUnderruns;            // VPU ran dry (nothing queued at COMPLETE)
+    unsigned nSourceUnderruns;            // write queue empty, silence inserted
+
+    unsigned nCallbackCount;            // chunk_cb() or write queue reads
+    unsigned nCallbackMinUs;
+    unsigned nCallbackMaxUs;
+    uint64_t nCallbackTotalUs;
+    unsigned CallbackHistogram[VCHIQ_SOUND_HISTOGRAM_SIZE];    // microseconds
+
+    unsigned nJitterMaxUs;            // of the COMPLETE inter-arrival time
+    unsigned JitterHistogram[VCHIQ_SOUND_HISTOGRAM_SIZE];    // microseconds
+
+    unsigned QueuedHistogram[VCHIQ_SOUND_HISTOGRAM_SIZE];    // bytes in flight at COMPLETE
+
+    unsigned nLatencyUs;            // estimated output latency at the last COMPLETE
+    unsigned nLatencyMaxUs;
+}
+TVCHIQSoundStats;
+
+#define VCHIQ_SOUND_CLOCK_LOCK_COUNT    16        // COMPLETE messages until locked
+#define VCHIQ_SOUND_CLOCK_MAX_DRIFT    1000        // ppm, limit of the estimation
+
+/// \brief Playback position, returned by CVCHIQSoundBaseDevice_GetPlaybackPosition()
+typedef struct TVCHIQSoundPosition
+{
+    uint64_t nFrame;                // frame at the DAC at nTicks (counted from Start())
+    unsigned nTicks;                // GetClockTicks() value of the estimation
+    unsigned nUncertaintyFrames;        // nFrame is +/- this exact (estimated)
+    int nDriftPPM;                // VPU sample clock against system timer (> 0 is faster)
+    boolean bLocked;                // the estimation has settled
+}
+TVCHIQSoundPosition;
+
+/// \brief Renders sound data directly into the VCHIQ slot memory or a bulk buffer
+/// \param pBuffer    buffer of nChunkSize words (interleaved stereo samples)
+/// \param nChunkSize    at most one packet of 2000 words, the whole chunk in bulk mode
+/// \return Number of words rendered (< nChunkSize to end the stream, the rest is silence)
+/// \note Is called on the slot handler thread. In message mode it is called with the\n
+///       VCHIQ slot mutex held and must not queue VCHIQ messages.
 typedef unsigned (*chunk_cb_t) (int16_t *pBuffer, unsigned nChunkSize);
 
+/// \brief Is called, when the RESULT message of an asynchronous request arrives
+/// \param nToken    token returned by the request function
+/// \param nResult    0 on success
+/// \param pParam    parameter given to the request function
+/// \note Is called on the slot handler thread and must not wait for other requests.
+typedef void (*request_cb_t) (unsigned nToken, int nResult, void *pParam);
+
+/// \brief Is called, when the last queued sound data has been played after a drain or\n
+///        the end of the stream
+/// \param pParam    parameter given to CVCHIQSoundBaseDevice_SetDrainCallback()
+/// \note Is called on the slot handler thread, CVCHIQSoundBaseDevice_Start() can be called here.\n
+///       If no sound data is pending any more, it is called directly from\n
+///       CVCHIQSoundBaseDevice_Drain() or CVCHIQSoundBaseDevice_Start() on the caller's thread.
+typedef void (*drain_cb_t) (void *pParam);
+
+#define VCHIQ_SOUND_MAX_REQUESTS    8        // waiting for their RESULT message
+
+typedef struct TVCHIQSoundRequest
+{
+    unsigned nToken;
+    request_cb_t pCallback;
+    void *pParam;
+    boolean bFailed;                // message could not be queued, no RESULT expected
+}
+TVCHIQSoundRequest;
+
 typedef struct CVCHIQSoundBaseDevice_s
 {
     chunk_cb_t chunk_cb;
 
     unsigned m_nSampleRate;
-    unsigned m_nChunkSize;
+    unsigned m_nChunkSize;            // current chunk size in words
+    unsigned m_nMaxChunkSize;            // chunk size given to the constructor
+    unsigned m_nQueueDepth;            // chunks kept in flight
     enum TVCHIQSoundDestination m_Destination;
 
     volatile enum TVCHIQSoundState m_State;
 
-    VCHI_INSTANCE_T m_VCHIInstance;
-    VCHI_SERVICE_HANDLE_T m_hService;
+    VCHI_INSTANCE_T m_VCHIInstance;        // shared by all devices
+    VCHI_SERVICE_HANDLE_T m_hService;        // one AUDS service per device
+    unsigned m_nSlotQuota;
 
-    volatile bool m_Event;
-    int m_nResult;
+    // the VPU answers the requests in order
+    TVCHIQSoundRequest m_Request[VCHIQ_SOUND_MAX_REQUESTS];
+    volatile unsigned m_nRequestIn;
+    volatile unsigned m_nRequestOut;
+    unsigned m_nNextToken;
 
+    struct mutex m_WriteMutex;            // one chunk is written at a time
     unsigned m_nWritePos;
     unsigned m_nCompletePos;
+
+    enum TVCHIQSoundTransferMode m_TransferMode;
+    boolean m_bBulkMode;
+    int16_t *m_pBulkBuffer[VCHIQ_SOUND_BULK_BUFFERS];
+    unsigned m_nBulkNext;
+    volatile unsigned m_nBulkPending;
+    boolean m_bWriteDeferred;
+    VCHI_MSG_BATCH_T *m_pBatch;            // message mode, one chunk is queued at once
+    boolean m_bEndOfStream;            // chunk_cb() returned less than requested
+
+    boolean m_bAdaptive;
+    unsigned m_nMinLatencyUs;
+    unsigned m_nMaxLatencyUs;
+    unsigned m_nLastCompleteTicks;
+    boolean m_bLastCompleteValid;
+    unsigned m_nJitterPeakUs;            // of the COMPLETE message arrival
+    unsigned m_nAdaptCount;
+
+    // playback clock, estimated from the arrival times of the COMPLETE messages
+    boolean m_bClockValid;
+    unsigned m_nClockCount;
+    unsigned m_nClockAnchorTicks;        // start of the measurement of the rate
+    double m_fClockAnchorFrame;
+    unsigned m_nClockTicks;            // time of the last estimation
+    double m_fClockFrame;            // frames consumed by the VPU at m_nClockTicks
+    double m_fClockRate;            // frames per microsecond
+    double m_fClockJitter;            // mean deviation of the COMPLETE messages in frames
+    uint64_t m_nFramesCompleted;
+    unsigned m_nOutputDelayUs;
+
+    drain_cb_t m_pDrainCallback;
+    void *m_pDrainParam;
+
+    boolean m_bSilenceDetection;
+    unsigned m_nSilenceThreshold;
+
+    CSoundGain m_Gain;                // applied to the rendered data
+    unsigned m_nGain;                // requested by the application
+    unsigned m_nCancelFadeMs;
+
+    TVCHIQSoundStats m_Stats;            // updated on the slot handler thread
+
+    int16_t *m_pQueue;
+    unsigned m_nQueueSize;            // words, power of two
+    volatile unsigned m_nQueueInPtr;        // written by the producer only
+    volatile unsigned m_nQueueOutPtr;        // written by the slot handler only
+    enum TSoundFormat m_WriteFormat;
+    unsigned m_nWriteChannels;
 } CVCHIQSoundBaseDevice;
 
 /// \param pVCHIQDevice    pointer to the VCHIQ interface device
 /// \param nSampleRate    sample rate in Hz (44100..48000)
-/// \param nChunkSize    number of samples transfered at once
+/// \param nChunkSize    number of samples transfered at once (maximum in adaptive mode)
 /// \param Destination    the target device, the sound data is sent to\n
 ///            (detected automatically, if equal to VCHIQSoundDestinationAuto)
+/// \note Multiple devices with different destinations can be used at the same time. They share\n
+///       one VCHI instance and each device opens its own AUDS service.
 void CVCHIQSoundBaseDevice_Ctor (
     CVCHIQSoundBaseDevice *_this,
     CVCHIQDevice *pVCHIQDevice,
@@ -86,12 +238,139 @@ void CVCHIQSoundBaseDevice_Ctor (
     unsigned nChunkSize,
     enum TVCHIQSoundDestination Destination);
 
+/// \brief Same as CVCHIQSoundBaseDevice_SetControl(), but does not wait for the result
+/// \param pCallback    is called with the result (0 if not required)
+/// \param pParam    parameter handed over to pCallback
+/// \return Token of the request (0 if the request queue is full or the device is not connected)
+unsigned CVCHIQSoundBaseDevice_SetControlAsync (
+    CVCHIQSoundBaseDevice *_this,
+    int nVolume,
+    enum TVCHIQSoundDestination Destination,
+    request_cb_t pCallback, void *pParam);
+
+/// \return Is the request with this token still waiting for its result?
+boolean CVCHIQSoundBaseDevice_IsRequestPending (CVCHIQSoundBaseDevice *_this, unsigned nToken);
+
+/// \param Mode    how the sound data is sent to the VPU (default VCHIQSoundTransferAuto)
+/// \note Must be called before CVCHIQSoundBaseDevice_Start().
+void CVCHIQSoundBaseDevice_SetTransferMode (
+    CVCHIQSoundBaseDevice *_this,
+    enum TVCHIQSoundTransferMode Mode);
+
+/// \brief Allocates the queue used by CVCHIQSoundBaseDevice_Write()
+/// \param nSizeMsecs    size of the queue in milliseconds duration of the stream
+/// \return Operation successful?
+/// \note The queue is used as sound source, if chunk_cb is not set.
+boolean CVCHIQSoundBaseDevice_AllocateQueue (CVCHIQSoundBaseDevice *_this, unsigned nSizeMsecs);
+
+/// \return Queue size in number of frames (stereo samples)
+unsigned CVCHIQSoundBaseDevice_GetQueueSizeFrames (CVCHIQSoundBaseDevice *_this);
+
+/// \return Number of frames currently waiting in the queue
+unsigned CVCHIQSoundBaseDevice_GetQueueFramesAvail (CVCHIQSoundBaseDevice *_this);
+
+/// \brief Sets the format of the sound data passed to CVCHIQSoundBaseDevice_Write()
+/// \param Format    sample format (default SoundFormatSigned16)
+/// \param nChannels    1 (mono) or 2 (stereo, default)
+/// \note The data is converted to 16-bit stereo, when it is written to the queue.
+void CVCHIQSoundBaseDevice_SetWriteFormat (CVCHIQSoundBaseDevice *_this,
+                       enum TSoundFormat Format, unsigned nChannels);
+
+/// \brief Appends sound data in the format set with CVCHIQSoundBaseDevice_SetWriteFormat() to the queue
+/// \param pBuffer    sound data (interleaved, if stereo)
+/// \param nCount    size of the sound data in bytes
+/// \return Number of bytes queued (may be less than nCount, if the queue is full), or < 0 on error
+/// \note Does not block. Must be called from one producer thread only.
+/// \note The slot handler plays silence, while the queue is empty.
+int CVCHIQSoundBaseDevice_Write (CVCHIQSoundBaseDevice *_this, const void *pBuffer, size_t nCount);
+
+/// \brief Enables the adaptive mode, in which chunk size and queue depth follow the\n
+///       measured jitter of the completion messages
+/// \param nMinLatencyMs    lower bound of the queued sound data in milliseconds
+/// \param nMaxLatencyMs    upper bound of the queued sound data in milliseconds (0 to disable)
+/// \note The chunk size stays between VCHIQ_SOUND_MIN_CHUNK_SIZE and nChunkSize given to the\n
+///       constructor, the queue depth between 2 and VCHIQ_SOUND_MAX_QUEUE_DEPTH chunks.
+void CVCHIQSoundBaseDevice_SetAdaptive (CVCHIQSoundBaseDevice *_this,
+                    unsigned nMinLatencyMs, unsigned nMaxLatencyMs);
+
+/// \brief Returns a snapshot of the statistics, which are collected since construction\n
+///       or the last call of CVCHIQSoundBaseDevice_ResetStats()
+/// \param pStats    the statistics are copied here
+/// \note The snapshot is consistent, because the slot handler does not preempt the caller.
+void CVCHIQSoundBaseDevice_GetStats (CVCHIQSoundBaseDevice *_this, TVCHIQSoundStats *pStats);
+
+/// \brief Clears the statistics
+void CVCHIQSoundBaseDevice_ResetStats (CVCHIQSoundBaseDevice *_this);
+
+/// \brief Enables the detection of silent chunks, which are sent as WRITE messages without data
+/// \param bEnable    enable or disable (default) the detection
+/// \param nThreshold    samples with an absolute value up to this are regarded as silence
+/// \note Silent data of the write queue is skipped without copying it. In message mode\n
+///       chunk_cb() renders directly into the slot memory after the WRITE message,\n
+///       so its data is not checked.
+void CVCHIQSoundBaseDevice_SetSilenceDetection (CVCHIQSoundBaseDevice *_this,
+                        boolean bEnable, unsigned nThreshold);
+
+/// \brief Sets the software gain, which is applied to the data from chunk_cb() or the write queue
+/// \param nGain    0..SOUND_GAIN_UNITY (default)
+/// \param nRampMs    length of the fade in milliseconds (0 to set the gain immediately)
+/// \param Ramp        shape of the fade
+/// \note This method does not send a control message and can be called while running.
+void CVCHIQSoundBaseDevice_SetGain (CVCHIQSoundBaseDevice *_this,
+                    unsigned nGain, unsigned nRampMs, enum TSoundRamp Ramp);
+
+/// \return Is a fade started with CVCHIQSoundBaseDevice_SetGain() still running?
+boolean CVCHIQSoundBaseDevice_IsFading (CVCHIQSoundBaseDevice *_this);
+
+/// \param nFadeMs    CVCHIQSoundBaseDevice_Cancel() fades out for this time, before it\n
+///            stops the transmission (0 to stop at once, default)
+void CVCHIQSoundBaseDevice_SetCancelFade (CVCHIQSoundBaseDevice *_this, unsigned nFadeMs);
+
+/// \brief Limits the number of message slots, this device may occupy
+/// \param nSlots    maximum number of slots (0 for the default of half of the slots)
+/// \note With more than two devices running at the same time, the quota should be set\n
+///       so that no stream can starve the others. Must be called before Start().
+void CVCHIQSoundBaseDevice_SetSlotQuota (CVCHIQSoundBaseDevice *_this, unsigned nSlots);
+
+/// \brief Returns the frame, which is currently played at the DAC
+/// \param pPosition    the estimation is returned here
+/// \return Is an estimation available? (not before the first COMPLETE message after Start())
+/// \note The position is interpolated between the COMPLETE messages using the estimated\n
+///       sample clock. It restarts with the next COMPLETE message after an underrun.
+boolean CVCHIQSoundBaseDevice_GetPlaybackPosition (CVCHIQSoundBaseDevice *_this,
+                           TVCHIQSoundPosition *pPosition);
+
+/// \brief Predicts the time, at which a frame will be played at the DAC
+/// \param nFrame    frame number as returned in TVCHIQSoundPosition::nFrame
+/// \param pTicks    the GetClockTicks() value is returned here (may be in the past)
+/// \return Is an estimation available?
+/// \note Can be used to program a timer, which triggers an event in sync with the sound.\n
+///       Frames more than about 35 minutes away are clamped to this distance.
+boolean CVCHIQSoundBaseDevice_GetFrameTicks (CVCHIQSoundBaseDevice *_this,
+                         uint64_t nFrame, unsigned *pTicks);
+
+/// \param nDelayUs    delay between the consumption of data by the VPU and its output\n
+///            at the DAC in microseconds (default 0, depends on the destination)
+void CVCHIQSoundBaseDevice_SetOutputDelay (CVCHIQSoundBaseDevice *_this, unsigned nDelayUs);
+
 /// \brief Connects to the VCHIQ sound service and starts sending sound data
 /// \return Operation successful?
 boolean CVCHIQSoundBaseDevice_Start (CVCHIQSoundBaseDevice *_this);
 
+/// \brief Stops the transmission of sound data after the queued data has been played
+/// \return Was the device running?
+/// \note Does not wait, the device stays active until the last COMPLETE message arrives.
+boolean CVCHIQSoundBaseDevice_Drain (CVCHIQSoundBaseDevice *_this);
+
+/// \brief Sets the callback, which is called, when the drain or the end of the stream\n
+///        (chunk_cb() returned less than requested) has been completed
+/// \param pCallback    callback function (0 to remove)
+/// \param pParam    parameter handed over to pCallback
+void CVCHIQSoundBaseDevice_SetDrainCallback (CVCHIQSoundBaseDevice *_this,
+                         drain_cb_t pCallback, void *pParam);
+
 /// \brief Stops the transmission of sound data
-/// \note Cancel takes effect after a short delay
+/// \note Cancel takes effect after a short delay (and the fade-out, if enabled)
 void CVCHIQSoundBaseDevice_Cancel (CVCHIQSoundBaseDevice *_this);
 
 /// \return Is the sound data transmission running?
@@ -100,7 +379,9 @@ boolean CVCHIQSoundBaseDevice_IsActive (CVCHIQSoundBaseDevice *_this);
 /// \param nVolume    Output volume to be set (-10000..400)
 /// \param Destination    the target device, the sound data is sent to\n
 ///            (not modified, if equal to VCHIQSoundDestinationUnknown)
-/// \note This method can be called, while the sound data transmission is running.
+/// \note This method can be called, while the sound data transmission is running.\n
+///       Before the device is connected by CVCHIQSoundBaseDevice_Start(), only the\n
+///       destination is set.
 void CVCHIQSoundBaseDevice_SetControl (
     CVCHIQSoundBaseDevice *_this,
     int nVolume,
@@ -240,6 +240,27 @@ extern int32_t vchi_msg_queue( VCHI_SERVICE_HANDLE_T handle,
                                VCHI_FLAGS_T flags,
                                void *msg_handle );
 
+// Callback, which writes up to maxsize bytes of message data to dest
+// Returns the number of bytes written (> 0) or a negative error code
+typedef int (*VCHI_COPY_CALLBACK_T)( void *context,
+                                     void *dest,
+                                     unsigned int offset,
+                                     unsigned int maxsize );
+
+// One message of vchi_msg_queue_batch(), the data is produced by copy_callback,
+// if it is not NULL, and copied from data otherwise
+typedef struct {
+   const void *data;
+   VCHI_COPY_CALLBACK_T copy_callback;
+   void *context;
+   uint32_t data_size;
+} VCHI_MSG_BATCH_T;
+
+// Routine to send several messages with a single signal to the peer
+extern int32_t vchi_msg_queue_batch( VCHI_SERVICE_HANDLE_T handle,
+                                     const VCHI_MSG_BATCH_T *batch,
+                                     uint32_t count );
+
 // scatter-gather (vector) and send message
 int32_t vchi_msg_queuev_ex( VCHI_SERVICE_HANDLE_T handle,
                             VCHI_MSG_VECTOR_EX_T *vector,
@@ -117,10 +117,21 @@ typedef enum
 
    VCHI_SERVICE_OPTION_TRACE,
    VCHI_SERVICE_OPTION_SYNCHRONOUS,
+   VCHI_SERVICE_OPTION_SLOT_QUOTA,
+   VCHI_SERVICE_OPTION_MESSAGE_QUOTA,
+   VCHI_SERVICE_OPTION_PRIORITY,
 
    VCHI_SERVICE_OPTION_MAX
 } VCHI_SERVICE_OPTION_T;
 
+// values of VCHI_SERVICE_OPTION_PRIORITY (same as VCHIQ_PRIORITY_T)
+typedef enum
+{
+   VCHI_PRIORITY_REALTIME,
+   VCHI_PRIORITY_NORMAL,
+   VCHI_PRIORITY_BACKGROUND
+} VCHI_SERVICE_PRIORITY_T;
+
 
 //Callback used by all services / bulk transfers
 typedef void (*VCHI_CALLBACK_T)( void *callback_param, //my service local param
@@ -37,6 +37,7 @@
 #include <linux/interrupt.h>
 #include <linux/pagemap.h>
 #include <linux/dma-mapping.h>
+#include <linux/delay.h>
 #include <linux/io.h>
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
@@ -57,9 +58,13 @@ extern void dmac_map_area(const void *, size_t, int);
 extern void dmac_unmap_area(const void *, size_t, int);
 #else
 #include <linux/synchronize.h>
+#include <linux/kthread.h>
+#include <linux/spinlock.h>
+#include <linux/env.h>
 #endif
 
-#define TOTAL_SLOTS (VCHIQ_SLOT_ZERO_SLOTS + 2 * 32)
+#define DEFAULT_SLOTS_PER_SIDE 32
+#define TOTAL_SLOTS(per_side) (VCHIQ_SLOT_ZERO_SLOTS + 2 * (per_side))
 
 #ifndef __circle__
 #define VCHIQ_ARM_ADDRESS(x) ((void *)((char *)x + g_virt_to_bus_offset))
@@ -84,24 +89,51 @@ typedef struct vchiq_2835_state_struct {
 } VCHIQ_2835_ARM_STATE_T;
 
 static void __iomem *g_regs;
+
+/* Doorbell coalescing (opt-in): BELL2 is not rung, while a burst is held, or
+** within g_doorbell_window microseconds after the last one. Then it is also
+** not rung, while the event of the last one is still pending on the VPU. A
+** deferred doorbell is rung at the end of the burst or the window, by the next
+** signal, by the VCHIQ interrupt or by the doorbell thread. */
+static DEFINE_SPINLOCK(g_doorbell_lock);
+static struct task_struct *g_doorbell_thread;	/* started with a window only */
+static struct semaphore g_doorbell_sema;	/* wakes the doorbell thread */
+static unsigned int g_doorbell_window;
+static unsigned int g_doorbell_ticks;
+static int g_doorbell_hold;
+static int g_doorbell_pending;
+static int g_doorbell_waiting;		/* doorbell thread awaits the window */
+static VCHIQ_DOORBELL_STATS_T g_doorbell_stats;
+
+/* Set by vchiq_set_slot_config(), before vchiq_platform_init() */
+static unsigned int g_slots_per_side = DEFAULT_SLOTS_PER_SIDE;
+static unsigned int g_data_quota;	/* 0 for the default */
 #ifndef __circle__
 static unsigned int g_cache_line_size = sizeof(CACHE_LINE_SIZE);
+static unsigned long g_virt_to_bus_offset;
+#elif RASPPI == 1
+static unsigned int g_cache_line_size = 32;
+#else
+static unsigned int g_cache_line_size = 64;
+#endif
 static unsigned int g_fragments_size;
 static char *g_fragments_base;
 static char *g_free_fragments;
 static struct semaphore g_free_fragments_sema;
-static unsigned long g_virt_to_bus_offset;
-#endif
 
 extern int vchiq_arm_log_level;
 
-#ifndef __circle__
 static DEFINE_SEMAPHORE(g_free_fragments_mutex);
-#endif
 
 static irqreturn_t
 vchiq_doorbell_irq(int irq, void *dev_id);
 
+static int
+doorbell_func(void *v);
+
+static int
+start_doorbell_thread(void);
+
 static int
 create_pagelist(char __user *buf, size_t count, unsigned short type,
                 struct task_struct *task, PAGELIST_T ** ppagelist);
@@ -120,9 +152,9 @@ int vchiq_platform_init(struct platform_device *pdev, VCHIQ_STATE_T *state)
 	u32 channelbase;
 	int slot_mem_size, frag_mem_size;
 	int err, irq;
-#ifndef __circle__
 	int i;
 
+#ifndef __circle__
 	g_virt_to_bus_offset = virt_to_dma(dev, (void *)0);
 
 	err = of_property_read_u32(dev->of_node, "cache-line-size",
@@ -132,17 +164,14 @@ int vchiq_platform_init(struct platform_device *pdev, VCHIQ_STATE_T *state)
 		dev_err(dev, "Missing cache-line-size property\n");
 		return -ENODEV;
 	}
+#endif
 
 	g_fragments_size = 2 * g_cache_line_size;
-#endif
 
 	/* Allocate space for the channels in coherent memory */
-	slot_mem_size = PAGE_ALIGN(TOTAL_SLOTS * VCHIQ_SLOT_SIZE);
-#ifndef __circle__
+	slot_mem_size = PAGE_ALIGN(TOTAL_SLOTS(g_slots_per_side) *
+		VCHIQ_SLOT_SIZE);
 	frag_mem_size = PAGE_ALIGN(g_fragments_size * MAX_FRAGMENTS);
-#else
-	frag_mem_size = 0;
-#endif
 
 	slot_mem = dmam_alloc_coherent(dev, slot_mem_size + frag_mem_size,
 				       &slot_phys, GFP_KERNEL);
@@ -162,7 +191,6 @@ int vchiq_platform_init(struct platform_device *pdev, VCHIQ_STATE_T *state)
 	vchiq_slot_zero->platform_data[VCHIQ_PLATFORM_FRAGMENTS_COUNT_IDX] =
 		MAX_FRAGMENTS;
 
-#ifndef __circle__
 	g_fragments_base = (char *)slot_mem + slot_mem_size;
 	slot_mem_size += frag_mem_size;
 
@@ -173,11 +201,16 @@ int vchiq_platform_init(struct platform_device *pdev, VCHIQ_STATE_T *state)
 	}
 	*(char **)&g_fragments_base[i * g_fragments_size] = NULL;
 	sema_init(&g_free_fragments_sema, MAX_FRAGMENTS);
-#endif
 
 	if (vchiq_init_state(state, vchiq_slot_zero, 0) != VCHIQ_SUCCESS)
 		return -EINVAL;
 
+	if (vchiq_set_data_quota(state, g_data_quota) != VCHIQ_SUCCESS)
+		return -EINVAL;
+
+	if (g_doorbell_window && (start_doorbell_thread() != 0))
+		return -ENOMEM;
+
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	g_regs = devm_ioremap_resource(&pdev->dev, res);
 	if (IS_ERR(g_regs))
@@ -206,8 +239,9 @@ int vchiq_platform_init(struct platform_device *pdev, VCHIQ_STATE_T *state)
 	}
 
 	vchiq_log_info(vchiq_arm_log_level,
-		"vchiq_init - done (slots %x, phys %pad)",
-		(unsigned int)(uintptr_t)vchiq_slot_zero, &slot_phys);
+		"vchiq_init - done (slots %x, phys %pad, %d per side, quota %d)",
+		(unsigned int)(uintptr_t)vchiq_slot_zero, &slot_phys,
+		g_slots_per_side, state->data_quota);
 
 	vchiq_call_connected_callbacks();
 
@@ -238,17 +272,229 @@ vchiq_platform_get_arm_state(VCHIQ_STATE_T *state)
    return &((VCHIQ_2835_ARM_STATE_T*)state->platform_state)->arm_state;
 }
 
+/* Called with g_doorbell_lock held */
+static void
+ring_doorbell(void)
+{
+	writel(0, g_regs + BELL2); /* trigger vc interrupt */
+
+	g_doorbell_ticks = GetClockTicks();
+	g_doorbell_pending = 0;
+	g_doorbell_stats.doorbells++;
+}
+
+/* Called with g_doorbell_lock held */
+static void
+flush_doorbell(int force)
+{
+	if (!g_doorbell_pending || g_doorbell_hold)
+		return;
+
+	if (force || (GetClockTicks() - g_doorbell_ticks >= g_doorbell_window))
+		ring_doorbell();
+}
+
+/* Rings a doorbell deferred by the window, when the window has elapsed, if
+** neither a signal nor an interrupt has done it before. Sleeps until then, so
+** that further messages can be queued within the window. */
+static int
+doorbell_func(void *v)
+{
+	unsigned int elapsed, remaining;
+
+	(void)v;
+
+	while (1) {
+		down(&g_doorbell_sema);
+
+		spin_lock(&g_doorbell_lock);
+		while (g_doorbell_pending && !g_doorbell_hold) {
+			elapsed = GetClockTicks() - g_doorbell_ticks;
+			if (elapsed >= g_doorbell_window)
+				break;
+			remaining = g_doorbell_window - elapsed;
+
+			spin_unlock(&g_doorbell_lock);
+			usleep_range(remaining, remaining);
+			spin_lock(&g_doorbell_lock);
+		}
+		g_doorbell_waiting = 0;
+		flush_doorbell(1);
+		spin_unlock(&g_doorbell_lock);
+	}
+
+	return 0;
+}
+
+/* Called without g_doorbell_lock held, when a window is set */
+static int
+start_doorbell_thread(void)
+{
+	struct task_struct *thread;
+
+	if (g_doorbell_thread)
+		return 0;
+
+	sema_init(&g_doorbell_sema, 0);
+	thread = kthread_create(&doorbell_func, NULL, "VCHIQ doorbell");
+	if (thread == NULL)
+		return -ENOMEM;
+	set_user_nice(thread, -19);
+	wake_up_process(thread);
+
+	g_doorbell_thread = thread;
+
+	return 0;
+}
+
 void
 remote_event_signal(REMOTE_EVENT_T *event)
 {
+	int was_fired;
+
 	wmb();
 
+	spin_lock(&g_doorbell_lock);
+
+	g_doorbell_stats.signals++;
+
+	/* The new data must be visible, before the state of the peer is read */
+	dsb();
+	was_fired = event->fired;
+
 	event->fired = 1;
 
 	dsb();         /* data barrier operation */
 
-	if (event->armed)
-		writel(0, g_regs + BELL2); /* trigger vc interrupt */
+	if (!event->armed) {
+		/* The peer checks 'fired' before it waits */
+	} else if (was_fired && (g_doorbell_hold || g_doorbell_window)) {
+		/* The doorbell for the pending event has been rung already,
+		** the peer reads the new data, when it handles the event. */
+		g_doorbell_stats.coalesced++;
+	} else if (g_doorbell_hold ||
+		(g_doorbell_window &&
+		 (GetClockTicks() - g_doorbell_ticks < g_doorbell_window))) {
+		g_doorbell_pending = 1;
+		g_doorbell_stats.deferred++;
+
+		/* Fallback, if neither a signal nor an interrupt follows */
+		if (!g_doorbell_hold && !g_doorbell_waiting) {
+			g_doorbell_waiting = 1;
+			up(&g_doorbell_sema);
+		}
+	} else
+		ring_doorbell();
+
+	/* A doorbell deferred before is due, when its window has elapsed */
+	flush_doorbell(0);
+
+	spin_unlock(&g_doorbell_lock);
+}
+
+/* Defers the doorbell until vchiq_release_doorbell() is called (nestable),
+** so that a burst of messages triggers one interrupt on the VPU only. */
+void
+vchiq_hold_doorbell(void)
+{
+	spin_lock(&g_doorbell_lock);
+	g_doorbell_hold++;
+	spin_unlock(&g_doorbell_lock);
+}
+
+void
+vchiq_release_doorbell(void)
+{
+	spin_lock(&g_doorbell_lock);
+	BUG_ON(g_doorbell_hold == 0);
+	if (--g_doorbell_hold == 0)
+		flush_doorbell(1);
+	spin_unlock(&g_doorbell_lock);
+}
+
+/* Doorbells within window_us after the last one are deferred (0 to disable,
+** default). A deferred doorbell is rung at the latest, when the window has
+** elapsed and the doorbell thread gets the CPU. The thread is started with
+** the first window (by vchiq_platform_init(), if it is set before) and stays
+** idle, when the window is disabled again. Without it no window is set. */
+void
+vchiq_set_doorbell_window(unsigned int window_us)
+{
+	if (window_us && vchiq_states[0] && (start_doorbell_thread() != 0)) {
+		vchiq_log_error(vchiq_arm_log_level,
+			"could not start the doorbell thread");
+		window_us = 0;
+	}
+
+	spin_lock(&g_doorbell_lock);
+	g_doorbell_window = window_us;
+	flush_doorbell(window_us == 0);
+	spin_unlock(&g_doorbell_lock);
+}
+
+void
+vchiq_get_doorbell_stats(VCHIQ_DOORBELL_STATS_T *stats)
+{
+	spin_lock(&g_doorbell_lock);
+	*stats = g_doorbell_stats;
+	stats->messages = vchiq_states[0] ?
+		(unsigned int)vchiq_states[0]->stats.msg_tx_count : 0;
+	spin_unlock(&g_doorbell_lock);
+}
+
+/* Must be called before the VCHIQ device is initialised. slots_per_side
+** includes the sync slot, the slots of both sides, slot zero and the fragment
+** pool behind them must fit into VCHIQ_MAX_SLOTS slots (the coherent region).
+** At least 4 data slots are needed, so that the default slot quota of a
+** service (half of them) allows a message to start in a new slot, while the
+** previous one has not been released yet. data_quota must be less than
+** slots_per_side - 1. 0 selects the default for both. */
+VCHIQ_STATUS_T
+vchiq_set_slot_config(unsigned int slots_per_side, unsigned int data_quota)
+{
+	if (vchiq_states[0])
+		return VCHIQ_ERROR;
+
+	if (slots_per_side == 0)
+		slots_per_side = DEFAULT_SLOTS_PER_SIDE;
+
+	if ((slots_per_side < 5) ||
+		(slots_per_side > VCHIQ_MAX_SLOTS_PER_SIDE) ||
+		(PAGE_ALIGN(TOTAL_SLOTS(slots_per_side) * VCHIQ_SLOT_SIZE) +
+		 PAGE_ALIGN(2 * g_cache_line_size * MAX_FRAGMENTS) >
+		 VCHIQ_MAX_SLOTS * VCHIQ_SLOT_SIZE) ||
+		(data_quota >= slots_per_side - 1))
+		return VCHIQ_ERROR;
+
+	g_slots_per_side = slots_per_side;
+	g_data_quota = data_quota;
+
+	return VCHIQ_SUCCESS;
+}
+
+/* Returns the size of the coherent memory used for the configured slots and
+** the fragment pool, see vchiq_platform_init(). */
+unsigned int
+vchiq_get_slot_mem_size(void)
+{
+	return PAGE_ALIGN(TOTAL_SLOTS(g_slots_per_side) * VCHIQ_SLOT_SIZE) +
+		PAGE_ALIGN(2 * g_cache_line_size * MAX_FRAGMENTS);
+}
+
+void
+vchiq_get_slot_stats(VCHIQ_SLOT_STATS_T *stats)
+{
+	VCHIQ_STATE_T *state = vchiq_states[0];
+
+	memset(stats, 0, sizeof(*stats));
+	stats->slots_per_side = g_slots_per_side;
+
+	if (state) {
+		stats->data_quota = state->data_quota;
+		stats->slot_stalls = state->stats.slot_stalls;
+		stats->data_stalls = state->stats.data_stalls;
+		stats->quota_stalls = state->stats.quota_stalls;
+	}
 }
 
 int
@@ -384,6 +630,11 @@ vchiq_doorbell_irq(int irq, void *dev_id)
 		ret = IRQ_HANDLED;
 	}
 
+	/* Deliver a deferred doorbell, if the window has elapsed */
+	spin_lock(&g_doorbell_lock);
+	flush_doorbell(0);
+	spin_unlock(&g_doorbell_lock);
+
 	return ret;
 }
 
@@ -407,6 +658,8 @@ vchiq_doorbell_irq(int irq, void *dev_id)
 struct page {};
 #define vmalloc_to_page(p)	((struct page *) ((uintptr_t) (p) & ~(PAGE_SIZE - 1)))
 #define page_address(pg)	((void *) (pg))
+#define kmap(pg)		page_address(pg)
+#define kunmap(pg)		((void) (pg))
 #endif
 
 static int
@@ -530,7 +783,6 @@ create_pagelist(char __user *buf, size_t count, unsigned short type,
 	addrs[addridx] = (unsigned int)(uintptr_t)base_addr + run;
 	addridx++;
 
-#ifndef __circle__
 	/* Partial cache lines (fragments) require special measures */
 	if ((type == PAGELIST_READ) &&
 		((pagelist->offset & (g_cache_line_size - 1)) ||
@@ -554,6 +806,7 @@ create_pagelist(char __user *buf, size_t count, unsigned short type,
 			(fragments - g_fragments_base) / g_fragments_size;
 	}
 
+#ifndef __circle__
 	dmac_flush_range(pagelist, addrs + num_pages);
 #else
 	linuxemu_CleanAndInvalidateDataCacheRange ((uintptr_t) pagelist,
@@ -570,21 +823,32 @@ free_pagelist(PAGELIST_T *pagelist, int actual)
 {
 #ifndef __circle__
         unsigned long *need_release;
-	struct page **pages;
-	unsigned int num_pages, i;
+	unsigned int i;
 #endif
+	struct page **pages;
+	unsigned int num_pages;
 
 	vchiq_log_trace(vchiq_arm_log_level,
 		"free_pagelist - %x, %d", (unsigned int)(uintptr_t)pagelist, actual);
 
-#ifndef __circle__
 	num_pages =
 		(pagelist->length + pagelist->offset + PAGE_SIZE - 1) /
 		PAGE_SIZE;
 
+#ifndef __circle__
         need_release = (unsigned long *)(pagelist->addrs + num_pages);
+#endif
 	pages = (struct page **)(pagelist->addrs + num_pages + 1);
 
+#ifdef __circle__
+	/* Discard the lines of the buffer, which may have been fetched
+	** speculatively, while the VPU was writing it */
+	if ((pagelist->type != PAGELIST_WRITE) && (actual > 0))
+		linuxemu_CleanAndInvalidateDataCacheRange (
+			(uintptr_t) page_address(pages[0]) + pagelist->offset,
+			actual);
+#endif
+
 	/* Deal with any partial cache lines (fragments) */
 	if (pagelist->type >= PAGELIST_READ_WITH_FRAGMENTS) {
 		char *fragments = g_fragments_base +
@@ -608,12 +872,17 @@ free_pagelist(PAGELIST_T *pagelist, int actual)
 		}
 		if ((actual >= 0) && (head_bytes < actual) &&
 			(tail_bytes != 0)) {
-			memcpy((char *)kmap(pages[num_pages - 1]) +
+			/* The page of the end of the transfer, which is not
+			** the last page, if less than length was received */
+			struct page *pg =
+				pages[(pagelist->offset + actual) / PAGE_SIZE];
+
+			memcpy((char *)kmap(pg) +
 				((pagelist->offset + actual) &
 				(PAGE_SIZE - 1) & ~(g_cache_line_size - 1)),
 				fragments + g_cache_line_size,
 				tail_bytes);
-			kunmap(pages[num_pages - 1]);
+			kunmap(pg);
 		}
 
 		down(&g_free_fragments_mutex);
@@ -623,6 +892,7 @@ free_pagelist(PAGELIST_T *pagelist, int actual)
 		up(&g_free_fragments_sema);
 	}
 
+#ifndef __circle__
 	if (*need_release) {
 		unsigned int length = pagelist->length;
 		unsigned int offset = pagelist->offset;
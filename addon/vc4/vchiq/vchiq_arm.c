@@ -1397,7 +1397,7 @@ vchiq_dump_platform_instances(void *dump_context)
 		marking those that have been dumped. */
 
 	for (i = 0; i < state->unused_service; i++) {
-		VCHIQ_SERVICE_T *service = state->services[i];
+		VCHIQ_SERVICE_T *service = port_to_service(state, i);
 		VCHIQ_INSTANCE_T instance;
 
 		if (service && (service->base.callback == service_callback)) {
@@ -1408,7 +1408,7 @@ vchiq_dump_platform_instances(void *dump_context)
 	}
 
 	for (i = 0; i < state->unused_service; i++) {
-		VCHIQ_SERVICE_T *service = state->services[i];
+		VCHIQ_SERVICE_T *service = port_to_service(state, i);
 		VCHIQ_INSTANCE_T instance;
 
 		if (service && (service->base.callback == service_callback)) {
@@ -2074,7 +2074,7 @@ output_timeout_error(VCHIQ_STATE_T *state)
 		goto output_msg;
 	}
 	for (i = 0; i < active_services; i++) {
-		VCHIQ_SERVICE_T *service_ptr = state->services[i];
+		VCHIQ_SERVICE_T *service_ptr = port_to_service(state, i);
 		if (service_ptr && service_ptr->service_use_count &&
 			(service_ptr->srvstate != VCHIQ_SRVSTATE_FREE)) {
 			snprintf(service_err, 50, " %c%c%c%c(%d) service has "
@@ -2711,7 +2711,7 @@ vchiq_dump_service_use_state(VCHIQ_STATE_T *state)
 		only_nonzero = 1;
 
 	for (i = 0; (i < active_services) && (j < local_max_services); i++) {
-		VCHIQ_SERVICE_T *service_ptr = state->services[i];
+		VCHIQ_SERVICE_T *service_ptr = port_to_service(state, i);
 		if (!service_ptr)
 			continue;
 
@@ -33,6 +33,10 @@
 
 #include "vchiq_core.h"
 #include "vchiq_killable.h"
+#include <linux/errno.h>
+#ifdef __circle__
+#include <linux/env.h>
+#endif
 
 #define VCHIQ_SLOT_HANDLER_STACK 8192
 
@@ -59,6 +63,10 @@
 	#define min(a, b)	((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef max
+	#define max(a, b)	((a) > (b) ? (a) : (b))
+#endif
+
 struct vchiq_open_payload {
 	int fourcc;
 	int client_id;
@@ -74,7 +82,10 @@ enum
 {
 	QMFLAGS_IS_BLOCKING     = (1 << 0),
 	QMFLAGS_NO_MUTEX_LOCK   = (1 << 1),
-	QMFLAGS_NO_MUTEX_UNLOCK = (1 << 2)
+	QMFLAGS_NO_MUTEX_UNLOCK = (1 << 2),
+	/* slot_mutex is held and is kept on success, tx_pos is not published
+	** and the peer is not signalled (see queue_message_batch) */
+	QMFLAGS_BATCH           = (1 << 3)
 };
 
 /* we require this for consistency between endpoints */
@@ -99,6 +110,10 @@ DEFINE_SPINLOCK(quota_spinlock);
 VCHIQ_STATE_T *vchiq_states[VCHIQ_MAX_STATES];
 static unsigned int handle_seq;
 
+static VCHIQ_SLOT_HANDLER_MODE_T slot_handler_mode =
+	VCHIQ_SLOT_HANDLER_INTERRUPT;
+static unsigned int slot_handler_spin_us;
+
 static const char *const srvstate_names[] = {
 	"FREE",
 	"HIDDEN",
@@ -170,6 +185,71 @@ vchiq_set_service_state(VCHIQ_SERVICE_T *service, int newstate)
 	service->srvstate = newstate;
 }
 
+static inline unsigned int
+fourcc_hash(int fourcc)
+{
+	unsigned int hash = (unsigned int)fourcc;
+	hash ^= hash >> 16;
+	hash ^= hash >> 8;
+	return hash & (VCHIQ_SERVICE_HASH_SIZE - 1);
+}
+
+static inline unsigned int
+remoteport_hash(unsigned int port)
+{
+	return port & (VCHIQ_SERVICE_HASH_SIZE - 1);
+}
+
+/* Called with service_spinlock held */
+static void
+unlink_service_remoteport(VCHIQ_SERVICE_T *service)
+{
+	VCHIQ_SERVICE_T **link;
+
+	if (service->remoteport == VCHIQ_PORT_FREE)
+		return;
+
+	link = &service->state->remoteport_hash[
+		remoteport_hash(service->remoteport)];
+	while (*link && (*link != service))
+		link = &(*link)->remoteport_next;
+	if (*link)
+		*link = service->remoteport_next;
+	service->remoteport_next = NULL;
+}
+
+/* Sets the remote port and keeps the remote port table up to date */
+static void
+set_service_remoteport(VCHIQ_SERVICE_T *service, unsigned int port)
+{
+	spin_lock(&service_spinlock);
+	unlink_service_remoteport(service);
+	service->remoteport = port;
+	if (port != VCHIQ_PORT_FREE) {
+		VCHIQ_SERVICE_T **head =
+			&service->state->remoteport_hash[remoteport_hash(port)];
+		service->remoteport_next = *head;
+		*head = service;
+	}
+	spin_unlock(&service_spinlock);
+}
+
+/* Called with service_spinlock held, when the service leaves the table */
+static void
+unlink_service(VCHIQ_SERVICE_T *service)
+{
+	VCHIQ_SERVICE_T **link;
+
+	unlink_service_remoteport(service);
+
+	link = &service->state->fourcc_hash[fourcc_hash(service->base.fourcc)];
+	while (*link && (*link != service))
+		link = &(*link)->fourcc_next;
+	if (*link)
+		*link = service->fourcc_next;
+	service->fourcc_next = NULL;
+}
+
 VCHIQ_SERVICE_T *
 find_service_by_handle(VCHIQ_SERVICE_HANDLE_T handle)
 {
@@ -198,7 +278,7 @@ find_service_by_port(VCHIQ_STATE_T *state, int localport)
 	VCHIQ_SERVICE_T *service = NULL;
 	if ((unsigned int)localport <= VCHIQ_PORT_MAX) {
 		spin_lock(&service_spinlock);
-		service = state->services[localport];
+		service = port_to_service(state, localport);
 		if (service && (service->srvstate != VCHIQ_SRVSTATE_FREE)) {
 			BUG_ON(service->ref_count == 0);
 			service->ref_count++;
@@ -271,7 +351,7 @@ next_service_by_instance(VCHIQ_STATE_T *state, VCHIQ_INSTANCE_T instance,
 
 	spin_lock(&service_spinlock);
 	while (idx < state->unused_service) {
-		VCHIQ_SERVICE_T *srv = state->services[idx++];
+		VCHIQ_SERVICE_T *srv = port_to_service(state, idx++);
 		if (srv && (srv->srvstate != VCHIQ_SRVSTATE_FREE) &&
 			(srv->instance == instance)) {
 			service = srv;
@@ -307,7 +387,10 @@ unlock_service(VCHIQ_SERVICE_T *service)
 		service->ref_count--;
 		if (!service->ref_count) {
 			BUG_ON(service->srvstate != VCHIQ_SRVSTATE_FREE);
-			state->services[service->localport] = NULL;
+			port_to_group(state, service->localport)->services[
+				service->localport & VCHIQ_SERVICE_GROUP_MASK] =
+				NULL;
+			unlink_service(service);
 		} else
 			service = NULL;
 	}
@@ -369,7 +452,7 @@ mark_service_closing_internal(VCHIQ_SERVICE_T *service, int sh_thread)
 	}
 
 	/* Unblock any sending thread. */
-	service_quota = &state->service_quotas[service->localport];
+	service_quota = port_to_quota(state, service->localport);
 	up(&service_quota->quota_event);
 }
 
@@ -486,39 +569,49 @@ calc_stride(unsigned int size)
 static VCHIQ_SERVICE_T *
 get_listening_service(VCHIQ_STATE_T *state, int fourcc)
 {
-	int i;
+	VCHIQ_SERVICE_T *found = NULL;
+	VCHIQ_SERVICE_T *service;
 
 	WARN_ON(fourcc == VCHIQ_FOURCC_INVALID);
 
-	for (i = 0; i < state->unused_service; i++) {
-		VCHIQ_SERVICE_T *service = state->services[i];
-		if (service &&
-			(service->public_fourcc == fourcc) &&
+	spin_lock(&service_spinlock);
+	/* Prefer the lowest port, as the former linear search did */
+	for (service = state->fourcc_hash[fourcc_hash(fourcc)]; service;
+		service = service->fourcc_next) {
+		if ((service->public_fourcc == fourcc) &&
 			((service->srvstate == VCHIQ_SRVSTATE_LISTENING) ||
 			((service->srvstate == VCHIQ_SRVSTATE_OPEN) &&
-			(service->remoteport == VCHIQ_PORT_FREE)))) {
-			lock_service(service);
-			return service;
-		}
+			(service->remoteport == VCHIQ_PORT_FREE))) &&
+			(!found || (service->localport < found->localport)))
+			found = service;
 	}
+	if (found)
+		found->ref_count++;
+	spin_unlock(&service_spinlock);
 
-	return NULL;
+	return found;
 }
 
 /* Called by the slot handler thread */
 static VCHIQ_SERVICE_T *
 get_connected_service(VCHIQ_STATE_T *state, unsigned int port)
 {
-	int i;
-	for (i = 0; i < state->unused_service; i++) {
-		VCHIQ_SERVICE_T *service = state->services[i];
-		if (service && (service->srvstate == VCHIQ_SRVSTATE_OPEN)
-			&& (service->remoteport == port)) {
-			lock_service(service);
-			return service;
-		}
+	VCHIQ_SERVICE_T *found = NULL;
+	VCHIQ_SERVICE_T *service;
+
+	spin_lock(&service_spinlock);
+	for (service = state->remoteport_hash[remoteport_hash(port)]; service;
+		service = service->remoteport_next) {
+		if ((service->srvstate == VCHIQ_SRVSTATE_OPEN) &&
+			(service->remoteport == port) &&
+			(!found || (service->localport < found->localport)))
+			found = service;
 	}
-	return NULL;
+	if (found)
+		found->ref_count++;
+	spin_unlock(&service_spinlock);
+
+	return found;
 }
 
 inline void
@@ -527,17 +620,19 @@ request_poll(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service, int poll_type)
 	uint32_t value;
 
 	if (service) {
+		atomic_t *poll_services =
+			&port_to_group(state, service->localport)->
+				poll_services;
+
 		do {
 			value = atomic_read(&service->poll_flags);
 		} while (atomic_cmpxchg(&service->poll_flags, value,
 			value | (1 << poll_type)) != value);
 
 		do {
-			value = atomic_read(&state->poll_services[
-				service->localport>>5]);
-		} while (atomic_cmpxchg(
-			&state->poll_services[service->localport>>5],
-			value, value | (1 << (service->localport & 0x1f)))
+			value = atomic_read(poll_services);
+		} while (atomic_cmpxchg(poll_services, value, value |
+			(1 << (service->localport & VCHIQ_SERVICE_GROUP_MASK)))
 			!= value);
 	}
 
@@ -649,8 +744,10 @@ process_free_queue(VCHIQ_STATE_T *state)
 			if (VCHIQ_MSG_TYPE(msgid) == VCHIQ_MSG_DATA) {
 				int port = VCHIQ_MSG_SRCPORT(msgid);
 				VCHIQ_SERVICE_QUOTA_T *service_quota =
-					&state->service_quotas[port];
+					port_to_quota(state, port);
 				int count;
+				/* The port was used to send this message */
+				BUG_ON(!service_quota);
 				spin_lock(&quota_spinlock);
 				count = service_quota->message_use_count;
 				if (count > 0)
@@ -736,15 +833,18 @@ process_free_queue(VCHIQ_STATE_T *state)
 		}
 
 		if (data_found) {
-			int count;
+			int count, prio;
 			spin_lock(&quota_spinlock);
 			count = state->data_use_count;
 			if (count > 0)
 				state->data_use_count =
 					count - 1;
 			spin_unlock(&quota_spinlock);
-			if (count == state->data_quota)
-				up(&state->data_quota_event);
+			/* Wake the classes, which have just dropped below
+			** their limit */
+			for (prio = 0; prio < VCHIQ_PRIORITY_COUNT; prio++)
+				if (count == state->data_class_limit[prio])
+					up(&state->data_quota_event[prio]);
 		}
 
 		mb();
@@ -754,16 +854,100 @@ process_free_queue(VCHIQ_STATE_T *state)
 	}
 }
 
-/* Called by the slot handler and application threads */
+/* Calls copy_callback until size bytes have been written to dest.
+** Returns size on success, or a negative value on failure. */
+static int
+copy_message_data(VCHIQ_COPY_CALLBACK_T copy_callback, void *context,
+	char *dest, unsigned int size)
+{
+	unsigned int pos = 0;
+
+	while (pos < size) {
+		int callback_result;
+		unsigned int max_bytes = size - pos;
+
+		callback_result = copy_callback(context, dest + pos, pos,
+			max_bytes);
+
+		if (callback_result < 0)
+			return callback_result;
+
+		if ((callback_result == 0) ||
+			((unsigned int)callback_result > max_bytes))
+			return -EIO;
+
+		pos += callback_result;
+	}
+
+	return size;
+}
+
+struct vchiq_element_context {
+	const VCHIQ_ELEMENT_T *elements;
+	int count;
+	int index;
+	unsigned int index_offset;
+};
+
+/* Copy callback which gathers the data of an element array */
+static int
+element_copy_callback(void *context, void *dest, unsigned int offset,
+	unsigned int maxsize)
+{
+	struct vchiq_element_context *ctx = context;
+	const VCHIQ_ELEMENT_T *element;
+	unsigned int copy_size;
+
+	(void)offset;
+
+	while ((ctx->index < ctx->count) &&
+		(ctx->index_offset == ctx->elements[ctx->index].size)) {
+		ctx->index++;
+		ctx->index_offset = 0;
+	}
+
+	if (ctx->index == ctx->count)
+		return 0;
+
+	element = &ctx->elements[ctx->index];
+	copy_size = min(element->size - ctx->index_offset, maxsize);
+	if (vchiq_copy_from_user(dest,
+		(const char *)element->data + ctx->index_offset,
+		copy_size) != VCHIQ_SUCCESS)
+		return -EFAULT;
+
+	ctx->index_offset += copy_size;
+
+	return copy_size;
+}
+
+/* Called with slot_mutex held. Publishes the messages of a batch, which have
+** been written so far, before the mutex is released to wait or on failure. */
+static void
+flush_tx_pos(VCHIQ_STATE_T *state)
+{
+	VCHIQ_SHARED_STATE_T *local = state->local;
+
+	if (local->tx_pos != state->local_tx_pos) {
+		wmb();
+		local->tx_pos = state->local_tx_pos;
+		remote_event_signal(&state->remote->trigger);
+	}
+}
+
+/* Called by the slot handler and application threads.
+** The message data is produced by copy_callback directly into the slot,
+** while slot_mutex is held. */
 static VCHIQ_STATUS_T
-queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
-	int msgid, const VCHIQ_ELEMENT_T *elements,
-	int count, int size, int flags)
+queue_message_callback(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
+	int msgid, VCHIQ_COPY_CALLBACK_T copy_callback, void *context,
+	int size, int flags)
 {
 	VCHIQ_SHARED_STATE_T *local;
 	VCHIQ_SERVICE_QUOTA_T *service_quota = NULL;
 	VCHIQ_HEADER_T *header;
 	int type = VCHIQ_MSG_TYPE(msgid);
+	int prio;
 
 	unsigned int stride;
 
@@ -773,7 +957,7 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 
 	WARN_ON(!(stride <= VCHIQ_SLOT_SIZE));
 
-	if (!(flags & QMFLAGS_NO_MUTEX_LOCK) &&
+	if (!(flags & (QMFLAGS_NO_MUTEX_LOCK | QMFLAGS_BATCH)) &&
 		(mutex_lock_interruptible(&state->slot_mutex) != 0))
 		return VCHIQ_RETRY;
 
@@ -786,11 +970,12 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 
 		if (service->closing) {
 			/* The service has been closed */
+			flush_tx_pos(state);
 			mutex_unlock(&state->slot_mutex);
 			return VCHIQ_ERROR;
 		}
 
-		service_quota = &state->service_quotas[service->localport];
+		service_quota = port_to_quota(state, service->localport);
 
 		spin_lock(&quota_spinlock);
 
@@ -800,14 +985,20 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 			state->local_tx_pos + stride - 1);
 
 		/* Ensure data messages don't use more than their quota of
-		** slots */
+		** slots. The lower priority classes stall earlier, so that
+		** the last data slots remain for the higher ones. */
+		prio = service->priority;
 		while ((tx_end_index != state->previous_data_index) &&
-			(state->data_use_count == state->data_quota)) {
+			(state->data_use_count >=
+				state->data_class_limit[prio])) {
 			VCHIQ_STATS_INC(state, data_stalls);
+			VCHIQ_STATS_INC(state, class_stalls[prio]);
+			VCHIQ_SERVICE_STATS_INC(service, data_stalls);
 			spin_unlock(&quota_spinlock);
+			flush_tx_pos(state);
 			mutex_unlock(&state->slot_mutex);
 
-			if (down_interruptible(&state->data_quota_event)
+			if (down_interruptible(&state->data_quota_event[prio])
 				!= 0)
 				return VCHIQ_RETRY;
 
@@ -816,9 +1007,10 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 			tx_end_index = SLOT_QUEUE_INDEX_FROM_POS(
 				state->local_tx_pos + stride - 1);
 			if ((tx_end_index == state->previous_data_index) ||
-				(state->data_use_count < state->data_quota)) {
+				(state->data_use_count <
+					state->data_class_limit[prio])) {
 				/* Pass the signal on to other waiters */
-				up(&state->data_quota_event);
+				up(&state->data_quota_event[prio]);
 				break;
 			}
 		}
@@ -836,7 +1028,9 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 				msg_type_str(type), size,
 				service_quota->message_use_count,
 				service_quota->slot_use_count);
+			VCHIQ_STATS_INC(state, quota_stalls);
 			VCHIQ_SERVICE_STATS_INC(service, quota_stalls);
+			flush_tx_pos(state);
 			mutex_unlock(&state->slot_mutex);
 			if (down_interruptible(&service_quota->quota_event)
 				!= 0)
@@ -864,14 +1058,15 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 		if (service)
 			VCHIQ_SERVICE_STATS_INC(service, slot_stalls);
 		/* In the event of a failure, return the mutex to the
-		   state it was in */
-		if (!(flags & QMFLAGS_NO_MUTEX_LOCK))
+		   state it was in (released in a batch) */
+		if (!(flags & QMFLAGS_NO_MUTEX_LOCK)) {
+			flush_tx_pos(state);
 			mutex_unlock(&state->slot_mutex);
+		}
 		return VCHIQ_RETRY;
 	}
 
 	if (type == VCHIQ_MSG_DATA) {
-		int i, pos;
 		int tx_end_index;
 		int slot_use_count;
 
@@ -887,25 +1082,25 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 		BUG_ON((flags & (QMFLAGS_NO_MUTEX_LOCK |
 				 QMFLAGS_NO_MUTEX_UNLOCK)) != 0);
 
-		for (i = 0, pos = 0; i < (unsigned int)count;
-			pos += elements[i++].size)
-			if (elements[i].size) {
-				if (vchiq_copy_from_user
-					(header->data + pos, elements[i].data,
-					(size_t) elements[i].size) !=
-					VCHIQ_SUCCESS) {
-					mutex_unlock(&state->slot_mutex);
-					VCHIQ_SERVICE_STATS_INC(service,
-						error_count);
-					return VCHIQ_ERROR;
-				}
-			}
+		if ((size != 0) &&
+			(copy_message_data(copy_callback, context,
+				header->data, size) < 0)) {
+			/* The space has already been reserved, so turn it
+			** into padding */
+			header->msgid = VCHIQ_MSGID_PADDING;
+			header->size = stride - sizeof(VCHIQ_HEADER_T);
+			/* publish the messages of the batch before it too */
+			flush_tx_pos(state);
+			mutex_unlock(&state->slot_mutex);
+			VCHIQ_SERVICE_STATS_INC(service, error_count);
+			return VCHIQ_ERROR;
+		}
 
 		if (SRVTRACE_ENABLED(service,
 				VCHIQ_LOG_INFO))
 			vchiq_log_dump_mem("Sent", 0,
 				header->data,
-				min(16, pos));
+				min(16, size));
 
 		spin_lock(&quota_spinlock);
 		service_quota->message_use_count++;
@@ -947,17 +1142,17 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 			(unsigned int)(uintptr_t)header, size,
 			VCHIQ_MSG_SRCPORT(msgid),
 			VCHIQ_MSG_DSTPORT(msgid));
-		if (size != 0) {
-			WARN_ON(!((count == 1) && (size == elements[0].size)));
-			memcpy(header->data, elements[0].data,
-				elements[0].size);
-		}
+		if (size != 0)
+			WARN_ON(copy_message_data(copy_callback, context,
+				header->data, size) < 0);
 		VCHIQ_STATS_INC(state, ctrl_tx_count);
 	}
 
 	header->msgid = msgid;
 	header->size = size;
 
+	VCHIQ_STATS_INC(state, msg_tx_count);
+
 	{
 		int svc_fourcc;
 
@@ -975,6 +1170,10 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 			size);
 	}
 
+	/* The batch is published, when the last message has been written */
+	if (flags & QMFLAGS_BATCH)
+		return VCHIQ_SUCCESS;
+
 	/* Make sure the new header is visible to the peer. */
 	wmb();
 
@@ -993,6 +1192,73 @@ queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
 	return VCHIQ_SUCCESS;
 }
 
+/* Called by the slot handler and application threads */
+static VCHIQ_STATUS_T
+queue_message(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
+	int msgid, const VCHIQ_ELEMENT_T *elements,
+	int count, int size, int flags)
+{
+	struct vchiq_element_context context = { elements, count, 0, 0 };
+
+	return queue_message_callback(state, service, msgid,
+		element_copy_callback, &context, size, flags);
+}
+
+/* Called by the slot handler and application threads.
+** Queues several data messages of a service with one acquisition of
+** slot_mutex, publishes tx_pos once and signals the peer once. On failure
+** the messages before the failed one have been queued. */
+static VCHIQ_STATUS_T
+queue_message_batch(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
+	int msgid, const VCHIQ_MESSAGE_T *messages, unsigned int count,
+	unsigned int *queued)
+{
+	VCHIQ_SHARED_STATE_T *local = state->local;
+	VCHIQ_STATUS_T status = VCHIQ_SUCCESS;
+	unsigned int i;
+
+	*queued = 0;
+
+	if (mutex_lock_interruptible(&state->slot_mutex) != 0)
+		return VCHIQ_RETRY;
+
+	for (i = 0; i < count; i++) {
+		const VCHIQ_MESSAGE_T *message = &messages[i];
+		VCHIQ_ELEMENT_T element = { message->data, message->size };
+		struct vchiq_element_context context = { &element, 1, 0, 0 };
+
+		if (message->copy_callback)
+			status = queue_message_callback(state, service, msgid,
+				message->copy_callback, message->context,
+				message->size,
+				QMFLAGS_IS_BLOCKING | QMFLAGS_BATCH);
+		else
+			status = queue_message_callback(state, service, msgid,
+				element_copy_callback, &context,
+				message->size,
+				QMFLAGS_IS_BLOCKING | QMFLAGS_BATCH);
+
+		/* slot_mutex has been released on failure */
+		if (status != VCHIQ_SUCCESS)
+			return status;
+
+		(*queued)++;
+	}
+
+	/* Make sure the new headers are visible to the peer. */
+	wmb();
+
+	/* Make the new tx_pos visible to the peer. */
+	local->tx_pos = state->local_tx_pos;
+	wmb();
+
+	mutex_unlock(&state->slot_mutex);
+
+	remote_event_signal(&state->remote->trigger);
+
+	return VCHIQ_SUCCESS;
+}
+
 /* Called by the slot handler and application threads */
 static VCHIQ_STATUS_T
 queue_message_sync(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service,
@@ -1267,14 +1533,20 @@ poll_services(VCHIQ_STATE_T *state)
 {
 	int group, i;
 
-	for (group = 0; group < BITSET_SIZE(state->unused_service); group++) {
+	for (group = 0;
+		(group << VCHIQ_SERVICE_GROUP_SHIFT) < state->unused_service;
+		group++) {
 		uint32_t flags;
-		flags = atomic_xchg(&state->poll_services[group], 0);
+		if (!state->service_groups[group])
+			continue;
+		flags = atomic_xchg(
+			&state->service_groups[group]->poll_services, 0);
 		for (i = 0; flags; i++) {
 			if (flags & (1 << i)) {
 				VCHIQ_SERVICE_T *service =
 					find_service_by_port(state,
-						(group<<5) + i);
+					(group << VCHIQ_SERVICE_GROUP_SHIFT) +
+					i);
 				uint32_t service_flags;
 				flags &= ~(1 << i);
 				if (!service)
@@ -1476,7 +1748,7 @@ resume_bulks(VCHIQ_STATE_T *state)
 		__func__, state->deferred_bulks);
 
 	for (i = 0; i < state->unused_service; i++) {
-		VCHIQ_SERVICE_T *service = state->services[i];
+		VCHIQ_SERVICE_T *service = port_to_service(state, i);
 		int resolved_rx = 0;
 		int resolved_tx = 0;
 		if (!service || (service->srvstate != VCHIQ_SRVSTATE_OPEN))
@@ -1585,12 +1857,13 @@ parse_open(VCHIQ_STATE_T *state, VCHIQ_HEADER_T *header)
 					: VCHIQ_SRVSTATE_OPEN);
 			}
 
-			service->remoteport = remoteport;
+			set_service_remoteport(service, remoteport);
 			service->client_id = ((int *)header->data)[1];
 			if (make_service_callback(service, VCHIQ_SERVICE_OPENED,
 				NULL, NULL) == VCHIQ_RETRY) {
 				/* Bail out if not ready */
-				service->remoteport = VCHIQ_PORT_FREE;
+				set_service_remoteport(service,
+					VCHIQ_PORT_FREE);
 				goto bail_not_ready;
 			}
 
@@ -1755,7 +2028,7 @@ parse_rx_slots(VCHIQ_STATE_T *state)
 				remoteport, localport, service->peer_version);
 			if (service->srvstate ==
 				VCHIQ_SRVSTATE_OPENING) {
-				service->remoteport = remoteport;
+				set_service_remoteport(service, remoteport);
 				vchiq_set_service_state(service,
 					VCHIQ_SRVSTATE_OPEN);
 				up(&service->remove_event);
@@ -2035,6 +2308,51 @@ bail_not_ready:
 		unlock_service(service);
 }
 
+/* Called by the slot handler thread. Returns, when the trigger event has been
+** signalled, or when new messages have been found by polling. The event stays
+** disarmed while polling, so the peer does not ring the doorbell. */
+static void
+slot_handler_wait(VCHIQ_STATE_T *state)
+{
+	VCHIQ_SHARED_STATE_T *local = state->local;
+#ifdef __circle__
+	VCHIQ_SLOT_HANDLER_MODE_T mode = slot_handler_mode;
+	struct semaphore *event =
+		(struct semaphore *)(uintptr_t)local->trigger.event;
+	unsigned int start = GetClockTicks();
+
+	while (mode != VCHIQ_SLOT_HANDLER_INTERRUPT) {
+		if (local->trigger.fired)
+			break;
+
+		/* Messages, which could not be handled at the last pass,
+		** are retried on the next event as before. */
+		if (state->remote->tx_pos != state->poll_tx_pos) {
+			state->poll_tx_pos = state->remote->tx_pos;
+			VCHIQ_STATS_INC(state, poll_wakeups);
+			return;
+		}
+
+		/* Signalled locally by request_poll() */
+		if (down_trylock(event) == 0) {
+			up(event);
+			break;
+		}
+
+		if (mode == VCHIQ_SLOT_HANDLER_POLLED)
+			SchedulerYield();
+		else if (GetClockTicks() - start >= slot_handler_spin_us)
+			break;
+
+		rmb();
+	}
+#endif
+
+	remote_event_wait(&local->trigger);
+	state->poll_tx_pos = state->remote->tx_pos;
+	VCHIQ_STATS_INC(state, event_wakeups);
+}
+
 /* Called by the slot handler thread */
 static int
 slot_handler_func(void *v)
@@ -2046,7 +2364,7 @@ slot_handler_func(void *v)
 	while (1) {
 		DEBUG_COUNT(SLOT_HANDLER_COUNT);
 		DEBUG_TRACE(SLOT_HANDLER_LINE);
-		remote_event_wait(&local->trigger);
+		slot_handler_wait(state);
 
 		rmb();
 
@@ -2210,7 +2528,7 @@ sync_func(void *v)
 				state->id, (unsigned int)(uintptr_t)header, size,
 				remoteport, localport, service->peer_version);
 			if (service->srvstate == VCHIQ_SRVSTATE_OPENING) {
-				service->remoteport = remoteport;
+				set_service_remoteport(service, remoteport);
 				vchiq_set_service_state(service,
 					VCHIQ_SRVSTATE_OPENSYNC);
 				service->sync = 1;
@@ -2311,6 +2629,39 @@ vchiq_init_slots(void *mem_base, int mem_size)
 	return slot_zero;
 }
 
+/* Derive the data_use_count limits of the priority classes from data_quota.
+** Each class below realtime leaves a reserve of slots to the classes above
+** it, but every class may use at least one data slot. */
+static void
+set_data_class_limits(VCHIQ_STATE_T *state)
+{
+	int reserve = max(state->data_quota / 8, 1);
+	int prio;
+
+	for (prio = 0; prio < VCHIQ_PRIORITY_COUNT; prio++) {
+		int limit = state->data_quota - prio * reserve;
+		state->data_class_limit[prio] = max(limit, 1);
+	}
+}
+
+/* Limit the number of slots occupied by data messages (0 for the default,
+** all local data slots but one). Called after vchiq_init_state. */
+VCHIQ_STATUS_T
+vchiq_set_data_quota(VCHIQ_STATE_T *state, int data_quota)
+{
+	int max_quota = state->local->slot_last - state->local->slot_first;
+
+	if (data_quota == 0)
+		data_quota = max_quota;
+	else if ((data_quota < 1) || (data_quota > max_quota))
+		return VCHIQ_ERROR;
+
+	state->data_quota = data_quota;
+	set_data_class_limits(state);
+
+	return VCHIQ_SUCCESS;
+}
+
 VCHIQ_STATUS_T
 vchiq_init_state(VCHIQ_STATE_T *state, VCHIQ_SLOT_ZERO_T *slot_zero,
 		 int is_master)
@@ -2446,16 +2797,11 @@ vchiq_init_state(VCHIQ_STATE_T *state, VCHIQ_SLOT_ZERO_T *slot_zero,
 
 	sema_init(&state->slot_available_event, 0);
 	sema_init(&state->slot_remove_event, 0);
-	sema_init(&state->data_quota_event, 0);
+	for (i = 0; i < VCHIQ_PRIORITY_COUNT; i++)
+		sema_init(&state->data_quota_event[i], 0);
 
 	state->slot_queue_available = 0;
 
-	for (i = 0; i < VCHIQ_MAX_SERVICES; i++) {
-		VCHIQ_SERVICE_QUOTA_T *service_quota =
-			&state->service_quotas[i];
-		sema_init(&service_quota->quota_event, 0);
-	}
-
 	for (i = local->slot_first; i <= local->slot_last; i++) {
 		local->slot_queue[state->slot_queue_available++] = i;
 		up(&state->slot_available_event);
@@ -2469,6 +2815,7 @@ vchiq_init_state(VCHIQ_STATE_T *state, VCHIQ_SLOT_ZERO_T *slot_zero,
 	state->previous_data_index = -1;
 	state->data_use_count = 0;
 	state->data_quota = state->slot_queue_available - 1;
+	set_data_class_limits(state);
 
 #if AARCH == 32
 	local->trigger.event = &state->trigger_event;
@@ -2561,6 +2908,34 @@ vchiq_init_state(VCHIQ_STATE_T *state, VCHIQ_SLOT_ZERO_T *slot_zero,
 	return status;
 }
 
+/* Called with state->mutex held. Returns the group of the port, which is
+** allocated, when the port is used for the first time. */
+static VCHIQ_SERVICE_GROUP_T *
+get_service_group(VCHIQ_STATE_T *state, int port)
+{
+	VCHIQ_SERVICE_GROUP_T *group = port_to_group(state, port);
+	int i;
+
+	if (group)
+		return group;
+
+	group = kmalloc(sizeof(VCHIQ_SERVICE_GROUP_T), GFP_KERNEL);
+	if (!group)
+		return NULL;
+
+	memset(group, 0, sizeof(VCHIQ_SERVICE_GROUP_T));
+	atomic_set(&group->poll_services, 0);
+	for (i = 0; i < VCHIQ_SERVICE_GROUP_SIZE; i++)
+		sema_init(&group->quotas[i].quota_event, 0);
+
+	/* The group must be complete, before it is seen by port_to_service()
+	** without state->mutex */
+	wmb();
+	state->service_groups[port >> VCHIQ_SERVICE_GROUP_SHIFT] = group;
+
+	return group;
+}
+
 /* Called from application thread when a client or server service is created. */
 VCHIQ_SERVICE_T *
 vchiq_add_service_internal(VCHIQ_STATE_T *state,
@@ -2580,6 +2955,8 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 		service->userdata_term = userdata_term;
 		service->localport     = VCHIQ_PORT_FREE;
 		service->remoteport    = VCHIQ_PORT_FREE;
+		service->fourcc_next   = NULL;
+		service->remoteport_next = NULL;
 
 		service->public_fourcc = (srvstate == VCHIQ_SRVSTATE_OPENING) ?
 			VCHIQ_FOURCC_INVALID : params->fourcc;
@@ -2588,6 +2965,7 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 		service->sync          = 0;
 		service->closing       = 0;
 		service->trace         = 0;
+		service->priority      = VCHIQ_PRIORITY_NORMAL;
 		atomic_set(&service->poll_flags, 0);
 		service->version       = params->version;
 		service->version_min   = params->version_min;
@@ -2606,7 +2984,8 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 	}
 
 	if (service) {
-		VCHIQ_SERVICE_T **pservice = NULL;
+		VCHIQ_SERVICE_GROUP_T *group = NULL;
+		int port = -1;
 		int i;
 
 		/* Although it is perfectly possible to use service_spinlock
@@ -2623,35 +3002,44 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 
 		/* Prepare to use a previously unused service */
 		if (state->unused_service < VCHIQ_MAX_SERVICES)
-			pservice = &state->services[state->unused_service];
+			port = state->unused_service;
 
 		if (srvstate == VCHIQ_SRVSTATE_OPENING) {
 			for (i = 0; i < state->unused_service; i++) {
-				VCHIQ_SERVICE_T *srv = state->services[i];
+				VCHIQ_SERVICE_T *srv = port_to_service(state, i);
 				if (!srv) {
-					pservice = &state->services[i];
+					port = i;
 					break;
 				}
 			}
 		} else {
 			for (i = (state->unused_service - 1); i >= 0; i--) {
-				VCHIQ_SERVICE_T *srv = state->services[i];
+				VCHIQ_SERVICE_T *srv = port_to_service(state, i);
 				if (!srv)
-					pservice = &state->services[i];
+					port = i;
 				else if ((srv->public_fourcc == params->fourcc)
 					&& ((srv->instance != instance) ||
 					(srv->base.callback !=
 					params->callback))) {
 					/* There is another server using this
 					** fourcc which doesn't match. */
-					pservice = NULL;
+					port = -1;
 					break;
 				}
 			}
 		}
 
-		if (pservice) {
-			service->localport = (pservice - state->services);
+		if (port >= 0) {
+			group = get_service_group(state, port);
+			if (!group) {
+				vchiq_log_error(vchiq_core_log_level,
+					"Out of memory");
+				port = -1;
+			}
+		}
+
+		if (port >= 0) {
+			service->localport = port;
 			if (!handle_seq)
 				handle_seq = VCHIQ_MAX_STATES *
 					 VCHIQ_MAX_SERVICES;
@@ -2659,14 +3047,22 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 				(state->id * VCHIQ_MAX_SERVICES) |
 				service->localport;
 			handle_seq += VCHIQ_MAX_STATES * VCHIQ_MAX_SERVICES;
-			*pservice = service;
-			if (pservice == &state->services[state->unused_service])
+			group->services[port & VCHIQ_SERVICE_GROUP_MASK] =
+				service;
+			if (port == state->unused_service)
 				state->unused_service++;
+
+			spin_lock(&service_spinlock);
+			service->fourcc_next = state->fourcc_hash[
+				fourcc_hash(service->base.fourcc)];
+			state->fourcc_hash[fourcc_hash(service->base.fourcc)] =
+				service;
+			spin_unlock(&service_spinlock);
 		}
 
 		mutex_unlock(&state->mutex);
 
-		if (!pservice) {
+		if (port < 0) {
 			kfree(service);
 			service = NULL;
 		}
@@ -2674,7 +3070,7 @@ vchiq_add_service_internal(VCHIQ_STATE_T *state,
 
 	if (service) {
 		VCHIQ_SERVICE_QUOTA_T *service_quota =
-			&state->service_quotas[service->localport];
+			port_to_quota(state, service->localport);
 		service_quota->slot_quota = state->default_slot_quota;
 		service_quota->message_quota = state->default_message_quota;
 		if (service_quota->slot_use_count == 0)
@@ -2833,7 +3229,8 @@ close_service_complete(VCHIQ_SERVICE_T *service, int failstate)
 		if (is_server) {
 			if (service->auto_close) {
 				service->client_id = 0;
-				service->remoteport = VCHIQ_PORT_FREE;
+				set_service_remoteport(service,
+					VCHIQ_PORT_FREE);
 				newstate = VCHIQ_SRVSTATE_LISTENING;
 			} else
 				newstate = VCHIQ_SRVSTATE_CLOSEWAIT;
@@ -2864,7 +3261,7 @@ close_service_complete(VCHIQ_SERVICE_T *service, int failstate)
 			vchiq_release_service_internal(service);
 
 		service->client_id = 0;
-		service->remoteport = VCHIQ_PORT_FREE;
+		set_service_remoteport(service, VCHIQ_PORT_FREE);
 
 		if (service->srvstate == VCHIQ_SRVSTATE_CLOSED)
 			vchiq_free_service_internal(service);
@@ -2907,7 +3304,8 @@ vchiq_close_service_internal(VCHIQ_SERVICE_T *service, int close_recvd)
 				status = VCHIQ_ERROR;
 			} else {
 				service->client_id = 0;
-				service->remoteport = VCHIQ_PORT_FREE;
+				set_service_remoteport(service,
+					VCHIQ_PORT_FREE);
 				if (service->srvstate ==
 					VCHIQ_SRVSTATE_CLOSEWAIT)
 					vchiq_set_service_state(service,
@@ -3495,6 +3893,70 @@ error_exit:
 	return status;
 }
 
+/* Selects how the slot handler waits for messages. In the hybrid mode it
+** spins for spin_us microseconds, before it sleeps until the doorbell. The
+** polled mode never sleeps and yields to other threads between the polls,
+** it is meant for a core dedicated to VCHIQ. */
+void
+vchiq_set_slot_handler_mode(VCHIQ_SLOT_HANDLER_MODE_T mode,
+	unsigned int spin_us)
+{
+	slot_handler_spin_us = spin_us;
+	wmb();
+	slot_handler_mode = mode;
+}
+
+/* Queues several messages, which are published together with a single
+** signal to the peer. Returns the number of messages queued in *queued,
+** also on failure. */
+VCHIQ_STATUS_T
+vchiq_queue_messages(VCHIQ_SERVICE_HANDLE_T handle,
+	const VCHIQ_MESSAGE_T *messages, unsigned int count,
+	unsigned int *queued)
+{
+	VCHIQ_SERVICE_T *service = find_service_by_handle(handle);
+	VCHIQ_STATUS_T status = VCHIQ_ERROR;
+	unsigned int dummy;
+	unsigned int i;
+
+	if (!queued)
+		queued = &dummy;
+	*queued = 0;
+
+	if (!service ||
+		(vchiq_check_service(service) != VCHIQ_SUCCESS))
+		goto error_exit;
+
+	for (i = 0; i < count; i++) {
+		if ((messages[i].size > VCHIQ_MAX_MSG_SIZE) ||
+			((messages[i].size != 0) && !messages[i].data &&
+			 !messages[i].copy_callback)) {
+			VCHIQ_SERVICE_STATS_INC(service, error_count);
+			goto error_exit;
+		}
+	}
+
+	switch (service->srvstate) {
+	case VCHIQ_SRVSTATE_OPEN:
+		status = queue_message_batch(service->state, service,
+				VCHIQ_MAKE_MSG(VCHIQ_MSG_DATA,
+					service->localport,
+					service->remoteport),
+				messages, count, queued);
+		break;
+	default:
+		/* Synchronous services are not supported */
+		status = VCHIQ_ERROR;
+		break;
+	}
+
+error_exit:
+	if (service)
+		unlock_service(service);
+
+	return status;
+}
+
 void
 vchiq_release_message(VCHIQ_SERVICE_HANDLE_T handle, VCHIQ_HEADER_T *header)
 {
@@ -3593,8 +4055,8 @@ vchiq_set_service_option(VCHIQ_SERVICE_HANDLE_T handle,
 
 		case VCHIQ_SERVICE_OPTION_SLOT_QUOTA: {
 			VCHIQ_SERVICE_QUOTA_T *service_quota =
-				&service->state->service_quotas[
-					service->localport];
+				port_to_quota(service->state,
+					service->localport);
 			if (value == 0)
 				value = service->state->default_slot_quota;
 			if ((value >= service_quota->slot_use_count) &&
@@ -3613,8 +4075,8 @@ vchiq_set_service_option(VCHIQ_SERVICE_HANDLE_T handle,
 
 		case VCHIQ_SERVICE_OPTION_MESSAGE_QUOTA: {
 			VCHIQ_SERVICE_QUOTA_T *service_quota =
-				&service->state->service_quotas[
-					service->localport];
+				port_to_quota(service->state,
+					service->localport);
 			if (value == 0)
 				value = service->state->default_message_quota;
 			if ((value >= service_quota->message_use_count) &&
@@ -3645,6 +4107,14 @@ vchiq_set_service_option(VCHIQ_SERVICE_HANDLE_T handle,
 			status = VCHIQ_SUCCESS;
 			break;
 
+		case VCHIQ_SERVICE_OPTION_PRIORITY:
+			if ((value >= VCHIQ_PRIORITY_REALTIME) &&
+				(value < VCHIQ_PRIORITY_COUNT)) {
+				service->priority = value;
+				status = VCHIQ_SUCCESS;
+			}
+			break;
+
 		default:
 			break;
 		}
@@ -3736,16 +4206,29 @@ vchiq_dump_state(void *dump_context, VCHIQ_STATE_T *state)
 			state->stats.ctrl_tx_count, state->stats.ctrl_rx_count,
 			state->stats.error_count);
 		vchiq_dump(dump_context, buf, len + 1);
+
+		len = snprintf(buf, sizeof(buf),
+			"  Wakeups: %d by poll, %d by event",
+			state->stats.poll_wakeups, state->stats.event_wakeups);
+		vchiq_dump(dump_context, buf, len + 1);
 	}
 
 	len = snprintf(buf, sizeof(buf),
 		"  Slots: %d available (%d data), %d recyclable, %d stalls "
-		"(%d data)",
+		"(%d data, %d quota)",
 		((state->slot_queue_available * VCHIQ_SLOT_SIZE) -
 			state->local_tx_pos) / VCHIQ_SLOT_SIZE,
 		state->data_quota - state->data_use_count,
 		state->local->slot_queue_recycle - state->slot_queue_available,
-		state->stats.slot_stalls, state->stats.data_stalls);
+		state->stats.slot_stalls, state->stats.data_stalls,
+		state->stats.quota_stalls);
+	vchiq_dump(dump_context, buf, len + 1);
+
+	len = snprintf(buf, sizeof(buf),
+		"  Data stalls: %d realtime, %d normal, %d background",
+		state->stats.class_stalls[VCHIQ_PRIORITY_REALTIME],
+		state->stats.class_stalls[VCHIQ_PRIORITY_NORMAL],
+		state->stats.class_stalls[VCHIQ_PRIORITY_BACKGROUND]);
 	vchiq_dump(dump_context, buf, len + 1);
 
 	vchiq_dump_platform_state(dump_context);
@@ -3778,7 +4261,7 @@ vchiq_dump_service_state(void *dump_context, VCHIQ_SERVICE_T *service)
 	if (service->srvstate != VCHIQ_SRVSTATE_FREE) {
 		char remoteport[30];
 		VCHIQ_SERVICE_QUOTA_T *service_quota =
-			&service->state->service_quotas[service->localport];
+			port_to_quota(service->state, service->localport);
 		int fourcc = service->base.fourcc;
 		int tx_pending, rx_pending;
 		if (service->remoteport != VCHIQ_PORT_FREE) {
@@ -3841,9 +4324,12 @@ vchiq_dump_service_state(void *dump_context, VCHIQ_SERVICE_T *service)
 
 			len = snprintf(buf, sizeof(buf),
 				"  %d quota stalls, %d slot stalls, "
+				"%d data stalls (prio %d), "
 				"%d bulk stalls, %d aborted, %d errors",
 				service->stats.quota_stalls,
 				service->stats.slot_stalls,
+				service->stats.data_stalls,
+				service->priority,
 				service->stats.bulk_stalls,
 				service->stats.bulk_aborted_count,
 				service->stats.error_count);
@@ -152,6 +152,9 @@ typedef uint32_t BITSET_T;
 
 vchiq_static_assert((sizeof(BITSET_T) * 8) == 32);
 
+/* Number of buckets of the service lookup tables, must be a power of two */
+#define VCHIQ_SERVICE_HASH_SIZE        32
+
 #define BITSET_SIZE(b)        ((b + 31) >> 5)
 #define BITSET_WORD(b)        (b >> 5)
 #define BITSET_BIT(b)         (1 << (b & 31))
@@ -302,11 +305,14 @@ typedef struct vchiq_service_struct {
 	unsigned int localport;
 	unsigned int remoteport;
 	int public_fourcc;
+	struct vchiq_service_struct *fourcc_next;	/* hash chains of */
+	struct vchiq_service_struct *remoteport_next;	/* vchiq_state_struct */
 	int client_id;
 	char auto_close;
 	char sync;
 	char closing;
 	char trace;
+	char priority;		/* VCHIQ_PRIORITY_T */
 	atomic_t poll_flags;
 	short version;
 	short version_min;
@@ -327,6 +333,7 @@ typedef struct vchiq_service_struct {
 	struct service_stats_struct {
 		int quota_stalls;
 		int slot_stalls;
+		int data_stalls;	/* waits for the data quota of the class */
 		int bulk_stalls;
 		int error_count;
 		int ctrl_tx_count;
@@ -354,6 +361,24 @@ typedef struct vchiq_service_quota_struct {
 	int previous_tx_index;
 } VCHIQ_SERVICE_QUOTA_T;
 
+/* The services and their quotas are kept in groups of 32 ports, which are
+	allocated on demand, when the first service with a port in the group is
+	created. A group is never freed, so that the quota of a port persists. */
+#define VCHIQ_SERVICE_GROUP_SHIFT	5
+#define VCHIQ_SERVICE_GROUP_SIZE	(1 << VCHIQ_SERVICE_GROUP_SHIFT)
+#define VCHIQ_SERVICE_GROUP_MASK	(VCHIQ_SERVICE_GROUP_SIZE - 1)
+#define VCHIQ_SERVICE_GROUPS \
+	(VCHIQ_MAX_SERVICES >> VCHIQ_SERVICE_GROUP_SHIFT)
+
+typedef struct vchiq_service_group_struct {
+	VCHIQ_SERVICE_T *services[VCHIQ_SERVICE_GROUP_SIZE];
+
+	/* A bit set indicating which services must be polled. */
+	atomic_t poll_services;
+
+	VCHIQ_SERVICE_QUOTA_T quotas[VCHIQ_SERVICE_GROUP_SIZE];
+} VCHIQ_SERVICE_GROUP_T;
+
 typedef struct vchiq_shared_state_struct {
 
 	/* A non-zero value here indicates that the content is valid. */
@@ -469,6 +494,9 @@ struct vchiq_state_struct {
 	** remote->slot_queue. */
 	int rx_pos;
 
+	/* The remote tx_pos at the last wakeup of the slot handler */
+	int poll_tx_pos;
+
 	/* A cached copy of local->tx_pos. Only write to local->tx_pos, and read
 		from remote->tx_pos. */
 	int local_tx_pos;
@@ -488,8 +516,9 @@ struct vchiq_state_struct {
 	/* The maximum number of slots to be occupied by data messages. */
 	unsigned short data_quota;
 
-	/* An array of bit sets indicating which services must be polled. */
-	atomic_t poll_services[BITSET_SIZE(VCHIQ_MAX_SERVICES)];
+	/* The data_use_count, from which on a priority class must wait. The
+	** realtime class may use the whole data_quota. */
+	unsigned short data_class_limit[VCHIQ_PRIORITY_COUNT];
 
 	/* The number of the first unused service */
 	int unused_service;
@@ -499,8 +528,8 @@ struct vchiq_state_struct {
 
 	struct semaphore slot_remove_event;
 
-	/* Signalled when a free data slot becomes available. */
-	struct semaphore data_quota_event;
+	/* Signalled when a free data slot becomes available for a class. */
+	struct semaphore data_quota_event[VCHIQ_PRIORITY_COUNT];
 
 	/* Incremented when there are bulk transfers which cannot be processed
 	 * whilst paused and must be processed on resume */
@@ -509,13 +538,24 @@ struct vchiq_state_struct {
 	struct state_stats_struct {
 		int slot_stalls;
 		int data_stalls;
+		int class_stalls[VCHIQ_PRIORITY_COUNT];	/* data stalls */
+		int quota_stalls;	/* of all services */
 		int ctrl_tx_count;
 		int ctrl_rx_count;
 		int error_count;
+		int msg_tx_count;	/* all messages incl. data */
+		int poll_wakeups;	/* slot handler found work by polling */
+		int event_wakeups;	/* slot handler woken by the event */
 	} stats;
 
-	VCHIQ_SERVICE_T * services[VCHIQ_MAX_SERVICES];
-	VCHIQ_SERVICE_QUOTA_T service_quotas[VCHIQ_MAX_SERVICES];
+	/* The services by their local port, see port_to_service() */
+	VCHIQ_SERVICE_GROUP_T *service_groups[VCHIQ_SERVICE_GROUPS];
+
+	/* Services hashed by their fourcc and by their remote port (if not
+	 * VCHIQ_PORT_FREE), protected by service_spinlock. */
+	VCHIQ_SERVICE_T *fourcc_hash[VCHIQ_SERVICE_HASH_SIZE];
+	VCHIQ_SERVICE_T *remoteport_hash[VCHIQ_SERVICE_HASH_SIZE];
+
 	VCHIQ_SLOT_INFO_T slot_info[VCHIQ_MAX_SLOTS];
 
 	VCHIQ_PLATFORM_STATE_T platform_state;
@@ -545,6 +585,9 @@ extern VCHIQ_STATUS_T
 vchiq_init_state(VCHIQ_STATE_T *state, VCHIQ_SLOT_ZERO_T *slot_zero,
 	int is_master);
 
+extern VCHIQ_STATUS_T
+vchiq_set_data_quota(VCHIQ_STATE_T *state, int data_quota);
+
 extern VCHIQ_STATUS_T
 vchiq_connect_internal(VCHIQ_STATE_T *state, VCHIQ_INSTANCE_T instance);
 
@@ -597,6 +640,34 @@ vchiq_loud_error_footer(void);
 extern void
 request_poll(VCHIQ_STATE_T *state, VCHIQ_SERVICE_T *service, int poll_type);
 
+static inline VCHIQ_SERVICE_GROUP_T *
+port_to_group(VCHIQ_STATE_T *state, unsigned int port)
+{
+	return state->service_groups[(port >> VCHIQ_SERVICE_GROUP_SHIFT) &
+		(VCHIQ_SERVICE_GROUPS - 1)];
+}
+
+static inline VCHIQ_SERVICE_T *
+port_to_service(VCHIQ_STATE_T *state, unsigned int port)
+{
+	VCHIQ_SERVICE_GROUP_T *group = port_to_group(state, port);
+	if (!group)
+		return NULL;
+
+	return group->services[port & VCHIQ_SERVICE_GROUP_MASK];
+}
+
+/* Returns NULL, if no service has ever used this port */
+static inline VCHIQ_SERVICE_QUOTA_T *
+port_to_quota(VCHIQ_STATE_T *state, unsigned int port)
+{
+	VCHIQ_SERVICE_GROUP_T *group = port_to_group(state, port);
+	if (!group)
+		return NULL;
+
+	return &group->quotas[port & VCHIQ_SERVICE_GROUP_MASK];
+}
+
 static inline VCHIQ_SERVICE_T *
 handle_to_service(VCHIQ_SERVICE_HANDLE_T handle)
 {
@@ -605,7 +676,7 @@ handle_to_service(VCHIQ_SERVICE_HANDLE_T handle)
 	if (!state)
 		return NULL;
 
-	return state->services[handle & (VCHIQ_MAX_SERVICES - 1)];
+	return port_to_service(state, handle & (VCHIQ_MAX_SERVICES - 1));
 }
 
 extern VCHIQ_SERVICE_T *
@@ -83,9 +83,20 @@ typedef enum {
 	VCHIQ_SERVICE_OPTION_SLOT_QUOTA,
 	VCHIQ_SERVICE_OPTION_MESSAGE_QUOTA,
 	VCHIQ_SERVICE_OPTION_SYNCHRONOUS,
-	VCHIQ_SERVICE_OPTION_TRACE
+	VCHIQ_SERVICE_OPTION_TRACE,
+	VCHIQ_SERVICE_OPTION_PRIORITY
 } VCHIQ_SERVICE_OPTION_T;
 
+/* Transmit priority classes (VCHIQ_SERVICE_OPTION_PRIORITY). When data slots
+** are scarce, the lower classes stall first, leaving the last slots to the
+** higher ones. */
+typedef enum {
+	VCHIQ_PRIORITY_REALTIME,
+	VCHIQ_PRIORITY_NORMAL,		/* default */
+	VCHIQ_PRIORITY_BACKGROUND,
+	VCHIQ_PRIORITY_COUNT
+} VCHIQ_PRIORITY_T;
+
 typedef struct vchiq_header_struct {
 	/* The message identifier - opaque to applications. */
 	int msgid;
@@ -103,6 +114,45 @@ typedef struct {
 
 typedef unsigned long VCHIQ_SERVICE_HANDLE_T;
 
+/* Writes up to maxsize bytes of message data, starting at offset, to dest.
+** Returns the number of bytes written (> 0), or a negative error code. */
+typedef int (*VCHIQ_COPY_CALLBACK_T)(void *context, void *dest,
+	unsigned int offset, unsigned int maxsize);
+
+/* One message of vchiq_queue_messages(). The data is produced by
+** copy_callback, if it is not NULL, and copied from data otherwise. */
+typedef struct {
+	const void *data;
+	VCHIQ_COPY_CALLBACK_T copy_callback;
+	void *context;
+	unsigned int size;
+} VCHIQ_MESSAGE_T;
+
+/* How the slot handler thread waits for messages from the VPU */
+typedef enum {
+	VCHIQ_SLOT_HANDLER_INTERRUPT,	/* sleep until the doorbell (default) */
+	VCHIQ_SLOT_HANDLER_HYBRID,	/* spin for a while, then sleep */
+	VCHIQ_SLOT_HANDLER_POLLED	/* poll, yielding to other threads */
+} VCHIQ_SLOT_HANDLER_MODE_T;
+
+/* Counters of the doorbell to the VPU, see vchiq_get_doorbell_stats() */
+typedef struct {
+	unsigned int messages;	/* queued to the VPU */
+	unsigned int signals;	/* events signalled to the VPU */
+	unsigned int doorbells;	/* interrupts triggered on the VPU */
+	unsigned int coalesced;	/* event still pending, no doorbell needed */
+	unsigned int deferred;	/* doorbell delayed by a burst or the window */
+} VCHIQ_DOORBELL_STATS_T;
+
+/* Slot configuration and usage, see vchiq_get_slot_stats() */
+typedef struct {
+	unsigned int slots_per_side;	/* incl. the sync slot */
+	unsigned int data_quota;	/* slots usable for data messages */
+	unsigned int slot_stalls;	/* waits for a free slot */
+	unsigned int data_stalls;	/* waits for the data quota */
+	unsigned int quota_stalls;	/* waits for the quota of a service */
+} VCHIQ_SLOT_STATS_T;
+
 typedef VCHIQ_STATUS_T (*VCHIQ_CALLBACK_T)(VCHIQ_REASON_T, VCHIQ_HEADER_T *,
 	VCHIQ_SERVICE_HANDLE_T, void *);
 
@@ -152,6 +202,19 @@ extern VCHIQ_STATUS_T vchiq_release_service(VCHIQ_SERVICE_HANDLE_T service);
 
 extern VCHIQ_STATUS_T vchiq_queue_message(VCHIQ_SERVICE_HANDLE_T service,
 	const VCHIQ_ELEMENT_T *elements, unsigned int count);
+extern VCHIQ_STATUS_T vchiq_queue_messages(VCHIQ_SERVICE_HANDLE_T service,
+	const VCHIQ_MESSAGE_T *messages, unsigned int count,
+	unsigned int *queued);
+extern void           vchiq_set_slot_handler_mode(
+	VCHIQ_SLOT_HANDLER_MODE_T mode, unsigned int spin_us);
+extern void           vchiq_hold_doorbell(void);
+extern void           vchiq_release_doorbell(void);
+extern void           vchiq_set_doorbell_window(unsigned int window_us);
+extern void           vchiq_get_doorbell_stats(VCHIQ_DOORBELL_STATS_T *stats);
+extern VCHIQ_STATUS_T vchiq_set_slot_config(unsigned int slots_per_side,
+	unsigned int data_quota);
+extern unsigned int   vchiq_get_slot_mem_size(void);
+extern void           vchiq_get_slot_stats(VCHIQ_SLOT_STATS_T *stats);
 extern void           vchiq_release_message(VCHIQ_SERVICE_HANDLE_T service,
 	VCHIQ_HEADER_T *header);
 extern VCHIQ_STATUS_T vchiq_queue_bulk_transmit(VCHIQ_SERVICE_HANDLE_T service,
@@ -195,6 +195,62 @@ int32_t vchi_msg_queue(VCHI_SERVICE_HANDLE_T handle,
 }
 EXPORT_SYMBOL(vchi_msg_queue);
 
+/***********************************************************
+ * Name: vchi_msg_queue_batch
+ *
+ * Arguments:  VCHI_SERVICE_HANDLE_T handle,
+ *             const VCHI_MSG_BATCH_T *batch,
+ *             uint32_t count
+ *
+ * Description: Queue several messages onto a connection in order. All
+ *              messages are queued with one acquisition of the slot mutex
+ *              and a single signal to the peer. If the batch has to wait
+ *              for free slots, the messages written so far are published
+ *              before. A copy_callback writes its data directly into the
+ *              slot memory and must not queue messages itself.
+ *
+ * Returns: int32_t - success == 0
+ *
+ ***********************************************************/
+
+vchiq_static_assert(sizeof(VCHI_MSG_BATCH_T) == sizeof(VCHIQ_MESSAGE_T));
+vchiq_static_assert(offsetof(VCHI_MSG_BATCH_T, data) ==
+	offsetof(VCHIQ_MESSAGE_T, data));
+vchiq_static_assert(offsetof(VCHI_MSG_BATCH_T, copy_callback) ==
+	offsetof(VCHIQ_MESSAGE_T, copy_callback));
+vchiq_static_assert(offsetof(VCHI_MSG_BATCH_T, context) ==
+	offsetof(VCHIQ_MESSAGE_T, context));
+vchiq_static_assert(offsetof(VCHI_MSG_BATCH_T, data_size) ==
+	offsetof(VCHIQ_MESSAGE_T, size));
+
+int32_t vchi_msg_queue_batch(VCHI_SERVICE_HANDLE_T handle,
+	const VCHI_MSG_BATCH_T *batch,
+	uint32_t count)
+{
+	SHIM_SERVICE_T *service = (SHIM_SERVICE_T *)handle;
+	const VCHIQ_MESSAGE_T *messages = (const VCHIQ_MESSAGE_T *)batch;
+	VCHIQ_STATUS_T status;
+	unsigned int pos = 0;
+	unsigned int queued;
+
+	status = vchiq_queue_messages(service->handle, messages, count,
+		&queued);
+
+	/* The messages, which have not been queued, are retried. Once a part
+	** of the batch has been published, the rest must follow at once, so
+	** that the peer does not wait in the middle of it. */
+	while (status == VCHIQ_RETRY) {
+		pos += queued;
+		if (pos == 0)
+			msleep(1);
+		status = vchiq_queue_messages(service->handle, messages + pos,
+			count - pos, &queued);
+	}
+
+	return vchiq_status_to_vchi(status);
+}
+EXPORT_SYMBOL(vchi_msg_queue_batch);
+
 /***********************************************************
  * Name: vchi_bulk_queue_receive
  *
@@ -749,6 +805,15 @@ int32_t vchi_service_set_option(const VCHI_SERVICE_HANDLE_T handle,
 	case VCHI_SERVICE_OPTION_SYNCHRONOUS:
 		vchiq_option = VCHIQ_SERVICE_OPTION_SYNCHRONOUS;
 		break;
+	case VCHI_SERVICE_OPTION_SLOT_QUOTA:
+		vchiq_option = VCHIQ_SERVICE_OPTION_SLOT_QUOTA;
+		break;
+	case VCHI_SERVICE_OPTION_MESSAGE_QUOTA:
+		vchiq_option = VCHIQ_SERVICE_OPTION_MESSAGE_QUOTA;
+		break;
+	case VCHI_SERVICE_OPTION_PRIORITY:
+		vchiq_option = VCHIQ_SERVICE_OPTION_PRIORITY;
+		break;
 	default:
 		service = NULL;
 		break;
@@ -2,6 +2,7 @@
 // vchiqdevice.cpp
 //
 #include <vc4/vchiq/vchiqdevice.h>
+#include <vc4/vchiq/vchiq_if.h>
 
 // circle/bcm2835.h
 #if RASPPI == 1
@@ -49,7 +50,7 @@ static inline void CVCHIQDevice_SetDMAMemory (
     _this->m_PlatformDevice.dev.dma_mem.flags = IORESOURCE_DMA;
 }
 
-boolean CVCHIQDevice_Initialize (CVCHIQDevice *_this)
+boolean CVCHIQDevice_Initialize (CVCHIQDevice *_this, unsigned nSlotsPerSide, unsigned nDataQuota)
 {
     // CVCHIQDevice::CVCHIQDevice()
     memset (&_this->m_PlatformDevice, 0, sizeof _this->m_PlatformDevice);
@@ -59,14 +60,21 @@ boolean CVCHIQDevice_Initialize (CVCHIQDevice *_this)
     CVCHIQDevice_AddResource (_this, ARM_VCHIQ_BASE, ARM_VCHIQ_END, IORESOURCE_MEM);
     CVCHIQDevice_AddResource (_this, ARM_IRQ_ARM_DOORBELL_0, ARM_IRQ_ARM_DOORBELL_0, IORESOURCE_IRQ);
 
-    uintptr start = (uintptr) GetCoherentRegion512K ();
-    CVCHIQDevice_SetDMAMemory (_this, start, start + 524287);
-
     // CVCHIQDevice::Initialize()
     if (linuxemu_init () != 0)
     {
         return FALSE;
     }
 
+    if (vchiq_set_slot_config (nSlotsPerSide, nDataQuota) != VCHIQ_SUCCESS)
+    {
+        return FALSE;
+    }
+
+    // only the memory needed for the configured slots is used, the rest of the region
+    // stays reserved (it is part of the memory map of the environment)
+    uintptr start = (uintptr) GetCoherentRegion512K ();
+    CVCHIQDevice_SetDMAMemory (_this, start, start + vchiq_get_slot_mem_size () - 1);
+
     return vchiq_probe (&_this->m_PlatformDevice) == 0 ? TRUE : FALSE;
 }
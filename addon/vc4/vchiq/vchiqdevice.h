@@ -15,7 +15,14 @@ typedef struct CVCHIQDevice_s
     struct platform_device m_PlatformDevice;
 } CVCHIQDevice;
 
-boolean CVCHIQDevice_Initialize (CVCHIQDevice *_this);
+// nSlotsPerSide: number of 4K slots for each direction (5..63, 0 for the default of 32)
+// nDataQuota: maximum number of slots used for data messages (0 for all but one)
+// The slots and the fragment pool for bulk transfers must fit into the coherent region of
+// 512K (at most 63 slots per side on the Raspberry Pi 1, 62 on later models). Only their
+// size is used from the start of the region, see vchiq_get_slot_mem_size(). The region is
+// a fixed part of the memory map, so the rest is not returned and stays reserved. Fewer
+// slots reduce the memory VCHIQ touches, not the memory reserved for it.
+boolean CVCHIQDevice_Initialize (CVCHIQDevice *_this, unsigned nSlotsPerSide, unsigned nDataQuota);
 
 #ifdef __cplusplus
 }